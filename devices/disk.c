@@ -3,13 +3,57 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include "devices/pci.h"
+#include "devices/ramdisk.h"
 #include "devices/timer.h"
+#include "devices/virtio-blk.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].
+
+   Where the controller is a PCI IDE function with bus-master DMA,
+   as QEMU's PIIX3 is, data moves by DMA: the driver describes the
+   buffers in a table of physical regions, and the controller
+   copies the data to or from them on its own while the thread
+   waiting for the transfer sleeps.  Transfers that DMA cannot
+   serve, because a buffer is misaligned or out of reach, or that
+   fail, are done again in PIO mode, with the CPU copying every
+   word through the data register.
+
+   Requests do not go to the disk in the order they are made.
+   Each channel has a queue of requests, kept in sector order, and
+   a dispatcher thread that alone drives the controller.  It takes
+   requests off the queue in elevator (C-LOOK) order, sweeping
+   upward from where the last command ended and then starting
+   over from the lowest sector, except that a request that has
+   waited DEADLINE_TICKS is served first.  Requests for the
+   sectors right after one another, on the same disk and in the
+   same direction, are merged into one command.  disk_read() and
+   friends submit a request and wait for it; disk_submit() lets a
+   caller queue many and wait for them afterward.
+
+   A disk slot that has no ATA disk may instead be backed by a
+   virtio block device (see virtio-blk.c), which takes requests
+   straight from disk_submit() and keeps many in flight at once.
+   A device whose ID string names a slot, e.g. "hd0:1", goes
+   there; any other takes the first free slot after hd0:0.
+
+   Finally, the -rd option can name disks to be copied into RAM at
+   boot and served from there (see ramdisk.c).  Writes to such a
+   disk are lost at power off.
+
+   Every disk keeps statistics on its requests: sectors moved by
+   each class of I/O (see enum disk_io_class), how many requests
+   started where the one before ended, and histograms of the time
+   each request spent queued and being served by the device. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -32,6 +76,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -47,6 +92,50 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Bus master IDE port addresses, relative to a channel's
+   BM_BASE. */
+#define BM_COMMAND 0            /* Command. */
+#define BM_STATUS 2             /* Status. */
+#define BM_PRDT 4               /* Physical address of PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits.  IRQ and ERR are cleared by
+   writing 1 to them. */
+#define BM_STA_ERR 0x02         /* Transfer failed. */
+#define BM_STA_IRQ 0x04         /* Interrupt raised. */
+
+/* A physical region descriptor, an entry in a PRD table.  Each
+   describes up to 64 kB of physically contiguous memory that
+   does not cross a 64 kB boundary. */
+struct prd {
+	uint32_t addr;              /* Physical address, even. */
+	uint16_t size;              /* Size in bytes, 0 for 64 kB. */
+	uint16_t flags;             /* PRD_EOT on the last entry. */
+};
+#define PRD_EOT 0x8000
+
+/* Entries in a channel's one-page PRD table. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
+
+/* Most sectors one READ SECTOR or WRITE SECTOR command can move.
+   A sector count of 0 in the command block asks for this many. */
+#define MAX_CMD_SECTORS 256
+
+/* Ticks a request may wait before it is served ahead of the
+   elevator order. */
+#define DEADLINE_TICKS 10
+
+/* Latency histograms.  Bucket I counts requests that took less
+   than 2**(I + DISK_HIST_SHIFT) TSC cycles; the last bucket also
+   takes everything slower. */
+#define DISK_HIST_SHIFT 10
+#define DISK_HIST_CNT 24
 
 /* An ATA device. */
 struct disk {
@@ -56,9 +145,20 @@ struct disk {
 
 	bool is_ata;                /* 1=This device is an ATA disk. */
 	disk_sector_t capacity;     /* Capacity in sectors (if is_ata). */
+	bool dma;                   /* Supports DMA (if is_ata)? */
+	struct virtio_blk *vblk;    /* Virtio device, if not is_ata. */
+	struct ramdisk *rd;         /* RAM copy serving requests, or null. */
 
 	long long read_cnt;         /* Number of sectors read. */
 	long long write_cnt;        /* Number of sectors written. */
+
+	/* Statistics, updated with interrupts off. */
+	long long class_cnt[DISK_IO_CLASS_CNT][2];  /* Sectors read, written. */
+	disk_sector_t next_sector;  /* Sector after the last request. */
+	long long seq_cnt;          /* Requests starting at NEXT_SECTOR. */
+	long long random_cnt;       /* Other requests. */
+	long long wait_hist[DISK_HIST_CNT];     /* Submission to start. */
+	long long service_hist[DISK_HIST_CNT];  /* Start to completion. */
 };
 
 /* An ATA channel (aka controller).
@@ -68,14 +168,27 @@ struct channel {
 	uint16_t reg_base;          /* Base I/O port. */
 	uint8_t irq;                /* Interrupt in use. */
 
-	struct lock lock;           /* Must acquire to access the controller. */
+	struct lock lock;           /* Protects QUEUE and HEAD. */
+	struct list queue;          /* Pending requests, in sector order. */
+	struct condition queue_ready;   /* Signaled when a request is queued. */
+	uint64_t head;              /* Request key where the last command ended. */
+	/* Used only by the dispatcher. */
+	struct disk_request *batch[MAX_CMD_SECTORS];    /* Merged requests. */
+	void *bufs[MAX_CMD_SECTORS];    /* Sector buffers for the command. */
+
 	bool expecting_interrupt;   /* True if an interrupt is expected, false if
 								   any interrupt would be spurious. */
 	struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+	uint16_t bm_base;           /* Bus master I/O base, 0 if no DMA. */
+	struct prd *prdt;           /* PRD table, if BM_BASE is nonzero. */
+
 	struct disk devices[2];     /* The devices on this channel. */
 };
 
+/* -rd: disks to serve from RAM, e.g. "hd0:1,hd1:1", or null. */
+const char *disk_ramdisk_slots;
+
 /* We support the two "legacy" ATA channels found in a standard PC. */
 #define CHANNEL_CNT 2
 static struct channel channels[CHANNEL_CNT];
@@ -83,8 +196,27 @@ static struct channel channels[CHANNEL_CNT];
 static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
-
-static void select_sector (struct disk *, disk_sector_t);
+static void print_capacity (const struct disk *);
+
+static void dma_init (void);
+static void virtio_init (void);
+static void ramdisk_init (void);
+static struct disk *parse_slot (const char *);
+static uint64_t request_key (const struct disk_request *);
+static bool request_less (const struct list_elem *, const struct list_elem *,
+		void *);
+static struct disk_request *request_next (struct channel *);
+static void **request_buffers (const struct disk_request *, size_t ofs,
+		size_t cnt, void **bufs);
+static void dispatcher (void *);
+static void transfer (struct disk_request *);
+static void issue (struct disk *, disk_sector_t, size_t cnt, bool write,
+		void *const buffers[]);
+static bool dma_transfer (struct disk *, disk_sector_t, size_t cnt,
+		bool write, void *const buffers[]);
+static void pio_transfer (struct disk *, disk_sector_t, size_t cnt,
+		bool write, void *const buffers[]);
+static void select_sector (struct disk *, disk_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -95,6 +227,8 @@ static void select_device (const struct disk *);
 static void select_device_wait (const struct disk *);
 
 static void interrupt_handler (struct intr_frame *);
+static void record_latency (long long hist[], uint64_t cycles);
+static void print_hist (const char *name, const long long hist[]);
 
 /* Initialize the disk subsystem and detect disks. */
 void
@@ -120,8 +254,13 @@ disk_init (void) {
 				NOT_REACHED ();
 		}
 		lock_init (&c->lock);
+		list_init (&c->queue);
+		cond_init (&c->queue_ready);
+		c->head = 0;
 		c->expecting_interrupt = false;
 		sema_init (&c->completion_wait, 0);
+		c->bm_base = 0;
+		c->prdt = NULL;
 
 		/* Initialize devices. */
 		for (dev_no = 0; dev_no < 2; dev_no++) {
@@ -132,6 +271,9 @@ disk_init (void) {
 
 			d->is_ata = false;
 			d->capacity = 0;
+			d->dma = false;
+			d->vblk = NULL;
+			d->rd = NULL;
 
 			d->read_cnt = d->write_cnt = 0;
 		}
@@ -152,6 +294,24 @@ disk_init (void) {
 				identify_ata_device (&c->devices[dev_no]);
 	}
 
+	dma_init ();
+	virtio_init ();
+
+	/* Start a dispatcher for each channel with a disk on it. */
+	for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++) {
+		struct channel *c = &channels[chan_no];
+		char name[16];
+
+		if (c->devices[0].is_ata || c->devices[1].is_ata) {
+			snprintf (name, sizeof name, "%s-io", c->name);
+			thread_create (name, PRI_MAX, dispatcher, c);
+		}
+	}
+
+	/* Copying a disk into RAM reads it through its channel's
+	   queue, so the dispatchers must be running first. */
+	ramdisk_init ();
+
 	/* DO NOT MODIFY BELOW LINES. */
 	register_disk_inspect_intr ();
 }
@@ -166,9 +326,23 @@ disk_print_stats (void) {
 
 		for (dev_no = 0; dev_no < 2; dev_no++) {
 			struct disk *d = disk_get (chan_no, dev_no);
-			if (d != NULL && d->is_ata)
-				printf ("%s: %lld reads, %lld writes\n",
-						d->name, d->read_cnt, d->write_cnt);
+			int class;
+
+			if (d == NULL)
+				continue;
+			printf ("%s: %lld reads, %lld writes\n",
+					d->name, d->read_cnt, d->write_cnt);
+			if (d->seq_cnt + d->random_cnt == 0)
+				continue;
+			printf ("  %lld sequential, %lld random requests\n",
+					d->seq_cnt, d->random_cnt);
+			for (class = 0; class < DISK_IO_CLASS_CNT; class++)
+				if (d->class_cnt[class][0] + d->class_cnt[class][1] != 0)
+					printf ("  %s: %lld reads, %lld writes\n",
+							disk_io_class_name (class), d->class_cnt[class][0],
+							d->class_cnt[class][1]);
+			print_hist ("queue wait", d->wait_hist);
+			print_hist ("service", d->service_hist);
 		}
 	}
 }
@@ -188,12 +362,23 @@ disk_get (int chan_no, int dev_no) {
 
 	if (chan_no < (int) CHANNEL_CNT) {
 		struct disk *d = &channels[chan_no].devices[dev_no];
-		if (d->is_ata)
+		if (d->is_ata || d->vblk != NULL)
 			return d;
 	}
 	return NULL;
 }
 
+/* Returns the disk that NAME, e.g. "hd1:1", names, or a null
+   pointer if NAME is not a slot name or there is no disk there. */
+struct disk *
+disk_get_by_name (const char *name) {
+	struct disk *d = parse_slot (name);
+
+	if (d != NULL && (d->is_ata || d->vblk != NULL))
+		return d;
+	return NULL;
+}
+
 /* Returns the size of disk D, measured in DISK_SECTOR_SIZE-byte
    sectors. */
 disk_sector_t
@@ -209,21 +394,7 @@ disk_size (struct disk *d) {
    per-disk locking is unneeded. */
 void
 disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) {
-	struct channel *c;
-
-	ASSERT (d != NULL);
-	ASSERT (buffer != NULL);
-
-	c = d->channel;
-	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
-	issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-	sema_down (&c->completion_wait);
-	if (!wait_while_busy (d))
-		PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-	input_sector (c, buffer);
-	d->read_cnt++;
-	lock_release (&c->lock);
+	disk_read_multiple (d, sec_no, buffer, 1);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -233,23 +404,593 @@ disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) {
    per-disk locking is unneeded. */
 void
 disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer) {
-	struct channel *c;
+	disk_write_multiple (d, sec_no, buffer, 1);
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFER, which must have room for CNT * DISK_SECTOR_SIZE bytes.
+   Issues one command per MAX_CMD_SECTORS sectors, rather than one
+   per sector as disk_read() would. */
+void
+disk_read_multiple (struct disk *d, disk_sector_t sec_no, void *buffer,
+		size_t cnt) {
+	struct disk_request r;
+
+	disk_request_init (&r, d, sec_no, cnt, false, buffer);
+	disk_submit (&r);
+	disk_wait (&r);
+}
 
+/* Writes CNT sectors from BUFFER to disk D, starting at sector
+   SEC_NO, as disk_read_multiple() reads them. */
+void
+disk_write_multiple (struct disk *d, disk_sector_t sec_no,
+		const void *buffer, size_t cnt) {
+	struct disk_request r;
+
+	disk_request_init (&r, d, sec_no, cnt, true, (void *) buffer);
+	disk_submit (&r);
+	disk_wait (&r);
+}
+
+/* Like disk_read_multiple(), but reads sector SEC_NO + I into
+   BUFFERS[I], each of which must have room for DISK_SECTOR_SIZE
+   bytes. */
+void
+disk_readv (struct disk *d, disk_sector_t sec_no, void *const buffers[],
+		size_t cnt) {
+	struct disk_request r;
+
+	disk_request_init (&r, d, sec_no, cnt, false, NULL);
+	r.buffers = buffers;
+	disk_submit (&r);
+	disk_wait (&r);
+}
+
+/* Like disk_write_multiple(), but writes sector SEC_NO + I from
+   BUFFERS[I]. */
+void
+disk_writev (struct disk *d, disk_sector_t sec_no,
+		const void *const buffers[], size_t cnt) {
+	struct disk_request r;
+
+	disk_request_init (&r, d, sec_no, cnt, true, NULL);
+	r.buffers = (void *const *) buffers;
+	disk_submit (&r);
+	disk_wait (&r);
+}
+
+/* Initializes R to move the CNT sectors starting at SEC_NO
+   between disk D and BUFFER, which must have room for CNT *
+   DISK_SECTOR_SIZE bytes, writing them if WRITE is true or else
+   reading them.  Afterward, the caller may set R->BUFFERS to
+   give each sector a buffer of its own instead, R->CALLBACK to
+   be called when R completes instead of using disk_wait(), or
+   R->IO_CLASS, which starts out as the current thread's class. */
+void
+disk_request_init (struct disk_request *r, struct disk *d,
+		disk_sector_t sec_no, size_t cnt, bool write, void *buffer) {
 	ASSERT (d != NULL);
-	ASSERT (buffer != NULL);
+	ASSERT (cnt > 0);
+	ASSERT (sec_no + cnt <= d->capacity);
+
+	r->disk = d;
+	r->sector = sec_no;
+	r->cnt = cnt;
+	r->write = write;
+	r->buffer = buffer;
+	r->buffers = NULL;
+	r->callback = NULL;
+	r->aux = NULL;
+	r->io_class = disk_io_class_get ();
+	sema_init (&r->done, 0);
+}
 
-	c = d->channel;
+/* Queues R on its disk's channel, or hands it to its virtio
+   device or RAM disk, and returns at once.  R must stay valid, and its
+   buffers untouched, until it completes.  R's callback, if any,
+   may run in an interrupt handler. */
+void
+disk_submit (struct disk_request *r) {
+	struct disk *d = r->disk;
+	struct channel *c = d->channel;
+	enum intr_level old_level;
+
+	ASSERT (r->buffer != NULL || r->buffers != NULL);
+
+	old_level = intr_disable ();
+	if (r->sector == d->next_sector)
+		d->seq_cnt++;
+	else
+		d->random_cnt++;
+	d->next_sector = r->sector + r->cnt;
+	intr_set_level (old_level);
+	r->submit_tsc = r->start_tsc = rdtsc ();
+
+	if (r->disk->rd != NULL) {
+		ramdisk_submit (r->disk->rd, r);
+		return;
+	}
+	if (r->disk->vblk != NULL) {
+		virtio_blk_submit (r->disk->vblk, r);
+		return;
+	}
+
+	r->deadline = timer_ticks () + DEADLINE_TICKS;
 	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
-	issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-	if (!wait_while_busy (d))
-		PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-	output_sector (c, buffer);
-	sema_down (&c->completion_wait);
-	d->write_cnt++;
+	list_insert_ordered (&c->queue, &r->elem, request_less, NULL);
+	cond_signal (&c->queue_ready, &c->lock);
 	lock_release (&c->lock);
 }
-
+
+/* Waits for R, which must have no callback, to complete. */
+void
+disk_wait (struct disk_request *r) {
+	ASSERT (r->callback == NULL);
+	sema_down (&r->done);
+}
+
+/* Called by a disk driver when R is done: counts its sectors and
+   calls its callback or wakes its waiter.  May be called from an
+   interrupt handler or, for a RAM disk, from any thread, so the
+   counts are updated with interrupts off. */
+void
+disk_request_complete (struct disk_request *r) {
+	struct disk *d = r->disk;
+	uint64_t now = rdtsc ();
+	enum intr_level old_level = intr_disable ();
+
+	if (r->write)
+		d->write_cnt += r->cnt;
+	else
+		d->read_cnt += r->cnt;
+	d->class_cnt[r->io_class][r->write] += r->cnt;
+	record_latency (d->wait_hist, r->start_tsc - r->submit_tsc);
+	record_latency (d->service_hist, now - r->start_tsc);
+	intr_set_level (old_level);
+
+	if (r->callback != NULL)
+		r->callback (r);
+	else
+		sema_up (&r->done);
+}
+
+/* Makes CLASS the current thread's I/O class, which the disk
+   requests it makes from now on are accounted to, and returns the
+   class it had before, for the caller to restore. */
+enum disk_io_class
+disk_io_class_set (enum disk_io_class class) {
+	struct thread *t = thread_current ();
+	enum disk_io_class old = t->io_class;
+
+	ASSERT (class < DISK_IO_CLASS_CNT);
+	t->io_class = class;
+	return old;
+}
+
+/* Returns the current thread's I/O class. */
+enum disk_io_class
+disk_io_class_get (void) {
+	return thread_current ()->io_class;
+}
+
+/* Returns the name of CLASS. */
+const char *
+disk_io_class_name (enum disk_io_class class) {
+	static const char *names[DISK_IO_CLASS_CNT] = {
+		"other", "inode", "data", "dir", "alloc", "journal", "swap",
+		"page cache",
+	};
+
+	ASSERT (class < DISK_IO_CLASS_CNT);
+	return names[class];
+}
+
+/* Adds a request that took CYCLES to latency histogram HIST. */
+static void
+record_latency (long long hist[], uint64_t cycles) {
+	int bucket = 0;
+
+	while (bucket < DISK_HIST_CNT - 1
+			&& cycles >= (1ULL << (bucket + DISK_HIST_SHIFT)))
+		bucket++;
+	hist[bucket]++;
+}
+
+/* Prints the nonempty buckets of latency histogram HIST, titled
+   NAME. */
+static void
+print_hist (const char *name, const long long hist[]) {
+	int i;
+
+	printf ("  %s:\n", name);
+	for (i = 0; i < DISK_HIST_CNT; i++)
+		if (hist[i] != 0)
+			printf ("    %s2^%d cycles: %lld\n", i < DISK_HIST_CNT - 1 ? "<" : ">=",
+					i + DISK_HIST_SHIFT - (i == DISK_HIST_CNT - 1), hist[i]);
+}
+
+/* Returns R's position in its channel's queue: its device, then
+   its first sector. */
+static uint64_t
+request_key (const struct disk_request *r) {
+	return ((uint64_t) r->disk->dev_no << 32) | r->sector;
+}
+
+/* Returns true if request A comes before request B in the queue. */
+static bool
+request_less (const struct list_elem *a, const struct list_elem *b,
+		void *aux UNUSED) {
+	return request_key (list_entry (a, struct disk_request, elem))
+		< request_key (list_entry (b, struct disk_request, elem));
+}
+
+/* Returns the request C's dispatcher should start next.  That is
+   the oldest request if it has waited past its deadline, and
+   otherwise the first one at or past the position where the last
+   command ended, wrapping around to the lowest (C-LOOK).  C's
+   lock must be held and its queue must not be empty. */
+static struct disk_request *
+request_next (struct channel *c) {
+	struct list_elem *e;
+	struct disk_request *oldest = NULL;
+	int64_t now = timer_ticks ();
+
+	for (e = list_begin (&c->queue); e != list_end (&c->queue);
+			e = list_next (e)) {
+		struct disk_request *r = list_entry (e, struct disk_request, elem);
+
+		if (oldest == NULL || r->deadline < oldest->deadline)
+			oldest = r;
+	}
+	if (oldest->deadline <= now)
+		return oldest;
+
+	for (e = list_begin (&c->queue); e != list_end (&c->queue);
+			e = list_next (e)) {
+		struct disk_request *r = list_entry (e, struct disk_request, elem);
+
+		if (request_key (r) >= c->head)
+			return r;
+	}
+	return list_entry (list_front (&c->queue), struct disk_request, elem);
+}
+
+/* Dispatcher thread for channel AUX.  Takes requests off the
+   queue in elevator order, merges each with the requests queued
+   for the sectors right after it on the same disk in the same
+   direction, and issues them as one command. */
+static void
+dispatcher (void *aux) {
+	struct channel *c = aux;
+
+	lock_acquire (&c->lock);
+	for (;;) {
+		struct disk_request **batch = c->batch;
+		struct disk_request *first;
+		struct list_elem *e;
+		size_t batch_cnt = 0, sector_cnt = 0, i;
+
+		while (list_empty (&c->queue))
+			cond_wait (&c->queue_ready, &c->lock);
+
+		/* Collect the batch: FIRST, then whatever continues it. */
+		first = request_next (c);
+		e = &first->elem;
+		do {
+			struct disk_request *r = list_entry (e, struct disk_request, elem);
+
+			e = list_remove (e);
+			r->start_tsc = rdtsc ();
+			batch[batch_cnt++] = r;
+			sector_cnt += r->cnt;
+			if (e == list_end (&c->queue))
+				break;
+			r = list_entry (e, struct disk_request, elem);
+			if (r->disk != first->disk || r->write != first->write
+					|| r->sector != first->sector + sector_cnt
+					|| sector_cnt + r->cnt > MAX_CMD_SECTORS)
+				break;
+		} while (true);
+		c->head = request_key (first) + sector_cnt;
+		lock_release (&c->lock);
+
+		if (batch_cnt == 1)
+			transfer (first);
+		else {
+			void **bufs = c->bufs;
+
+			for (i = 0; i < batch_cnt; i++)
+				bufs = request_buffers (batch[i], 0, batch[i]->cnt, bufs);
+			issue (first->disk, first->sector, sector_cnt, first->write, c->bufs);
+		}
+		for (i = 0; i < batch_cnt; i++)
+			disk_request_complete (batch[i]);
+		lock_acquire (&c->lock);
+	}
+}
+
+/* Stores pointers to the buffers for sectors OFS through OFS +
+   CNT - 1 of request R in BUFS, and returns the slot after them. */
+static void **
+request_buffers (const struct disk_request *r, size_t ofs, size_t cnt,
+		void **bufs) {
+	size_t i;
+
+	for (i = ofs; i < ofs + cnt; i++)
+		*bufs++ = r->buffers != NULL ? r->buffers[i]
+			: (uint8_t *) r->buffer + i * DISK_SECTOR_SIZE;
+	return bufs;
+}
+
+/* Carries out request R, one command per MAX_CMD_SECTORS
+   sectors.  Called by the dispatcher without the channel's lock
+   held. */
+static void
+transfer (struct disk_request *r) {
+	struct channel *c = r->disk->channel;
+	size_t done;
+
+	for (done = 0; done < r->cnt; done += MAX_CMD_SECTORS) {
+		size_t n = r->cnt - done;
+
+		if (n > MAX_CMD_SECTORS)
+			n = MAX_CMD_SECTORS;
+		request_buffers (r, done, n, c->bufs);
+		issue (r->disk, r->sector + done, n, r->write, c->bufs);
+	}
+}
+
+/* Moves the CNT sectors, at most MAX_CMD_SECTORS, starting at
+   SEC_NO between disk D and BUFFERS, one buffer per sector, by
+   DMA if possible and otherwise by PIO.  Only D's channel's
+   dispatcher may call this. */
+static void
+issue (struct disk *d, disk_sector_t sec_no, size_t cnt, bool write,
+		void *const buffers[]) {
+	if (!dma_transfer (d, sec_no, cnt, write, buffers))
+		pio_transfer (d, sec_no, cnt, write, buffers);
+}
+
+/* Fills in D's channel's PRD table to describe BUFFERS, one per
+   sector, for a transfer of CNT sectors.  Returns false if they
+   cannot be described, that is, if one is not an even kernel
+   address in the low 4 GB of physical memory, or if the table is
+   too short. */
+static bool
+prd_build (struct disk *d, size_t cnt, void *const buffers[]) {
+	struct prd *prdt = d->channel->prdt;
+	uint32_t last_size = 0;
+	size_t prd_cnt = 0, i;
+
+	for (i = 0; i < cnt; i++) {
+		uint64_t addr;
+		uint32_t left = DISK_SECTOR_SIZE;
+
+		if (!is_kernel_vaddr (buffers[i]))
+			return false;
+		addr = vtop (buffers[i]);
+		if (addr % 2 != 0 || addr + DISK_SECTOR_SIZE > ((uint64_t) 1 << 32))
+			return false;
+
+		while (left > 0) {
+			uint32_t room = 0x10000 - (addr & 0xffff);
+			uint32_t size = left < room ? left : room;
+
+			if (prd_cnt > 0 && prdt[prd_cnt - 1].addr + last_size == addr
+					&& (addr & 0xffff) != 0)
+				/* Extends the previous region, within its 64 kB. */
+				last_size += size;
+			else {
+				if (prd_cnt == PRD_CNT)
+					return false;
+				prdt[prd_cnt].addr = addr;
+				prdt[prd_cnt].flags = 0;
+				prd_cnt++;
+				last_size = size;
+			}
+			prdt[prd_cnt - 1].size = last_size & 0xffff;
+			addr += size;
+			left -= size;
+		}
+	}
+	prdt[prd_cnt - 1].flags = PRD_EOT;
+	return true;
+}
+
+/* Tries to move CNT sectors by DMA, as for issue().  Returns
+   false if D's channel has no DMA, if the buffers are not
+   suitable for it, or if the transfer fails, in which case it
+   should be done again by PIO. */
+static bool
+dma_transfer (struct disk *d, disk_sector_t sec_no, size_t cnt, bool write,
+		void *const buffers[]) {
+	struct channel *c = d->channel;
+	uint8_t direction = write ? 0 : BM_CMD_READ;
+	uint8_t bm_status;
+
+	if (c->bm_base == 0 || !d->dma || !prd_build (d, cnt, buffers))
+		return false;
+
+	/* Point the controller at the table and clear old status. */
+	outb (c->bm_base + BM_COMMAND, 0);
+	outl (c->bm_base + BM_PRDT, vtop (c->prdt));
+	outb (c->bm_base + BM_STATUS,
+			inb (c->bm_base + BM_STATUS) | BM_STA_ERR | BM_STA_IRQ);
+	outb (c->bm_base + BM_COMMAND, direction);
+
+	/* Start the transfer and sleep until it completes. */
+	select_sector (d, sec_no, cnt);
+	issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+	outb (c->bm_base + BM_COMMAND, direction | BM_CMD_START);
+	sema_down (&c->completion_wait);
+
+	bm_status = inb (c->bm_base + BM_STATUS);
+	outb (c->bm_base + BM_COMMAND, 0);
+	outb (c->bm_base + BM_STATUS, bm_status | BM_STA_ERR | BM_STA_IRQ);
+	if ((bm_status & BM_STA_ERR) || (inb (reg_status (c)) & STA_ERR)) {
+		printf ("%s: DMA %s failed, sector=%"PRDSNu", retrying by PIO\n",
+				d->name, write ? "write" : "read", sec_no);
+		return false;
+	}
+	return true;
+}
+
+/* Moves CNT sectors by PIO, as for issue().  The disk raises
+   DRQ, and an interrupt, once per sector: for a read, when the
+   next sector is ready to be taken; for a write, when it is ready
+   for the next one, with a final interrupt once the last one is
+   done. */
+static void
+pio_transfer (struct disk *d, disk_sector_t sec_no, size_t cnt, bool write,
+		void *const buffers[]) {
+	struct channel *c = d->channel;
+	size_t i;
+
+	select_sector (d, sec_no, cnt);
+	issue_pio_command (c, write ? CMD_WRITE_SECTOR_RETRY
+			: CMD_READ_SECTOR_RETRY);
+	for (i = 0; i < cnt; i++) {
+		if (!write || i > 0)
+			sema_down (&c->completion_wait);
+		if (!wait_while_busy (d))
+			PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+					write ? "write" : "read", sec_no + (disk_sector_t) i);
+		if (write)
+			output_sector (c, buffers[i]);
+		else
+			input_sector (c, buffers[i]);
+	}
+	if (write)
+		sema_down (&c->completion_wait);
+}
+
+/* Finds virtio block devices and puts each in a disk slot that
+   has no ATA disk: the one its ID string names, if that is free,
+   and otherwise the first free one after hd0:0. */
+static void
+virtio_init (void) {
+	struct virtio_blk *vbs[CHANNEL_CNT * 2];
+	size_t cnt = virtio_blk_probe (vbs, CHANNEL_CNT * 2);
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		char id[VIRTIO_BLK_ID_LEN + 1];
+		struct disk *d = NULL;
+		int slot;
+
+		virtio_blk_get_id (vbs[i], id);
+		d = parse_slot (id);
+		if (d != NULL && (d->is_ata || d->vblk != NULL))
+			d = NULL;
+		for (slot = 1; d == NULL && slot < CHANNEL_CNT * 2; slot++) {
+			struct disk *s = &channels[slot / 2].devices[slot % 2];
+			if (!s->is_ata && s->vblk == NULL)
+				d = s;
+		}
+		if (d == NULL) {
+			printf ("virtio-blk: no free disk slot for device %zu\n", i);
+			continue;
+		}
+
+		d->vblk = vbs[i];
+		d->capacity = virtio_blk_capacity (vbs[i]);
+		print_capacity (d);
+		printf (" virtio disk\n");
+	}
+}
+
+/* Copies each disk named in disk_ramdisk_slots into a RAM disk
+   that serves its requests from then on. */
+static void
+ramdisk_init (void) {
+	char slots[64];
+	char *slot, *save_ptr;
+	uint8_t *bounce;
+
+	if (disk_ramdisk_slots == NULL)
+		return;
+	bounce = palloc_get_multiple (PAL_ASSERT,
+			MAX_CMD_SECTORS * DISK_SECTOR_SIZE / PGSIZE);
+
+	strlcpy (slots, disk_ramdisk_slots, sizeof slots);
+	for (slot = strtok_r (slots, ",", &save_ptr); slot != NULL;
+			slot = strtok_r (NULL, ",", &save_ptr)) {
+		struct disk *d = parse_slot (slot);
+		disk_sector_t sec_no;
+		struct ramdisk *rd;
+
+		if (d == NULL || !(d->is_ata || d->vblk != NULL) || d->rd != NULL) {
+			printf ("ramdisk: no disk %s to copy\n", slot);
+			continue;
+		}
+		rd = ramdisk_create (d->capacity);
+		if (rd == NULL)
+			PANIC ("ramdisk: out of memory for %s", d->name);
+
+		for (sec_no = 0; sec_no < d->capacity; sec_no += MAX_CMD_SECTORS) {
+			size_t cnt = d->capacity - sec_no < MAX_CMD_SECTORS
+				? d->capacity - sec_no : MAX_CMD_SECTORS;
+
+			disk_read_multiple (d, sec_no, bounce, cnt);
+			ramdisk_write (rd, sec_no, bounce, cnt);
+		}
+		d->rd = rd;
+
+		/* Start counting afresh, without the copying. */
+		d->read_cnt = d->write_cnt = 0;
+		d->seq_cnt = d->random_cnt = 0;
+		memset (d->class_cnt, 0, sizeof d->class_cnt);
+		memset (d->wait_hist, 0, sizeof d->wait_hist);
+		memset (d->service_hist, 0, sizeof d->service_hist);
+		printf ("%s: copied to RAM disk, %zu pages\n", d->name,
+				ramdisk_page_cnt (rd));
+	}
+	palloc_free_multiple (bounce, MAX_CMD_SECTORS * DISK_SECTOR_SIZE / PGSIZE);
+}
+
+/* Returns the disk slot that NAME, e.g. "hd0:1", names, or a null
+   pointer if NAME is not a slot name. */
+static struct disk *
+parse_slot (const char *name) {
+	if (name[0] == 'h' && name[1] == 'd' && (name[2] == '0' || name[2] == '1')
+			&& name[3] == ':' && (name[4] == '0' || name[4] == '1')
+			&& name[5] == '\0')
+		return &channels[name[2] - '0'].devices[name[4] - '0'];
+	return NULL;
+}
+
+/* Finds the PCI IDE controller and, if it can do bus-master DMA,
+   enables DMA on both channels. */
+static void
+dma_init (void) {
+	struct pci_addr addr;
+	uint32_t bar4;
+	size_t chan_no;
+
+	/* Mass storage controller, IDE. */
+	if (!pci_find_class (0x01, 0x01, &addr))
+		return;
+
+	/* BAR4 holds the I/O base of the bus master registers, 8 ports
+	   per channel. */
+	bar4 = pci_read_config (addr, PCI_BAR0 + 4 * 4);
+	if (!(bar4 & 1) || (bar4 & ~3u) == 0)
+		return;
+	pci_write_config16 (addr, PCI_COMMAND, pci_read_config16 (addr, PCI_COMMAND)
+			| PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+	for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++) {
+		struct channel *c = &channels[chan_no];
+
+		c->prdt = palloc_get_page (0);
+		if (c->prdt == NULL)
+			continue;
+		c->bm_base = (bar4 & ~3u) + 8 * chan_no;
+		printf ("%s: bus-master DMA at port %#x\n", c->name, c->bm_base);
+	}
+}
+
 /* Disk detection and identification. */
 
 static void print_ata_string (char *string, size_t size);
@@ -361,10 +1102,24 @@ identify_ata_device (struct disk *d) {
 	}
 	input_sector (c, id);
 
-	/* Calculate capacity. */
+	/* Calculate capacity.  Word 49 bit 8 tells whether the disk
+	   supports DMA. */
 	d->capacity = id[60] | ((uint32_t) id[61] << 16);
+	d->dma = (id[49] & 0x100) != 0;
 
 	/* Print identification message. */
+	print_capacity (d);
+	printf (" disk, model \"");
+	print_ata_string ((char *) &id[27], 40);
+	printf ("\", serial \"");
+	print_ata_string ((char *) &id[10], 20);
+	printf ("\"\n");
+}
+
+/* Prints the start of a message announcing disk D: its name and
+   its capacity. */
+static void
+print_capacity (const struct disk *d) {
 	printf ("%s: detected %'"PRDSNu" sector (", d->name, d->capacity);
 	if (d->capacity > 1024 / DISK_SECTOR_SIZE * 1024 * 1024)
 		printf ("%"PRDSNu" GB",
@@ -375,11 +1130,7 @@ identify_ata_device (struct disk *d) {
 		printf ("%"PRDSNu" kB", d->capacity / (1024 / DISK_SECTOR_SIZE));
 	else
 		printf ("%"PRDSNu" byte", d->capacity * DISK_SECTOR_SIZE);
-	printf (") disk, model \"");
-	print_ata_string ((char *) &id[27], 40);
-	printf ("\", serial \"");
-	print_ata_string ((char *) &id[10], 20);
-	printf ("\"\n");
+	printf (")");
 }
 
 /* Prints STRING, which consists of SIZE bytes in a funky format:
@@ -402,17 +1153,18 @@ print_ata_string (char *string, size_t size) {
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT, at most MAX_CMD_SECTORS, to the disk's
+   sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) {
+select_sector (struct disk *d, disk_sector_t sec_no, size_t cnt) {
 	struct channel *c = d->channel;
 
-	ASSERT (sec_no < d->capacity);
-	ASSERT (sec_no < (1UL << 28));
+	ASSERT (cnt > 0 && cnt <= MAX_CMD_SECTORS);
+	ASSERT (sec_no + cnt <= d->capacity);
+	ASSERT (sec_no + cnt <= (1UL << 28));
 
 	select_device_wait (d);
-	outb (reg_nsect (c), 1);
+	outb (reg_nsect (c), cnt == MAX_CMD_SECTORS ? 0 : cnt);
 	outb (reg_lbal (c), sec_no);
 	outb (reg_lbam (c), sec_no >> 8);
 	outb (reg_lbah (c), (sec_no >> 16));
@@ -541,6 +1293,19 @@ inspect_write_cnt (struct intr_frame *f) {
 	f->R.rax = d->write_cnt;
 }
 
+/* Returns in RAX the sectors that disk RDX:RCX has read, if RDI
+   is 0, or written, otherwise, for I/O class RSI, or -1 if RSI is
+   not a class. */
+static void
+inspect_class_cnt (struct intr_frame *f) {
+	struct disk *d = disk_get (f->R.rdx, f->R.rcx);
+
+	if (d == NULL || f->R.rsi >= DISK_IO_CLASS_CNT)
+		f->R.rax = -1;
+	else
+		f->R.rax = d->class_cnt[f->R.rsi][f->R.rdi != 0];
+}
+
 /* Tool for testing disk r/w cnt. Calling this function via int 0x43 and int 0x44.
  * Input:
  *   @RDX - chan_no of disk to inspect
@@ -551,4 +1316,5 @@ void
 register_disk_inspect_intr (void) {
 	intr_register_int (0x43, 3, INTR_OFF, inspect_read_cnt, "Inspect Disk Read Count");
 	intr_register_int (0x44, 3, INTR_OFF, inspect_write_cnt, "Inspect Disk Write Count");
+	intr_register_int (0x45, 3, INTR_OFF, inspect_class_cnt, "Inspect Disk I/O by Class");
 }
@@ -0,0 +1,148 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/io.h"
+
+/* Access to PCI configuration space through configuration
+   mechanism #1: the address of a 32-bit configuration register is
+   written to the CONFIG_ADDRESS port, and the register is then
+   read or written through the CONFIG_DATA port.  That is all the
+   PCI support drivers here need to find their devices. */
+
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* Buses scanned when looking for a device. */
+#define PCI_BUS_CNT 256
+#define PCI_DEV_CNT 32
+#define PCI_FUNC_CNT 8
+
+/* Selects register REG of function ADDR for the next access to
+   PCI_CONFIG_DATA. */
+static void
+select_register (struct pci_addr addr, uint8_t reg) {
+	outl (PCI_CONFIG_ADDRESS, 0x80000000u | ((uint32_t) addr.bus << 16)
+			| ((uint32_t) addr.dev << 11) | ((uint32_t) addr.func << 8)
+			| (reg & 0xfc));
+}
+
+/* Returns the 32-bit configuration register at offset REG, which
+   is rounded down to a multiple of 4, of function ADDR. */
+uint32_t
+pci_read_config (struct pci_addr addr, uint8_t reg) {
+	select_register (addr, reg);
+	return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit configuration register at offset
+   REG, which is rounded down to a multiple of 4, of function
+   ADDR. */
+void
+pci_write_config (struct pci_addr addr, uint8_t reg, uint32_t value) {
+	select_register (addr, reg);
+	outl (PCI_CONFIG_DATA, value);
+}
+
+/* Returns the 16-bit configuration register at offset REG, which
+   must be even, of function ADDR. */
+uint16_t
+pci_read_config16 (struct pci_addr addr, uint8_t reg) {
+	ASSERT (reg % 2 == 0);
+	return pci_read_config (addr, reg) >> ((reg & 2) * 8);
+}
+
+/* Writes VALUE to the 16-bit configuration register at offset
+   REG, which must be even, of function ADDR. */
+void
+pci_write_config16 (struct pci_addr addr, uint8_t reg, uint16_t value) {
+	uint32_t word = pci_read_config (addr, reg);
+	int shift = (reg & 2) * 8;
+
+	ASSERT (reg % 2 == 0);
+	word = (word & ~(0xffffu << shift)) | ((uint32_t) value << shift);
+	pci_write_config (addr, reg, word);
+}
+
+/* Returns a key that orders functions by bus, device, and
+   function number. */
+static unsigned
+addr_key (struct pci_addr a) {
+	return ((unsigned) a.bus << 8) | (a.dev << 3) | a.func;
+}
+
+/* Calls MATCH on every function present that comes after AFTER,
+   or on every one if AFTER is null, with AUX, stopping at the
+   first for which it returns true and storing its location in
+   *ADDR.  Returns false if MATCH never returns true. */
+static bool
+scan (bool (*match) (struct pci_addr, uint32_t aux), uint32_t aux,
+		const struct pci_addr *after, struct pci_addr *addr) {
+	struct pci_addr a;
+	unsigned bus, dev, func;
+
+	for (bus = 0; bus < PCI_BUS_CNT; bus++)
+		for (dev = 0; dev < PCI_DEV_CNT; dev++)
+			for (func = 0; func < PCI_FUNC_CNT; func++) {
+				a.bus = bus;
+				a.dev = dev;
+				a.func = func;
+				if ((pci_read_config (a, PCI_VENDOR_ID) & 0xffff) == 0xffff) {
+					/* Nothing here.  Without function 0, there are no
+					   other functions either. */
+					if (func == 0)
+						break;
+					continue;
+				}
+				if ((after == NULL || addr_key (a) > addr_key (*after))
+						&& match (a, aux)) {
+					*addr = a;
+					return true;
+				}
+
+				/* Only multi-function devices have functions past 0. */
+				if (func == 0
+						&& !(pci_read_config (a, PCI_HEADER_TYPE) >> 16 & 0x80))
+					break;
+			}
+	return false;
+}
+
+/* Returns true if function A's class and subclass are AUX's low
+   16 bits. */
+static bool
+class_match (struct pci_addr a, uint32_t aux) {
+	return pci_read_config (a, PCI_CLASS) >> 16 == aux;
+}
+
+/* Returns true if function A's vendor and device IDs are AUX. */
+static bool
+id_match (struct pci_addr a, uint32_t aux) {
+	return pci_read_config (a, PCI_VENDOR_ID) == aux;
+}
+
+/* Finds the first function with the given CLASS and SUBCLASS
+   and stores its location in *ADDR.  Returns false if there is
+   none. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_addr *addr) {
+	return scan (class_match, ((uint32_t) class << 8) | subclass, NULL,
+			addr);
+}
+
+/* Finds the first function with the given VENDOR and DEVICE IDs
+   and stores its location in *ADDR.  Returns false if there is
+   none. */
+bool
+pci_find_device (uint16_t vendor, uint16_t device, struct pci_addr *addr) {
+	return scan (id_match, ((uint32_t) device << 16) | vendor, NULL, addr);
+}
+
+/* Finds the next function after *ADDR with the given VENDOR and
+   DEVICE IDs and stores its location in *ADDR.  Returns false if
+   there is none. */
+bool
+pci_find_next_device (uint16_t vendor, uint16_t device,
+		struct pci_addr *addr) {
+	struct pci_addr after = *addr;
+
+	return scan (id_match, ((uint32_t) device << 16) | vendor, &after, addr);
+}
@@ -0,0 +1,155 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* A disk kept in kernel memory.
+
+   Its sectors live in pages from the kernel pool, SECTORS_PER_PAGE
+   to a page, found through a table with one entry per page.  A
+   page that has never held anything but zeros is not allocated,
+   and reads as zeros, so a mostly empty disk, such as a fresh
+   swap disk, costs little memory.
+
+   Requests complete before ramdisk_submit() returns, so they
+   measure only the software above the disk. */
+
+#define SECTORS_PER_PAGE (PGSIZE / DISK_SECTOR_SIZE)
+
+/* A RAM disk. */
+struct ramdisk {
+	disk_sector_t capacity;     /* Size in sectors. */
+	size_t page_cnt;            /* Number of entries in PAGES. */
+	size_t alloc_cnt;           /* Number of pages allocated. */
+	uint8_t **pages;            /* Page table, null for zero pages. */
+	struct lock alloc_lock;     /* Serializes page allocation. */
+};
+
+static uint8_t *sector_data (struct ramdisk *, disk_sector_t, bool create,
+		const void *data);
+
+/* Creates and returns a RAM disk of CAPACITY sectors, all zero.
+   Returns a null pointer if memory is not available. */
+struct ramdisk *
+ramdisk_create (disk_sector_t capacity) {
+	struct ramdisk *rd = malloc (sizeof *rd);
+
+	if (rd == NULL)
+		return NULL;
+	rd->capacity = capacity;
+	rd->page_cnt = DIV_ROUND_UP (capacity, SECTORS_PER_PAGE);
+	rd->alloc_cnt = 0;
+	rd->pages = calloc (rd->page_cnt, sizeof *rd->pages);
+	if (rd->pages == NULL) {
+		free (rd);
+		return NULL;
+	}
+	lock_init (&rd->alloc_lock);
+	return rd;
+}
+
+/* Returns RD's size in sectors. */
+disk_sector_t
+ramdisk_capacity (const struct ramdisk *rd) {
+	return rd->capacity;
+}
+
+/* Returns the number of pages of memory RD's data takes up. */
+size_t
+ramdisk_page_cnt (const struct ramdisk *rd) {
+	return rd->alloc_cnt;
+}
+
+/* Reads the CNT sectors starting at SEC_NO from RD into BUFFER. */
+void
+ramdisk_read (struct ramdisk *rd, disk_sector_t sec_no, void *buffer,
+		size_t cnt) {
+	uint8_t *dst = buffer;
+
+	ASSERT (sec_no + cnt <= rd->capacity);
+	for (; cnt > 0; cnt--, sec_no++, dst += DISK_SECTOR_SIZE) {
+		const uint8_t *src = sector_data (rd, sec_no, false, NULL);
+
+		if (src != NULL)
+			memcpy (dst, src, DISK_SECTOR_SIZE);
+		else
+			memset (dst, 0, DISK_SECTOR_SIZE);
+	}
+}
+
+/* Writes CNT sectors from BUFFER to RD, starting at SEC_NO.
+   Panics if memory runs out. */
+void
+ramdisk_write (struct ramdisk *rd, disk_sector_t sec_no, const void *buffer,
+		size_t cnt) {
+	const uint8_t *src = buffer;
+
+	ASSERT (sec_no + cnt <= rd->capacity);
+	for (; cnt > 0; cnt--, sec_no++, src += DISK_SECTOR_SIZE) {
+		uint8_t *dst = sector_data (rd, sec_no, true, src);
+
+		if (dst != NULL)
+			memcpy (dst, src, DISK_SECTOR_SIZE);
+	}
+}
+
+/* Carries out disk request R on RD and completes it. */
+void
+ramdisk_submit (struct ramdisk *rd, struct disk_request *r) {
+	size_t i;
+
+	if (r->buffers == NULL) {
+		if (r->write)
+			ramdisk_write (rd, r->sector, r->buffer, r->cnt);
+		else
+			ramdisk_read (rd, r->sector, r->buffer, r->cnt);
+	} else
+		for (i = 0; i < r->cnt; i++) {
+			if (r->write)
+				ramdisk_write (rd, r->sector + i, r->buffers[i], 1);
+			else
+				ramdisk_read (rd, r->sector + i, r->buffers[i], 1);
+		}
+	disk_request_complete (r);
+}
+
+/* Returns true if the sector of data at P is all zeros. */
+static bool
+is_zero (const void *p) {
+	const uint64_t *w = p;
+	size_t i;
+
+	for (i = 0; i < DISK_SECTOR_SIZE / sizeof *w; i++)
+		if (w[i] != 0)
+			return false;
+	return true;
+}
+
+/* Returns the memory holding sector SEC_NO of RD, or a null
+   pointer if its page has not been allocated.  If CREATE is true,
+   allocates the page first, unless DATA, the data about to be
+   written, is all zeros. */
+static uint8_t *
+sector_data (struct ramdisk *rd, disk_sector_t sec_no, bool create,
+		const void *data) {
+	uint8_t **page = &rd->pages[sec_no / SECTORS_PER_PAGE];
+
+	if (*page == NULL && create && !is_zero (data)) {
+		lock_acquire (&rd->alloc_lock);
+		if (*page == NULL) {
+			uint8_t *kpage = palloc_get_page (PAL_ZERO);
+
+			if (kpage == NULL)
+				PANIC ("ramdisk: out of memory");
+			*page = kpage;
+			rd->alloc_cnt++;
+		}
+		lock_release (&rd->alloc_lock);
+	}
+	return *page != NULL
+		? *page + sec_no % SECTORS_PER_PAGE * DISK_SECTOR_SIZE : NULL;
+}
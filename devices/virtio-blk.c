@@ -0,0 +1,455 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "intrinsic.h"
+
+/* Driver for virtio block devices, through the legacy virtio PCI
+   interface that QEMU's virtio-blk-pci offers.
+
+   Each device has one split virtqueue: a table of descriptors, an
+   "available" ring of descriptor chains handed to the device, and
+   a "used" ring of chains it has finished with.  A request is a
+   chain of a header naming the operation and sector, one
+   descriptor per physically contiguous run of data, and a status
+   byte for the device to fill in.  The device works on as many
+   requests at once as fit in the queue, in whatever order it
+   likes, and many may complete per interrupt: the interrupt
+   handler takes every finished chain off the used ring before
+   returning, and the device is only notified of new requests
+   when it has not said that it will look for them on its own.
+
+   A disk request too big for one chain is split into parts, and
+   completes when its last part does.  As with the ATA driver, a
+   failed request is fatal. */
+
+/* PCI IDs of a legacy or transitional virtio block device. */
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLK_DEVICE 0x1001
+
+/* Legacy virtio PCI registers, relative to BAR0. */
+#define VIRTIO_HOST_FEATURES 0x00       /* 32 bits. */
+#define VIRTIO_GUEST_FEATURES 0x04      /* 32 bits. */
+#define VIRTIO_QUEUE_PFN 0x08           /* 32 bits. */
+#define VIRTIO_QUEUE_SIZE 0x0c          /* 16 bits. */
+#define VIRTIO_QUEUE_SELECT 0x0e        /* 16 bits. */
+#define VIRTIO_QUEUE_NOTIFY 0x10        /* 16 bits. */
+#define VIRTIO_STATUS 0x12              /* 8 bits. */
+#define VIRTIO_ISR 0x13                 /* 8 bits, cleared on read. */
+#define VIRTIO_BLK_CAPACITY 0x14        /* 64 bits, in sectors. */
+
+/* Device status bits. */
+#define STATUS_ACKNOWLEDGE 0x01
+#define STATUS_DRIVER 0x02
+#define STATUS_DRIVER_OK 0x04
+#define STATUS_FAILED 0x80
+
+/* Legacy rings are aligned to, and addressed in units of, this. */
+#define VRING_ALIGN 4096
+
+/* Descriptor flags. */
+#define VRING_DESC_F_NEXT 0x01          /* Chain continues in NEXT. */
+#define VRING_DESC_F_WRITE 0x02         /* Device writes this buffer. */
+
+/* Used ring flags. */
+#define VRING_USED_F_NO_NOTIFY 0x01     /* Device needs no notification. */
+
+/* Request types. */
+#define VIRTIO_BLK_T_IN 0               /* Read. */
+#define VIRTIO_BLK_T_OUT 1              /* Write. */
+#define VIRTIO_BLK_T_GET_ID 8           /* Read ID string. */
+
+/* Request status. */
+#define VIRTIO_BLK_S_OK 0
+
+/* Most sectors one part of a request may cover.  Also limited by
+   the queue size, since each sector may need a descriptor. */
+#define MAX_PART_SECTORS 128
+
+/* Most devices supported. */
+#define VIRTIO_BLK_MAX 4
+
+/* A virtqueue descriptor. */
+struct vring_desc {
+	uint64_t addr;              /* Physical address. */
+	uint32_t len;               /* Length in bytes. */
+	uint16_t flags;             /* VRING_DESC_F_*. */
+	uint16_t next;              /* Next descriptor, if F_NEXT. */
+};
+
+/* The available ring. */
+struct vring_avail {
+	uint16_t flags;
+	uint16_t idx;               /* Where the driver puts the next entry. */
+	uint16_t ring[];            /* Heads of descriptor chains. */
+};
+
+/* An entry in the used ring. */
+struct vring_used_elem {
+	uint32_t id;                /* Head of a finished chain. */
+	uint32_t len;               /* Bytes the device wrote. */
+};
+
+/* The used ring. */
+struct vring_used {
+	uint16_t flags;             /* VRING_USED_F_*. */
+	uint16_t idx;               /* Where the device puts the next entry. */
+	struct vring_used_elem ring[];
+};
+
+/* Header of a request. */
+struct virtio_blk_hdr {
+	uint32_t type;              /* VIRTIO_BLK_T_*. */
+	uint32_t ioprio;            /* Priority, unused. */
+	uint64_t sector;            /* First sector. */
+};
+
+/* State of the request part whose chain starts at a given
+   descriptor. */
+struct vblk_slot {
+	struct virtio_blk_hdr hdr;  /* Read by the device. */
+	uint8_t status;             /* Written by the device. */
+	struct disk_request *req;   /* Request this is part of. */
+};
+
+/* A virtio block device. */
+struct virtio_blk {
+	char name[8];               /* Name, e.g. "vblk0". */
+	uint16_t io;                /* Base of the legacy registers. */
+	uint8_t irq;                /* Interrupt vector. */
+	disk_sector_t capacity;     /* Size in sectors. */
+
+	/* The virtqueue.  Only changed with interrupts off. */
+	uint16_t qsize;             /* Number of descriptors. */
+	size_t part_max;            /* Most sectors in one chain. */
+	struct vring_desc *desc;    /* Descriptor table. */
+	struct vring_avail *avail;  /* Available ring. */
+	struct vring_used *used;    /* Used ring. */
+	uint16_t free_head;         /* First free descriptor. */
+	uint16_t free_cnt;          /* Number of free descriptors. */
+	uint16_t used_seen;         /* Used ring entries handled so far. */
+	struct vblk_slot *slots;    /* One per descriptor. */
+	struct semaphore desc_freed;    /* Up'd when descriptors come free. */
+};
+
+static struct virtio_blk devices[VIRTIO_BLK_MAX];
+static size_t device_cnt;
+
+static bool device_init (struct virtio_blk *, struct pci_addr);
+static void queue_part (struct virtio_blk *, struct disk_request *,
+		uint32_t type, size_t ofs, size_t cnt);
+static bool next_segment (const struct disk_request *, size_t *sector,
+		size_t end, uint64_t *addr, uint32_t *len);
+static void interrupt_handler (struct intr_frame *);
+
+/* Finds and initializes up to MAX virtio block devices, storing
+   them in DEVS in PCI order.  Returns the number found. */
+size_t
+virtio_blk_probe (struct virtio_blk *devs[], size_t max) {
+	struct pci_addr addr;
+	bool found;
+	size_t cnt = 0;
+
+	for (found = pci_find_device (VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, &addr);
+			found && cnt < max && device_cnt < VIRTIO_BLK_MAX;
+			found = pci_find_next_device (VIRTIO_VENDOR, VIRTIO_BLK_DEVICE,
+				&addr)) {
+		struct virtio_blk *vb = &devices[device_cnt];
+
+		snprintf (vb->name, sizeof vb->name, "vblk%zu", device_cnt);
+		if (device_init (vb, addr)) {
+			device_cnt++;
+			devs[cnt++] = vb;
+		}
+	}
+	return cnt;
+}
+
+/* Returns VB's size in sectors. */
+disk_sector_t
+virtio_blk_capacity (const struct virtio_blk *vb) {
+	return vb->capacity;
+}
+
+/* Reads VB's ID string, which QEMU sets from the drive's
+   "serial" property, into ID.  Sets ID to the empty string if
+   the device has none. */
+void
+virtio_blk_get_id (struct virtio_blk *vb, char id[VIRTIO_BLK_ID_LEN + 1]) {
+	struct disk_request r;
+	uint8_t *buffer = palloc_get_page (PAL_ZERO);
+
+	id[0] = '\0';
+	if (buffer == NULL)
+		return;
+
+	/* Like a one-sector read, which has room for the ID.  The
+	   interrupt handler clears the buffer if the device fails it. */
+	r.disk = NULL;
+	r.sector = 0;
+	r.cnt = 1;
+	r.buffer = buffer;
+	r.buffers = NULL;
+	r.callback = NULL;
+	r.parts = 1;
+	sema_init (&r.done, 0);
+	queue_part (vb, &r, VIRTIO_BLK_T_GET_ID, 0, 1);
+	sema_down (&r.done);
+
+	memcpy (id, buffer, VIRTIO_BLK_ID_LEN);
+	id[VIRTIO_BLK_ID_LEN] = '\0';
+	palloc_free_page (buffer);
+}
+
+/* Queues disk request R on VB and returns at once.  R is
+   completed with disk_request_complete(), from the interrupt
+   handler. */
+void
+virtio_blk_submit (struct virtio_blk *vb, struct disk_request *r) {
+	size_t ofs;
+
+	r->parts = DIV_ROUND_UP (r->cnt, vb->part_max);
+	for (ofs = 0; ofs < r->cnt; ofs += vb->part_max) {
+		size_t n = r->cnt - ofs < vb->part_max ? r->cnt - ofs : vb->part_max;
+
+		queue_part (vb, r, r->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+				ofs, n);
+	}
+}
+
+/* Resets and sets up the device at ADDR as VB.  Returns false if
+   it cannot be used. */
+static bool
+device_init (struct virtio_blk *vb, struct pci_addr addr) {
+	static bool irq_registered[16];
+	uint32_t bar0 = pci_read_config (addr, PCI_BAR0);
+	size_t desc_size, avail_size, used_size, ring_pages, slot_pages, i;
+	uint8_t *ring;
+	uint8_t line;
+
+	if (!(bar0 & 1))
+		return false;
+	vb->io = bar0 & ~3u;
+	line = pci_read_config (addr, PCI_INTERRUPT_LINE) & 0xff;
+	if (line >= 16)
+		return false;
+	vb->irq = 0x20 + line;
+	pci_write_config16 (addr, PCI_COMMAND, pci_read_config16 (addr, PCI_COMMAND)
+			| PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+	/* Reset, then say that we know how to drive it.  None of its
+	   optional features are needed. */
+	outb (vb->io + VIRTIO_STATUS, 0);
+	outb (vb->io + VIRTIO_STATUS, STATUS_ACKNOWLEDGE);
+	outb (vb->io + VIRTIO_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+	outl (vb->io + VIRTIO_GUEST_FEATURES, 0);
+
+	/* Set up queue 0. */
+	outw (vb->io + VIRTIO_QUEUE_SELECT, 0);
+	vb->qsize = inw (vb->io + VIRTIO_QUEUE_SIZE);
+	if (vb->qsize < 3)
+		goto fail;
+	vb->part_max = vb->qsize - 2 < MAX_PART_SECTORS
+		? vb->qsize - 2u : MAX_PART_SECTORS;
+	desc_size = vb->qsize * sizeof (struct vring_desc);
+	avail_size = sizeof (struct vring_avail) + (vb->qsize + 1) * sizeof (uint16_t);
+	used_size = sizeof (struct vring_used)
+		+ vb->qsize * sizeof (struct vring_used_elem) + sizeof (uint16_t);
+	ring_pages = DIV_ROUND_UP (ROUND_UP (desc_size + avail_size, VRING_ALIGN)
+			+ used_size, PGSIZE);
+	slot_pages = DIV_ROUND_UP (vb->qsize * sizeof *vb->slots, PGSIZE);
+	ring = palloc_get_multiple (PAL_ZERO, ring_pages);
+	vb->slots = palloc_get_multiple (PAL_ZERO, slot_pages);
+	if (ring == NULL || vb->slots == NULL) {
+		palloc_free_multiple (ring, ring_pages);
+		palloc_free_multiple (vb->slots, slot_pages);
+		goto fail;
+	}
+	vb->desc = (struct vring_desc *) ring;
+	vb->avail = (struct vring_avail *) (ring + desc_size);
+	vb->used = (struct vring_used *) (ring
+			+ ROUND_UP (desc_size + avail_size, VRING_ALIGN));
+	for (i = 0; i < vb->qsize; i++)
+		vb->desc[i].next = i + 1;
+	vb->free_head = 0;
+	vb->free_cnt = vb->qsize;
+	vb->used_seen = 0;
+	sema_init (&vb->desc_freed, 0);
+	outl (vb->io + VIRTIO_QUEUE_PFN, vtop (ring) / VRING_ALIGN);
+
+	vb->capacity = inl (vb->io + VIRTIO_BLK_CAPACITY);
+	if (inl (vb->io + VIRTIO_BLK_CAPACITY + 4) != 0)
+		vb->capacity = UINT32_MAX;
+
+	/* Devices may share an interrupt line; the handler serves
+	   every device on it. */
+	if (!irq_registered[line]) {
+		intr_register_ext (vb->irq, interrupt_handler, "virtio-blk");
+		irq_registered[line] = true;
+	}
+	outb (vb->io + VIRTIO_STATUS,
+			STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+	return true;
+
+fail:
+	outb (vb->io + VIRTIO_STATUS, STATUS_FAILED);
+	return false;
+}
+
+/* Queues sectors OFS through OFS + CNT - 1 of R as one chain of
+   type TYPE, waiting for enough free descriptors. */
+static void
+queue_part (struct virtio_blk *vb, struct disk_request *r, uint32_t type,
+		size_t ofs, size_t cnt) {
+	struct vblk_slot *slot;
+	enum intr_level old_level;
+	size_t seg_cnt = 0, sector, need;
+	uint64_t addr;
+	uint32_t len;
+	uint16_t head, d;
+
+	for (sector = ofs; next_segment (r, &sector, ofs + cnt, &addr, &len); )
+		seg_cnt++;
+	need = seg_cnt + 2;
+	ASSERT (need <= vb->qsize);
+
+	old_level = intr_disable ();
+	while (vb->free_cnt < need)
+		sema_down (&vb->desc_freed);
+	if (ofs == 0)
+		r->start_tsc = rdtsc ();
+
+	/* Header. */
+	head = d = vb->free_head;
+	slot = &vb->slots[head];
+	slot->hdr.type = type;
+	slot->hdr.ioprio = 0;
+	slot->hdr.sector = r->sector + ofs;
+	slot->status = 0xff;
+	slot->req = r;
+	vb->desc[d].addr = vtop (&slot->hdr);
+	vb->desc[d].len = sizeof slot->hdr;
+	vb->desc[d].flags = VRING_DESC_F_NEXT;
+	d = vb->desc[d].next;
+
+	/* Data. */
+	for (sector = ofs; next_segment (r, &sector, ofs + cnt, &addr, &len); ) {
+		vb->desc[d].addr = addr;
+		vb->desc[d].len = len;
+		vb->desc[d].flags = VRING_DESC_F_NEXT
+			| (type != VIRTIO_BLK_T_OUT ? VRING_DESC_F_WRITE : 0);
+		d = vb->desc[d].next;
+	}
+
+	/* Status. */
+	vb->desc[d].addr = vtop (&slot->status);
+	vb->desc[d].len = 1;
+	vb->desc[d].flags = VRING_DESC_F_WRITE;
+	vb->free_head = vb->desc[d].next;
+	vb->free_cnt -= need;
+
+	/* Publish the chain, then tell the device if it is listening. */
+	vb->avail->ring[vb->avail->idx % vb->qsize] = head;
+	barrier ();
+	vb->avail->idx++;
+	barrier ();
+	if (!(vb->used->flags & VRING_USED_F_NO_NOTIFY))
+		outw (vb->io + VIRTIO_QUEUE_NOTIFY, 0);
+	intr_set_level (old_level);
+}
+
+/* Finds the physically contiguous run of R's data that starts at
+   sector *SECTOR, stopping short of sector END, and stores its
+   address in *ADDR and length in *LEN, advancing *SECTOR past it.
+   Returns false if *SECTOR is END already. */
+static bool
+next_segment (const struct disk_request *r, size_t *sector, size_t end,
+		uint64_t *addr, uint32_t *len) {
+	if (*sector >= end)
+		return false;
+
+	*len = 0;
+	do {
+		const uint8_t *buf = r->buffers != NULL ? r->buffers[*sector]
+			: (const uint8_t *) r->buffer + *sector * DISK_SECTOR_SIZE;
+		uint64_t pa = vtop (buf);
+
+		if (*len == 0)
+			*addr = pa;
+		else if (pa != *addr + *len)
+			break;
+		*len += DISK_SECTOR_SIZE;
+		++*sector;
+	} while (*sector < end);
+	return true;
+}
+
+/* Virtio block interrupt handler.  Serves every device on the
+   interrupt line, taking all finished chains off each used ring,
+   so that one interrupt can complete many requests. */
+static void
+interrupt_handler (struct intr_frame *f) {
+	size_t i;
+
+	for (i = 0; i < device_cnt; i++) {
+		struct virtio_blk *vb = &devices[i];
+		uint16_t freed = 0;
+
+		if (vb->irq != f->vec_no)
+			continue;
+
+		/* Acknowledge the interrupt, then take everything that is
+		   done, whether or not this device raised it. */
+		inb (vb->io + VIRTIO_ISR);
+
+		while (vb->used_seen != vb->used->idx) {
+			struct vring_used_elem *e;
+			struct vblk_slot *slot;
+			struct disk_request *r;
+			uint16_t d, n = 1;
+
+			barrier ();
+			e = &vb->used->ring[vb->used_seen % vb->qsize];
+			slot = &vb->slots[e->id];
+			r = slot->req;
+			d = e->id;
+			if (slot->status != VIRTIO_BLK_S_OK) {
+				if (slot->hdr.type != VIRTIO_BLK_T_GET_ID)
+					PANIC ("%s: %s failed, sector=%"PRIu64, vb->name,
+							slot->hdr.type == VIRTIO_BLK_T_OUT ? "write" : "read",
+							slot->hdr.sector);
+				memset (r->buffer, 0, DISK_SECTOR_SIZE);
+			}
+
+			/* Put the chain back on the free list. */
+			while (vb->desc[d].flags & VRING_DESC_F_NEXT) {
+				d = vb->desc[d].next;
+				n++;
+			}
+			vb->desc[d].next = vb->free_head;
+			vb->free_head = e->id;
+			vb->free_cnt += n;
+			freed += n;
+			vb->used_seen++;
+
+			if (--r->parts > 0)
+				continue;
+			if (slot->hdr.type == VIRTIO_BLK_T_GET_ID)
+				sema_up (&r->done);
+			else
+				disk_request_complete (r);
+		}
+
+		/* Each waiter checks for itself whether enough came free. */
+		if (freed > 0)
+			while (!list_empty (&vb->desc_freed.waiters))
+				sema_up (&vb->desc_freed);
+	}
+}
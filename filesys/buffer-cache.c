@@ -0,0 +1,549 @@
+#include "filesys/buffer-cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Sector buffer cache.
+
+   Keeps the contents of up to CACHE_SIZE file system sectors in
+   memory.  All reads and writes of file data and inodes go
+   through here, so that small or repeated accesses to the same
+   sector touch the disk at most once.  Writes only mark an entry
+   dirty; it reaches the disk when the entry is evicted or when
+   buffer_cache_flush() runs.
+
+   Entries are found through a hash table keyed by sector number
+   and replaced with the clock algorithm.  Each entry is a
+   readers-writer lock of its own, so any number of threads may
+   copy out of a sector at once, while a writer, or the thread
+   filling an entry from disk, has it exclusively.  CACHE_LOCK
+   only guards the index and the per-entry bookkeeping, and is not
+   held while a sector is read in.  It is held while a dirty
+   victim is written back, which keeps another thread from reading
+   a stale copy of that sector off the disk in the meantime.
+
+   Most dirty data is written back by the page cache worker thread
+   (see page_cache.c) rather than by eviction: it flushes
+   periodically, and whenever more than DIRTY_HIGH entries are
+   dirty.  Eviction passes over dirty entries as long as there is
+   a clean one to take, and wakes the worker instead, so that a
+   miss does not wait for a write, and the write goes out batched
+   with the others while the miss is being read.  Only when every
+   entry it could take is dirty does eviction still write one
+   back itself, synchronously and with CACHE_LOCK held.  Flushing
+   queues a disk request for each run of adjacent dirty sectors,
+   all at once.  The same thread reads ahead sectors that
+   buffer_cache_readahead() asks for, also reading adjacent ones
+   with one command.
+
+   Disk I/O is accounted to the I/O class (see devices/disk.h) of
+   the thread that causes it: a read to the thread that missed, and
+   a writeback to the thread that last dirtied the entry, whoever
+   ends up writing it.
+
+   Metadata is written with buffer_cache_write_logged(), which
+   marks the entry "logged".  A logged entry is neither evicted
+   nor written back until journal_checkpoint() has committed it to
+   the journal (see journal.c) and written it home itself. */
+
+/* Number of cached sectors. */
+#define CACHE_SIZE BUFFER_CACHE_SIZE
+
+/* Number of dirty entries above which writeback is started. */
+#define DIRTY_HIGH (CACHE_SIZE * 3 / 4)
+
+/* Most sectors buffer_cache_prefetch() reads with one command. */
+#define PREFETCH_RUN 16
+
+/* A cached sector. */
+struct cache_entry {
+	struct hash_elem elem;      /* Element in cache_index. */
+	disk_sector_t sector;       /* Sector held, if VALID. */
+	bool valid;                 /* In use and in cache_index? */
+	bool dirty;                 /* Modified since read or written? */
+	bool accessed;              /* Used since the clock hand passed? */
+	bool logged;                /* Holds metadata not yet journaled? */
+	enum disk_io_class io_class;    /* Class of the last write. */
+	int pins;                   /* Threads holding or waiting for it. */
+	int readers;                /* Threads holding it shared. */
+	bool writer;                /* Held exclusively? */
+	struct condition unlocked;  /* Signaled when READERS or WRITER drop. */
+	uint8_t *data;              /* DISK_SECTOR_SIZE bytes of data. */
+};
+
+static struct cache_entry cache[CACHE_SIZE];
+static struct hash cache_index;
+static struct lock cache_lock;
+static struct condition cache_unpinned;  /* Signaled when PINS hits 0. */
+static size_t clock_hand;
+static size_t dirty_cnt;                 /* Number of dirty entries. */
+static bool evict_blocked;               /* Eviction passed over dirty ones? */
+static size_t logged_cnt;                /* Number of logged entries. */
+
+static uint64_t cache_hash (const struct hash_elem *, void *);
+static bool cache_less (const struct hash_elem *, const struct hash_elem *,
+		void *);
+static struct cache_entry *cache_evict (void);
+static struct cache_entry *cache_get (disk_sector_t, bool exclusive,
+		bool fill);
+static void cache_put (struct cache_entry *, bool exclusive, bool dirty,
+		bool logged);
+static void cache_write (disk_sector_t, const void *buffer, int ofs,
+		int size, bool logged);
+static void cache_zero (disk_sector_t, bool logged);
+static int cache_compare (const void *, const void *, void *);
+
+/* Initializes the buffer cache. */
+void
+buffer_cache_init (void) {
+	size_t data_pages = CACHE_SIZE * DISK_SECTOR_SIZE / PGSIZE;
+	uint8_t *data = palloc_get_multiple (PAL_ASSERT | PAL_ZERO, data_pages);
+	size_t i;
+
+	if (!hash_init (&cache_index, cache_hash, cache_less, NULL))
+		PANIC ("buffer_cache_init: out of memory");
+	lock_init (&cache_lock);
+	cond_init (&cache_unpinned);
+	clock_hand = 0;
+	dirty_cnt = logged_cnt = 0;
+	for (i = 0; i < CACHE_SIZE; i++) {
+		struct cache_entry *e = &cache[i];
+
+		e->valid = e->dirty = e->accessed = e->logged = e->writer = false;
+		e->pins = e->readers = 0;
+		cond_init (&e->unlocked);
+		e->data = data + i * DISK_SECTOR_SIZE;
+	}
+}
+
+/* Copies SIZE bytes starting at offset OFS within SECTOR into
+   BUFFER. */
+void
+buffer_cache_read (disk_sector_t sector, void *buffer, int ofs, int size) {
+	struct cache_entry *e;
+
+	ASSERT (ofs >= 0 && size >= 0 && ofs + size <= DISK_SECTOR_SIZE);
+
+	e = cache_get (sector, false, true);
+	memcpy (buffer, e->data + ofs, size);
+	cache_put (e, false, false, false);
+}
+
+/* Copies SIZE bytes from BUFFER into SECTOR, starting at offset
+   OFS within the sector.  The sector is only read from disk if
+   the write does not cover all of it. */
+void
+buffer_cache_write (disk_sector_t sector, const void *buffer, int ofs,
+		int size) {
+	cache_write (sector, buffer, ofs, size, false);
+}
+
+/* Like buffer_cache_write(), for metadata: the sector stays in
+   the cache until the journal commits it. */
+void
+buffer_cache_write_logged (disk_sector_t sector, const void *buffer, int ofs,
+		int size) {
+	cache_write (sector, buffer, ofs, size, true);
+}
+
+/* Fills SECTOR with zeros without reading it first. */
+void
+buffer_cache_zero (disk_sector_t sector) {
+	cache_zero (sector, false);
+}
+
+/* Like buffer_cache_zero(), for metadata. */
+void
+buffer_cache_zero_logged (disk_sector_t sector) {
+	cache_zero (sector, true);
+}
+
+/* Brings the CNT sectors starting at SECTOR into the cache, those
+   not there yet, without copying them anywhere.  Each run of
+   missing sectors is read with one disk command.  Called by the
+   read-ahead worker. */
+void
+buffer_cache_prefetch (disk_sector_t sector, size_t cnt) {
+	struct cache_entry *run[PREFETCH_RUN];
+	void *bufs[PREFETCH_RUN];
+
+	while (cnt > 0) {
+		struct cache_entry key;
+		size_t n = 0, i;
+
+		/* Claim entries for the missing sectors, exclusively, as
+		   cache_get() does on a miss. */
+		lock_acquire (&cache_lock);
+		while (n < cnt && n < PREFETCH_RUN) {
+			struct cache_entry *e;
+
+			key.sector = sector + n;
+			if (hash_find (&cache_index, &key.elem) != NULL)
+				break;
+			e = cache_evict ();
+			if (e == NULL)
+				break;
+			e->sector = sector + n;
+			e->valid = true;
+			e->pins = 1;
+			e->writer = true;
+			e->accessed = true;
+			hash_insert (&cache_index, &e->elem);
+			run[n] = e;
+			bufs[n] = e->data;
+			n++;
+		}
+		lock_release (&cache_lock);
+
+		if (n == 0) {
+			/* Cached already, or no entry to spare: skip it, since
+			   read-ahead is only a hint. */
+			sector++;
+			cnt--;
+			continue;
+		}
+		disk_readv (filesys_disk, sector, bufs, n);
+		for (i = 0; i < n; i++)
+			cache_put (run[i], true, false, false);
+		sector += n;
+		cnt -= n;
+	}
+}
+
+/* Asks for SECTOR to be read into the cache in the background. */
+void
+buffer_cache_readahead (disk_sector_t sector) {
+	page_cache_post_readahead (sector);
+}
+
+/* Writes every dirty entry back to disk.  Each run of adjacent
+   sectors becomes one disk request, and all of them are queued
+   before waiting for any, so that the disk driver can order
+   them. */
+void
+buffer_cache_flush (void) {
+	struct cache_entry *dirty[CACHE_SIZE];
+	void *bufs[CACHE_SIZE];
+	struct disk_request *reqs;
+	size_t cnt = 0, req_cnt = 0, i, j;
+
+	/* Pin the dirty entries so that they keep their sectors. */
+	lock_acquire (&cache_lock);
+	for (i = 0; i < CACHE_SIZE; i++)
+		if (cache[i].valid && cache[i].dirty && !cache[i].logged) {
+			cache[i].pins++;
+			dirty[cnt++] = &cache[i];
+		}
+	lock_release (&cache_lock);
+	if (cnt == 0)
+		return;
+
+	/* Take every entry shared, locking writers out while the data
+	   goes to disk. */
+	sort (dirty, cnt, sizeof *dirty, cache_compare, NULL);
+	lock_acquire (&cache_lock);
+	for (i = 0; i < cnt; i++) {
+		while (dirty[i]->writer)
+			cond_wait (&dirty[i]->unlocked, &cache_lock);
+		dirty[i]->readers++;
+		bufs[i] = dirty[i]->data;
+	}
+	lock_release (&cache_lock);
+
+	/* Entries that came clean or logged meanwhile split runs, as
+	   do changes of I/O class.
+	   Without memory for the requests, write each run at once. */
+	reqs = malloc (cnt * sizeof *reqs);
+	for (i = 0; i < cnt; i = j) {
+		if (!dirty[i]->dirty || dirty[i]->logged) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < cnt; j++)
+			if (!dirty[j]->dirty || dirty[j]->logged
+					|| dirty[j]->sector != dirty[j - 1]->sector + 1
+					|| dirty[j]->io_class != dirty[i]->io_class)
+				break;
+		if (reqs != NULL) {
+			disk_request_init (&reqs[req_cnt], filesys_disk, dirty[i]->sector,
+					j - i, true, NULL);
+			reqs[req_cnt].buffers = bufs + i;
+			reqs[req_cnt].io_class = dirty[i]->io_class;
+			disk_submit (&reqs[req_cnt++]);
+		} else {
+			enum disk_io_class old = disk_io_class_set (dirty[i]->io_class);
+
+			disk_writev (filesys_disk, dirty[i]->sector,
+					(const void *const *) bufs + i, j - i);
+			disk_io_class_set (old);
+		}
+	}
+	for (i = 0; i < req_cnt; i++)
+		disk_wait (&reqs[i]);
+	free (reqs);
+
+	lock_acquire (&cache_lock);
+	for (i = 0; i < cnt; i++)
+		if (dirty[i]->dirty && !dirty[i]->logged) {
+			dirty[i]->dirty = false;
+			dirty_cnt--;
+		}
+	lock_release (&cache_lock);
+
+	for (i = 0; i < cnt; i++)
+		cache_put (dirty[i], false, false, false);
+}
+
+/* Returns true if enough entries are dirty that writeback should
+   not wait for the next periodic flush. */
+bool
+buffer_cache_under_pressure (void) {
+	if (evict_blocked) {
+		evict_blocked = false;
+		return true;
+	}
+	return dirty_cnt > DIRTY_HIGH;
+}
+
+/* Returns the number of logged entries. */
+size_t
+buffer_cache_logged_cnt (void) {
+	return logged_cnt;
+}
+
+/* Passes the contents of every logged entry to journal_log().
+   Called by the journal while no metadata is being written, so
+   that logged entries do not change underneath it. */
+void
+buffer_cache_log_pending (void) {
+	size_t i;
+
+	lock_acquire (&cache_lock);
+	for (i = 0; i < CACHE_SIZE; i++)
+		if (cache[i].valid && cache[i].logged)
+			if (!journal_log (cache[i].sector, cache[i].data,
+						cache[i].io_class))
+				PANIC ("buffer_cache_log_pending: journal full");
+	lock_release (&cache_lock);
+}
+
+/* Marks every logged entry clean and evictable again, once the
+   journal has written them home. */
+void
+buffer_cache_release_logged (void) {
+	size_t i;
+
+	lock_acquire (&cache_lock);
+	for (i = 0; i < CACHE_SIZE; i++)
+		if (cache[i].valid && cache[i].logged) {
+			cache[i].logged = false;
+			if (cache[i].dirty) {
+				cache[i].dirty = false;
+				dirty_cnt--;
+			}
+		}
+	logged_cnt = 0;
+	cond_broadcast (&cache_unpinned, &cache_lock);
+	lock_release (&cache_lock);
+}
+
+/* Writes back all dirty sectors, for shutdown. */
+void
+buffer_cache_done (void) {
+	buffer_cache_flush ();
+}
+
+/* Picks an entry to hold a new sector and returns it with VALID
+   false.  A dirty entry is only picked, and written back first,
+   if the clock finds no clean one.  Returns a null pointer if
+   every entry is pinned.  CACHE_LOCK must be held. */
+static struct cache_entry *
+cache_evict (void) {
+	struct cache_entry *e = NULL, *dirty = NULL;
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&cache_lock));
+
+	for (i = 0; i < 2 * CACHE_SIZE && e == NULL; i++) {
+		struct cache_entry *c = &cache[clock_hand];
+
+		clock_hand = (clock_hand + 1) % CACHE_SIZE;
+		if (c->pins > 0 || c->logged)
+			continue;
+		if (!c->valid)
+			return c;
+		if (c->accessed)
+			c->accessed = false;
+		else if (!c->dirty)
+			e = c;
+		else if (dirty == NULL)
+			dirty = c;
+	}
+
+	if (dirty != NULL) {
+		/* Have the worker write the dirty ones back meanwhile. */
+		evict_blocked = true;
+		page_cache_wake ();
+	}
+	if (e == NULL) {
+		enum disk_io_class old;
+
+		if (dirty == NULL)
+			return NULL;
+		e = dirty;
+		old = disk_io_class_set (e->io_class);
+		disk_write (filesys_disk, e->sector, e->data);
+		disk_io_class_set (old);
+		e->dirty = false;
+		dirty_cnt--;
+	}
+	hash_delete (&cache_index, &e->elem);
+	e->valid = false;
+	return e;
+}
+
+/* Returns the entry for SECTOR, locked exclusively if EXCLUSIVE
+   is true or shared otherwise, reading the sector in from disk on
+   a miss if FILL is true.  A miss with FILL false leaves the
+   entry's data undefined, so it must be taken exclusively and
+   overwritten entirely. */
+static struct cache_entry *
+cache_get (disk_sector_t sector, bool exclusive, bool fill) {
+	struct cache_entry key, *e;
+	struct hash_elem *found;
+
+	ASSERT (exclusive || fill);
+
+	key.sector = sector;
+	lock_acquire (&cache_lock);
+	for (;;) {
+		found = hash_find (&cache_index, &key.elem);
+		if (found != NULL) {
+			/* Hit.  Wait until we can have the entry. */
+			e = hash_entry (found, struct cache_entry, elem);
+			e->pins++;
+			while (e->writer || (exclusive && e->readers > 0))
+				cond_wait (&e->unlocked, &cache_lock);
+			break;
+		}
+
+		e = cache_evict ();
+		if (e != NULL) {
+			/* Miss.  Claim the entry exclusively, so that others
+			   looking for SECTOR wait until it has been read. */
+			e->sector = sector;
+			e->valid = true;
+			e->pins = 1;
+			e->writer = true;
+			hash_insert (&cache_index, &e->elem);
+			if (fill) {
+				lock_release (&cache_lock);
+				disk_read (filesys_disk, sector, e->data);
+				lock_acquire (&cache_lock);
+			}
+			e->writer = false;
+			cond_broadcast (&e->unlocked, &cache_lock);
+			break;
+		}
+
+		/* Every entry is in use.  Wait for one to come free. */
+		cond_wait (&cache_unpinned, &cache_lock);
+	}
+
+	if (exclusive)
+		e->writer = true;
+	else
+		e->readers++;
+	e->accessed = true;
+	lock_release (&cache_lock);
+	return e;
+}
+
+/* Releases entry E, which was obtained from cache_get() with the
+   same EXCLUSIVE, marking it dirty, on behalf of the current
+   thread's I/O class, if DIRTY is true and logged if LOGGED is
+   true. */
+static void
+cache_put (struct cache_entry *e, bool exclusive, bool dirty, bool logged) {
+	lock_acquire (&cache_lock);
+	if (exclusive) {
+		ASSERT (e->writer);
+		e->writer = false;
+	} else {
+		ASSERT (e->readers > 0);
+		e->readers--;
+	}
+	if (dirty) {
+		if (!e->dirty) {
+			e->dirty = true;
+			dirty_cnt++;
+		}
+		e->io_class = disk_io_class_get ();
+	}
+	if (logged && !e->logged) {
+		e->logged = true;
+		logged_cnt++;
+	}
+	cond_broadcast (&e->unlocked, &cache_lock);
+	if (--e->pins == 0)
+		cond_broadcast (&cache_unpinned, &cache_lock);
+	lock_release (&cache_lock);
+}
+
+/* Copies SIZE bytes from BUFFER into SECTOR at offset OFS, marking
+   the entry logged if LOGGED is true. */
+static void
+cache_write (disk_sector_t sector, const void *buffer, int ofs, int size,
+		bool logged) {
+	struct cache_entry *e;
+
+	ASSERT (ofs >= 0 && size >= 0 && ofs + size <= DISK_SECTOR_SIZE);
+
+	e = cache_get (sector, true, ofs > 0 || size < DISK_SECTOR_SIZE);
+	memcpy (e->data + ofs, buffer, size);
+	cache_put (e, true, true, logged);
+
+	if (dirty_cnt > DIRTY_HIGH)
+		page_cache_kick ();
+}
+
+/* Fills SECTOR with zeros, marking it logged if LOGGED is true. */
+static void
+cache_zero (disk_sector_t sector, bool logged) {
+	struct cache_entry *e = cache_get (sector, true, false);
+
+	memset (e->data, 0, DISK_SECTOR_SIZE);
+	cache_put (e, true, true, logged);
+}
+
+/* Orders pointers to cache entries by sector. */
+static int
+cache_compare (const void *a_, const void *b_, void *aux UNUSED) {
+	const struct cache_entry *const *a = a_;
+	const struct cache_entry *const *b = b_;
+
+	return (*a)->sector < (*b)->sector ? -1 : (*a)->sector > (*b)->sector;
+}
+
+/* Returns a hash value for the sector held by cache entry E. */
+static uint64_t
+cache_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct cache_entry *c = hash_entry (e, struct cache_entry, elem);
+	return hash_int (c->sector);
+}
+
+/* Returns true if cache entry A holds a lower sector than B. */
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	const struct cache_entry *x = hash_entry (a, struct cache_entry, elem);
+	const struct cache_entry *y = hash_entry (b, struct cache_entry, elem);
+	return x->sector < y->sector;
+}
@@ -0,0 +1,229 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/synch.h"
+
+/* Dentry cache.
+
+   Remembers the results of recent directory lookups as a map from
+   (directory inode sector, name) to the inode sector the name
+   refers to, so that resolving a name that was resolved recently
+   reads no directory blocks at all.  Lookups that found nothing
+   are remembered too, as "absent" entries, since opening or
+   creating a file that does not exist yet is just as common.
+
+   Entries are found through a hash table and replaced in least
+   recently used order.  The directory code keeps the cache
+   coherent: dir_add() and dir_remove() invalidate the name they
+   change, and a directory that is created or removed has all of
+   its entries dropped, since its sector may be reused.
+
+   A lookup that misses has to go to disk without holding
+   DCACHE_LOCK, so a change to the same name can race with it and
+   leave it holding a stale answer.  To catch that, a miss hands
+   out the current generation number, which every invalidation
+   increments, and the answer is only inserted if the generation
+   has not changed since. */
+
+/* Number of cached names. */
+#define DCACHE_SIZE 256
+
+/* A cached name. */
+struct dcache_entry {
+	struct hash_elem hash_elem; /* Element in dcache_index. */
+	struct list_elem lru_elem;  /* Element in dcache_lru. */
+	disk_sector_t parent;       /* Directory's inode sector. */
+	char name[NAME_MAX + 1];    /* Name within PARENT. */
+	bool present;               /* Does NAME exist? */
+	disk_sector_t child;        /* Its inode sector, if PRESENT. */
+	bool valid;                 /* In use and in dcache_index? */
+};
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+static struct hash dcache_index;
+static struct list dcache_lru;          /* Most recently used first. */
+static struct lock dcache_lock;
+static uint32_t dcache_gen;             /* Incremented on invalidation. */
+
+static uint64_t dcache_hash (const struct hash_elem *, void *);
+static bool dcache_less (const struct hash_elem *, const struct hash_elem *,
+		void *);
+static struct dcache_entry *dcache_find (disk_sector_t parent,
+		const char *name);
+static void dcache_put (disk_sector_t parent, const char *name,
+		bool present, disk_sector_t child, uint32_t gen);
+static void dcache_evict (struct dcache_entry *);
+
+/* Initializes the dentry cache. */
+void
+dcache_init (void) {
+	size_t i;
+
+	if (!hash_init (&dcache_index, dcache_hash, dcache_less, NULL))
+		PANIC ("dcache_init: out of memory");
+	list_init (&dcache_lru);
+	lock_init (&dcache_lock);
+	dcache_gen = 0;
+	for (i = 0; i < DCACHE_SIZE; i++) {
+		dcache[i].valid = false;
+		list_push_back (&dcache_lru, &dcache[i].lru_elem);
+	}
+}
+
+/* Looks up NAME in the directory whose inode is in sector PARENT.
+   Returns DCACHE_FOUND and sets *CHILD if NAME is cached as
+   existing, DCACHE_ABSENT if it is cached as not existing, or
+   DCACHE_MISS if it is not cached.  In every case sets *GEN to
+   the generation to pass to dcache_insert() or
+   dcache_insert_absent() once NAME has been looked up on disk. */
+enum dcache_result
+dcache_lookup (disk_sector_t parent, const char *name,
+		disk_sector_t *child, uint32_t *gen) {
+	struct dcache_entry *e;
+	enum dcache_result result = DCACHE_MISS;
+
+	lock_acquire (&dcache_lock);
+	*gen = dcache_gen;
+	e = dcache_find (parent, name);
+	if (e != NULL) {
+		list_remove (&e->lru_elem);
+		list_push_front (&dcache_lru, &e->lru_elem);
+		if (e->present) {
+			*child = e->child;
+			result = DCACHE_FOUND;
+		} else
+			result = DCACHE_ABSENT;
+	}
+	lock_release (&dcache_lock);
+	return result;
+}
+
+/* Caches NAME in directory PARENT as referring to the inode in
+   sector CHILD, unless something was invalidated since GEN was
+   obtained from dcache_lookup(). */
+void
+dcache_insert (disk_sector_t parent, const char *name,
+		disk_sector_t child, uint32_t gen) {
+	dcache_put (parent, name, true, child, gen);
+}
+
+/* Caches NAME as not existing in directory PARENT, unless
+   something was invalidated since GEN was obtained from
+   dcache_lookup(). */
+void
+dcache_insert_absent (disk_sector_t parent, const char *name, uint32_t gen) {
+	dcache_put (parent, name, false, 0, gen);
+}
+
+/* Drops whatever is cached for NAME in directory PARENT.  Must be
+   called after NAME is changed on disk. */
+void
+dcache_invalidate (disk_sector_t parent, const char *name) {
+	struct dcache_entry *e;
+
+	lock_acquire (&dcache_lock);
+	dcache_gen++;
+	e = dcache_find (parent, name);
+	if (e != NULL)
+		dcache_evict (e);
+	lock_release (&dcache_lock);
+}
+
+/* Drops every name cached for directory PARENT. */
+void
+dcache_invalidate_dir (disk_sector_t parent) {
+	size_t i;
+
+	lock_acquire (&dcache_lock);
+	dcache_gen++;
+	for (i = 0; i < DCACHE_SIZE; i++)
+		if (dcache[i].valid && dcache[i].parent == parent)
+			dcache_evict (&dcache[i]);
+	lock_release (&dcache_lock);
+}
+
+/* Returns the entry for NAME in PARENT, or a null pointer if
+   there is none.  A NAME longer than NAME_MAX is never cached, so
+   it is not truncated into a key that could match a shorter one.
+   DCACHE_LOCK must be held. */
+static struct dcache_entry *
+dcache_find (disk_sector_t parent, const char *name) {
+	struct dcache_entry key;
+	struct hash_elem *e;
+
+	if (strlen (name) > NAME_MAX)
+		return NULL;
+	key.parent = parent;
+	strlcpy (key.name, name, sizeof key.name);
+	e = hash_find (&dcache_index, &key.hash_elem);
+	return e != NULL ? hash_entry (e, struct dcache_entry, hash_elem) : NULL;
+}
+
+/* Caches NAME in PARENT as PRESENT, referring to CHILD if so,
+   reusing the least recently used entry, unless the generation
+   is no longer GEN. */
+static void
+dcache_put (disk_sector_t parent, const char *name, bool present,
+		disk_sector_t child, uint32_t gen) {
+	struct dcache_entry *e;
+
+	if (strlen (name) > NAME_MAX)
+		return;
+
+	lock_acquire (&dcache_lock);
+	if (gen == dcache_gen) {
+		e = dcache_find (parent, name);
+		if (e == NULL) {
+			e = list_entry (list_back (&dcache_lru), struct dcache_entry,
+					lru_elem);
+			if (e->valid)
+				dcache_evict (e);
+			e->parent = parent;
+			strlcpy (e->name, name, sizeof e->name);
+			hash_insert (&dcache_index, &e->hash_elem);
+			e->valid = true;
+		}
+		e->present = present;
+		e->child = child;
+		list_remove (&e->lru_elem);
+		list_push_front (&dcache_lru, &e->lru_elem);
+	}
+	lock_release (&dcache_lock);
+}
+
+/* Removes E from the index and makes it the next one reused.
+   DCACHE_LOCK must be held. */
+static void
+dcache_evict (struct dcache_entry *e) {
+	ASSERT (e->valid);
+
+	hash_delete (&dcache_index, &e->hash_elem);
+	e->valid = false;
+	list_remove (&e->lru_elem);
+	list_push_back (&dcache_lru, &e->lru_elem);
+}
+
+/* Returns a hash value for dentry cache entry E. */
+static uint64_t
+dcache_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct dcache_entry *d = hash_entry (e, struct dcache_entry,
+			hash_elem);
+	return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+/* Returns true if dentry cache entry A orders before B. */
+static bool
+dcache_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	const struct dcache_entry *x = hash_entry (a, struct dcache_entry,
+			hash_elem);
+	const struct dcache_entry *y = hash_entry (b, struct dcache_entry,
+			hash_elem);
+
+	if (x->parent != y->parent)
+		return x->parent < y->parent;
+	return strcmp (x->name, y->name) < 0;
+}
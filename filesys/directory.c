@@ -1,10 +1,15 @@
 #include "filesys/directory.h"
+#include <hash.h>
+#include <round.h>
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
 
 /* A directory. */
 struct dir {
@@ -19,25 +24,144 @@ struct dir_entry {
 	bool in_use;                        /* In use or free? */
 };
 
+/* Directories are hash tables, so that finding a name takes one
+ * block read rather than a scan of every entry.
+ *
+ * The directory's data is an array of DISK_SECTOR_SIZE blocks.
+ * Block 0 is a header; every other block holds ENTRIES_PER_BLOCK
+ * entries and belongs to one bucket, either as the bucket's first
+ * block or on its chain of overflow blocks.  A name's bucket is
+ * its hash modulo the bucket count.
+ *
+ * The table grows by linear hashing: whenever the directory gets
+ * fuller than 3/4 of its buckets' first blocks, the bucket at
+ * SPLIT is split in two, by moving the entries that now hash
+ * elsewhere into a new bucket at the end.  Each split touches
+ * only one bucket's blocks, so an insertion never rewrites the
+ * whole directory, and stays small enough for one journal
+ * transaction.
+ *
+ * Directories written before this format, which are a plain array
+ * of entries, have no header and are still read and written as
+ * such. */
+
+/* Identifies a hashed directory's header. */
+#define DIR_MAGIC 0x48444952
+
+/* Directory entries in each block. */
+#define ENTRIES_PER_BLOCK 25
+
+/* Most buckets a directory can have.  Past this, chains grow. */
+#define MAX_BUCKETS 240
+
+/* The start of a hashed directory's header: what it takes to find
+ * the bucket of a name. */
+struct dir_table {
+	uint32_t magic;                     /* DIR_MAGIC. */
+	uint32_t base_cnt;                  /* Buckets at level 0. */
+	uint32_t level;                     /* Times the buckets have doubled. */
+	uint32_t split;                     /* Next bucket to split. */
+};
+
+/* Header, in block 0 of a hashed directory.
+ * Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct dir_header {
+	struct dir_table table;             /* Shape of the hash table. */
+	uint32_t entry_cnt;                 /* Entries in use. */
+	uint32_t block_cnt;                 /* Blocks in the directory. */
+	uint32_t free_block;                /* First unused block, or 0. */
+	uint32_t unused;                    /* Not used. */
+	uint16_t buckets[MAX_BUCKETS];      /* First block of each bucket. */
+};
+
+/* Block of entries in a hashed directory.
+ * Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct dir_block {
+	uint32_t next;                      /* Next block in chain, or 0. */
+	struct dir_entry entries[ENTRIES_PER_BLOCK];
+	uint8_t unused[8];                  /* Not used. */
+};
+
+static bool is_hashed (const struct dir *);
+static bool hdr_write (struct dir *, const struct dir_header *);
+static bool block_write (struct dir *, uint32_t, const struct dir_block *);
+static uint32_t bucket_count (const struct dir_table *);
+static uint32_t bucket_of (const struct dir_table *, const char *name);
+static uint32_t block_alloc (struct dir *, struct dir_header *);
+static bool hashed_insert (struct dir *, struct dir_header *,
+		const struct dir_entry *, struct dir_block *);
+static bool hashed_split (struct dir *, struct dir_header *);
+static bool hashed_remove (struct dir *, struct dir_header *,
+		const char *name, off_t ofs, struct dir_block *);
+
+/* Slab cache for struct dir. */
+static struct kmem_cache *dir_cache;
+
+/* Initializes the directory module. */
+void
+dir_init (void) {
+	dir_cache = kmem_cache_create ("dir", sizeof (struct dir), NULL);
+	if (dir_cache == NULL)
+		PANIC ("dir_init: out of memory");
+	dcache_init ();
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
  * given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (disk_sector_t sector, size_t entry_cnt) {
-	return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+	uint32_t base_cnt = DIV_ROUND_UP (entry_cnt, ENTRIES_PER_BLOCK);
+	struct dir_header *hdr;
+	struct dir *dir;
+	bool success = false;
+	uint32_t i;
+
+	ASSERT (sizeof (struct dir_header) == DISK_SECTOR_SIZE);
+	ASSERT (sizeof (struct dir_block) == DISK_SECTOR_SIZE);
+
+	if (base_cnt == 0)
+		base_cnt = 1;
+	if (base_cnt > MAX_BUCKETS)
+		base_cnt = MAX_BUCKETS;
+
+	hdr = calloc (1, sizeof *hdr);
+	if (hdr == NULL)
+		return false;
+	hdr->table.magic = DIR_MAGIC;
+	hdr->table.base_cnt = base_cnt;
+	hdr->block_cnt = 1 + base_cnt;
+	for (i = 0; i < base_cnt; i++)
+		hdr->buckets[i] = 1 + i;
+
+	/* The buckets' blocks start out zeroed, that is, empty.  Names
+	 * cached for a directory that used SECTOR before are stale. */
+	dcache_invalidate_dir (sector);
+	journal_begin ();
+	if (inode_create (sector, hdr->block_cnt * DISK_SECTOR_SIZE)) {
+		dir = dir_open (inode_open (sector));
+		if (dir != NULL) {
+			success = hdr_write (dir, hdr);
+			dir_close (dir);
+		}
+	}
+	journal_end ();
+	free (hdr);
+	return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
  * it takes ownership.  Returns a null pointer on failure. */
 struct dir *
 dir_open (struct inode *inode) {
-	struct dir *dir = calloc (1, sizeof *dir);
+	struct dir *dir = kmem_cache_zalloc (dir_cache);
 	if (inode != NULL && dir != NULL) {
+		inode_set_metadata (inode);
 		dir->inode = inode;
 		dir->pos = 0;
 		return dir;
 	} else {
 		inode_close (inode);
-		free (dir);
+		kmem_cache_free (dir_cache, dir);
 		return NULL;
 	}
 }
@@ -61,7 +185,7 @@ void
 dir_close (struct dir *dir) {
 	if (dir != NULL) {
 		inode_close (dir->inode);
-		free (dir);
+		kmem_cache_free (dir_cache, dir);
 	}
 }
 
@@ -75,16 +199,50 @@ dir_get_inode (struct dir *dir) {
  * If successful, returns true, sets *EP to the directory entry
  * if EP is non-null, and sets *OFSP to the byte offset of the
  * directory entry if OFSP is non-null.
- * otherwise, returns false and ignores EP and OFSP. */
+ * otherwise, returns false and ignores EP and OFSP.
+ * In a hashed directory, reads just the start of the header, the
+ * first block number of NAME's bucket, and the bucket's blocks,
+ * which are usually one. */
 static bool
 lookup (const struct dir *dir, const char *name,
 		struct dir_entry *ep, off_t *ofsp) {
+	struct dir_table table;
 	struct dir_entry e;
 	size_t ofs;
 
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
+	if (inode_read_at (dir->inode, &table, sizeof table, 0) == sizeof table
+			&& table.magic == DIR_MAGIC) {
+		struct dir_block block;
+		uint16_t first = 0;
+		uint32_t b;
+		int i;
+
+		inode_read_at (dir->inode, &first, sizeof first,
+				offsetof (struct dir_header, buckets)
+				+ bucket_of (&table, name) * sizeof first);
+		for (b = first; b != 0; b = block.next) {
+			if (inode_read_at (dir->inode, &block, sizeof block,
+						b * DISK_SECTOR_SIZE) != sizeof block)
+				return false;
+			for (i = 0; i < ENTRIES_PER_BLOCK; i++) {
+				const struct dir_entry *be = &block.entries[i];
+				if (be->in_use && !strcmp (name, be->name)) {
+					if (ep != NULL)
+						*ep = *be;
+					if (ofsp != NULL)
+						*ofsp = b * DISK_SECTOR_SIZE
+							+ offsetof (struct dir_block, entries)
+							+ i * sizeof *be;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
 	for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 			ofs += sizeof e)
 		if (e.in_use && !strcmp (name, e.name)) {
@@ -100,19 +258,45 @@ lookup (const struct dir *dir, const char *name,
 /* Searches DIR for a file with the given NAME
  * and returns true if one exists, false otherwise.
  * On success, sets *INODE to an inode for the file, otherwise to
- * a null pointer.  The caller must close *INODE. */
+ * a null pointer.  The caller must close *INODE.
+ * Names looked up recently are answered from the dentry cache
+ * without reading DIR. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
 		struct inode **inode) {
+	disk_sector_t parent, child;
 	struct dir_entry e;
+	uint32_t gen;
 
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
-	if (lookup (dir, name, &e, NULL))
-		*inode = inode_open (e.inode_sector);
-	else
+	/* dir_add() refuses such names, so none is on disk. */
+	if (strlen (name) > NAME_MAX) {
 		*inode = NULL;
+		return false;
+	}
+
+	parent = inode_get_inumber (dir->inode);
+	switch (dcache_lookup (parent, name, &child, &gen)) {
+		case DCACHE_FOUND:
+			*inode = inode_open (child);
+			break;
+		case DCACHE_ABSENT:
+			*inode = NULL;
+			break;
+		default:
+			inode_lock_dir (dir->inode);
+			if (lookup (dir, name, &e, NULL)) {
+				dcache_insert (parent, name, e.inode_sector, gen);
+				*inode = inode_open (e.inode_sector);
+			} else {
+				dcache_insert_absent (parent, name, gen);
+				*inode = NULL;
+			}
+			inode_unlock_dir (dir->inode);
+			break;
+	}
 
 	return *inode != NULL;
 }
@@ -136,10 +320,42 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) {
 	if (*name == '\0' || strlen (name) > NAME_MAX)
 		return false;
 
+	journal_begin ();
+	inode_lock_dir (dir->inode);
+
 	/* Check that NAME is not in use. */
 	if (lookup (dir, name, NULL, NULL))
 		goto done;
 
+	if (is_hashed (dir)) {
+		struct dir_header *hdr = malloc (sizeof *hdr);
+		struct dir_block *block = malloc (sizeof *block);
+		bool inserted = false;
+
+		memset (&e, 0, sizeof e);
+		e.in_use = true;
+		strlcpy (e.name, name, sizeof e.name);
+		e.inode_sector = inode_sector;
+
+		/* Write the header back even if the insertion failed, since
+		 * it may have taken a block. */
+		if (hdr != NULL && block != NULL
+				&& inode_read_at (dir->inode, hdr, sizeof *hdr, 0) == sizeof *hdr) {
+			if (hashed_insert (dir, hdr, &e, block)) {
+				hdr->entry_cnt++;
+				inserted = true;
+				if (hdr->entry_cnt
+						> bucket_count (&hdr->table) * ENTRIES_PER_BLOCK * 3 / 4
+						&& bucket_count (&hdr->table) < MAX_BUCKETS)
+					hashed_split (dir, hdr);
+			}
+			success = hdr_write (dir, hdr) && inserted;
+		}
+		free (block);
+		free (hdr);
+		goto done;
+	}
+
 	/* Set OFS to offset of free slot.
 	 * If there are no free slots, then it will be set to the
 	 * current end-of-file.
@@ -159,6 +375,10 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) {
 	success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
 done:
+	if (success)
+		dcache_invalidate (inode_get_inumber (dir->inode), name);
+	inode_unlock_dir (dir->inode);
+	journal_end ();
 	return success;
 }
 
@@ -175,6 +395,9 @@ dir_remove (struct dir *dir, const char *name) {
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
+	journal_begin ();
+	inode_lock_dir (dir->inode);
+
 	/* Find directory entry. */
 	if (!lookup (dir, name, &e, &ofs))
 		goto done;
@@ -185,26 +408,64 @@ dir_remove (struct dir *dir, const char *name) {
 		goto done;
 
 	/* Erase directory entry. */
-	e.in_use = false;
-	if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
-		goto done;
+	if (is_hashed (dir)) {
+		struct dir_header *hdr = malloc (sizeof *hdr);
+		struct dir_block *block = malloc (sizeof *block);
+		bool erased = hdr != NULL && block != NULL
+			&& inode_read_at (dir->inode, hdr, sizeof *hdr, 0) == sizeof *hdr
+			&& hashed_remove (dir, hdr, name, ofs, block)
+			&& hdr_write (dir, hdr);
+
+		free (block);
+		free (hdr);
+		if (!erased)
+			goto done;
+	} else {
+		e.in_use = false;
+		if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+			goto done;
+	}
 
-	/* Remove inode. */
+	/* Remove inode, and forget the name and, if it was a
+	 * directory, everything in it. */
 	inode_remove (inode);
+	dcache_invalidate (inode_get_inumber (dir->inode), name);
+	dcache_invalidate_dir (e.inode_sector);
 	success = true;
 
 done:
+	inode_unlock_dir (dir->inode);
 	inode_close (inode);
+	journal_end ();
 	return success;
 }
 
 /* Reads the next directory entry in DIR and stores the name in
  * NAME.  Returns true if successful, false if the directory
- * contains no more entries. */
+ * contains no more entries.
+ * In a hashed directory, DIR's position counts entry slots in the
+ * blocks after the header. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1]) {
 	struct dir_entry e;
 
+	if (is_hashed (dir)) {
+		for (;;) {
+			off_t block = 1 + dir->pos / ENTRIES_PER_BLOCK;
+			off_t slot = dir->pos % ENTRIES_PER_BLOCK;
+			off_t ofs = block * DISK_SECTOR_SIZE
+				+ offsetof (struct dir_block, entries) + slot * sizeof e;
+
+			if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+				return false;
+			dir->pos++;
+			if (e.in_use) {
+				strlcpy (name, e.name, NAME_MAX + 1);
+				return true;
+			}
+		}
+	}
+
 	while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
 		dir->pos += sizeof e;
 		if (e.in_use) {
@@ -214,3 +475,281 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1]) {
 	}
 	return false;
 }
+
+/* Returns true if DIR is in the hashed format. */
+static bool
+is_hashed (const struct dir *dir) {
+	uint32_t magic;
+
+	return inode_read_at (dir->inode, &magic, sizeof magic, 0) == sizeof magic
+		&& magic == DIR_MAGIC;
+}
+
+/* Writes HDR to DIR's header block. */
+static bool
+hdr_write (struct dir *dir, const struct dir_header *hdr) {
+	return inode_write_at (dir->inode, hdr, sizeof *hdr, 0) == sizeof *hdr;
+}
+
+/* Writes BLOCK to block number B of DIR. */
+static bool
+block_write (struct dir *dir, uint32_t b, const struct dir_block *block) {
+	return inode_write_at (dir->inode, block, sizeof *block,
+			b * DISK_SECTOR_SIZE) == sizeof *block;
+}
+
+/* Returns the number of buckets in TABLE. */
+static uint32_t
+bucket_count (const struct dir_table *table) {
+	return (table->base_cnt << table->level) + table->split;
+}
+
+/* Returns the bucket of TABLE that NAME belongs in. */
+static uint32_t
+bucket_of (const struct dir_table *table, const char *name) {
+	uint32_t hash = hash_string (name);
+	uint32_t b = hash % (table->base_cnt << table->level);
+
+	/* Buckets before SPLIT have been split already. */
+	if (b < table->split)
+		b = hash % (table->base_cnt << (table->level + 1));
+	return b;
+}
+
+/* Takes an unused block of DIR, from the free list or from the
+ * end of the directory, and returns its number with its contents
+ * zeroed.  Updates HDR, which the caller must write back.
+ * Returns 0 if the disk is full. */
+static uint32_t
+block_alloc (struct dir *dir, struct dir_header *hdr) {
+	static const struct dir_block zeros;
+	uint32_t b;
+
+	if (hdr->free_block != 0) {
+		b = hdr->free_block;
+		if (inode_read_at (dir->inode, &hdr->free_block, sizeof hdr->free_block,
+					b * DISK_SECTOR_SIZE) != sizeof hdr->free_block)
+			return 0;
+	} else {
+		if (hdr->block_cnt > UINT16_MAX)
+			return 0;
+		b = hdr->block_cnt++;
+	}
+	if (!block_write (dir, b, &zeros))
+		return 0;
+	return b;
+}
+
+/* Puts entry E in the first free slot of its bucket in DIR,
+ * chaining on a new block if the bucket's blocks are full.  BLOCK
+ * is scratch space.  Updates HDR, which the caller must write
+ * back. */
+static bool
+hashed_insert (struct dir *dir, struct dir_header *hdr,
+		const struct dir_entry *e, struct dir_block *block) {
+	uint32_t bucket = bucket_of (&hdr->table, e->name);
+	uint32_t b = hdr->buckets[bucket], prev = 0;
+	int i;
+
+	for (; b != 0; prev = b, b = block->next) {
+		if (inode_read_at (dir->inode, block, sizeof *block,
+					b * DISK_SECTOR_SIZE) != sizeof *block)
+			return false;
+		for (i = 0; i < ENTRIES_PER_BLOCK; i++)
+			if (!block->entries[i].in_use) {
+				block->entries[i] = *e;
+				return block_write (dir, b, block);
+			}
+	}
+
+	/* Every block of the bucket is full: chain on another. */
+	b = block_alloc (dir, hdr);
+	if (b == 0)
+		return false;
+	memset (block, 0, sizeof *block);
+	block->entries[0] = *e;
+	if (!block_write (dir, b, block))
+		return false;
+	if (prev == 0)
+		hdr->buckets[bucket] = b;
+	else if (inode_write_at (dir->inode, &b, sizeof b,
+				prev * DISK_SECTOR_SIZE) != sizeof b)
+		return false;
+	return true;
+}
+
+/* Splits bucket HDR->SPLIT of DIR, moving the entries that hash
+ * to the new bucket there.  The new bucket is written in full
+ * before the old one is touched, and the old one is then packed
+ * into as few of its blocks as it needs, the rest going to the
+ * free list, so that a failure part way leaves every entry in a
+ * bucket where lookup() finds it.  Updates HDR, which the caller
+ * must write back. */
+static bool
+hashed_split (struct dir *dir, struct dir_header *hdr) {
+	uint32_t old = hdr->table.split, new = bucket_count (&hdr->table);
+	uint32_t free_block = hdr->free_block, block_cnt = hdr->block_cnt;
+	struct dir_table table = hdr->table;
+	struct dir_entry *entries = NULL, tmp;
+	struct dir_block *block;
+	uint32_t *chain = NULL, *fresh = NULL;
+	size_t entry_cnt = 0, chain_cnt = 0, chain_cap = 0;
+	size_t stay_cnt, move_cnt, keep_cnt, fresh_cnt, i;
+	bool success = false;
+	uint32_t b;
+
+	block = malloc (sizeof *block);
+	if (block == NULL)
+		return false;
+
+	/* Read the old bucket's blocks and every entry in them. */
+	for (b = hdr->buckets[old]; b != 0; b = block->next) {
+		if (inode_read_at (dir->inode, block, sizeof *block,
+					b * DISK_SECTOR_SIZE) != sizeof *block)
+			goto done;
+		if (chain_cnt == chain_cap) {
+			size_t cap = chain_cap ? 2 * chain_cap : 4;
+			uint32_t *c = realloc (chain, cap * sizeof *c);
+			struct dir_entry *m = realloc (entries,
+					cap * ENTRIES_PER_BLOCK * sizeof *m);
+			if (c != NULL)
+				chain = c;
+			if (m != NULL)
+				entries = m;
+			if (c == NULL || m == NULL)
+				goto done;
+			chain_cap = cap;
+		}
+		chain[chain_cnt++] = b;
+		for (i = 0; i < ENTRIES_PER_BLOCK; i++)
+			if (block->entries[i].in_use)
+				entries[entry_cnt++] = block->entries[i];
+	}
+	if (chain_cnt == 0)
+		goto done;
+
+	/* Advance the split point, and sort the entries that stay in
+	 * the old bucket ahead of those that move. */
+	if (++table.split == table.base_cnt << table.level) {
+		table.level++;
+		table.split = 0;
+	}
+	for (i = stay_cnt = 0; i < entry_cnt; i++)
+		if (bucket_of (&table, entries[i].name) == old) {
+			tmp = entries[stay_cnt];
+			entries[stay_cnt++] = entries[i];
+			entries[i] = tmp;
+		}
+	move_cnt = entry_cnt - stay_cnt;
+
+	/* Write the new bucket, chaining as many blocks as it needs.
+	 * On failure, the blocks taken for it are abandoned. */
+	fresh_cnt = move_cnt > 0 ? DIV_ROUND_UP (move_cnt, ENTRIES_PER_BLOCK) : 1;
+	fresh = malloc (fresh_cnt * sizeof *fresh);
+	if (fresh == NULL)
+		goto done;
+	for (i = 0; i < fresh_cnt; i++)
+		if ((fresh[i] = block_alloc (dir, hdr)) == 0)
+			goto restore;
+	for (i = 0; i < fresh_cnt; i++) {
+		size_t first = i * ENTRIES_PER_BLOCK;
+		size_t cnt = move_cnt - first < ENTRIES_PER_BLOCK
+			? move_cnt - first : ENTRIES_PER_BLOCK;
+
+		memset (block, 0, sizeof *block);
+		block->next = i + 1 < fresh_cnt ? fresh[i + 1] : 0;
+		if (move_cnt > 0)
+			memcpy (block->entries, &entries[stay_cnt + first],
+					cnt * sizeof *block->entries);
+		if (!block_write (dir, fresh[i], block))
+			goto restore;
+	}
+	hdr->table = table;
+	hdr->buckets[new] = fresh[0];
+
+	/* Pack what stays into the old bucket's first blocks.  Until the
+	 * last of them is written, the rest of the chain still holds
+	 * its entries. */
+	keep_cnt = stay_cnt > 0 ? DIV_ROUND_UP (stay_cnt, ENTRIES_PER_BLOCK) : 1;
+	for (i = 0; i < keep_cnt; i++) {
+		size_t first = i * ENTRIES_PER_BLOCK;
+		size_t cnt = stay_cnt - first < ENTRIES_PER_BLOCK
+			? stay_cnt - first : ENTRIES_PER_BLOCK;
+
+		memset (block, 0, sizeof *block);
+		block->next = i + 1 < keep_cnt ? chain[i + 1] : 0;
+		if (stay_cnt > 0)
+			memcpy (block->entries, &entries[first],
+					cnt * sizeof *block->entries);
+		if (!block_write (dir, chain[i], block))
+			goto done;
+	}
+
+	/* Free the blocks left over. */
+	success = true;
+	for (i = keep_cnt; i < chain_cnt; i++) {
+		memset (block, 0, sizeof *block);
+		block->next = hdr->free_block;
+		if (block_write (dir, chain[i], block))
+			hdr->free_block = chain[i];
+		else
+			success = false;
+	}
+	goto done;
+
+restore:
+	hdr->free_block = free_block;
+	hdr->block_cnt = block_cnt;
+done:
+	free (fresh);
+	free (chain);
+	free (entries);
+	free (block);
+	return success;
+}
+
+/* Erases the entry for NAME at byte offset OFS of DIR, where
+ * lookup() found it.  An overflow block that this leaves empty
+ * is unlinked from its bucket's chain and put on the free list.
+ * BLOCK is scratch space.  Updates HDR, which the caller must
+ * write back. */
+static bool
+hashed_remove (struct dir *dir, struct dir_header *hdr, const char *name,
+		off_t ofs, struct dir_block *block) {
+	uint32_t b = ofs / DISK_SECTOR_SIZE;
+	uint32_t first = hdr->buckets[bucket_of (&hdr->table, name)];
+	size_t slot = (ofs % DISK_SECTOR_SIZE
+			- offsetof (struct dir_block, entries)) / sizeof *block->entries;
+	uint32_t prev, next;
+	size_t i;
+
+	if (inode_read_at (dir->inode, block, sizeof *block,
+				b * DISK_SECTOR_SIZE) != sizeof *block)
+		return false;
+	block->entries[slot].in_use = false;
+	hdr->entry_cnt--;
+
+	/* A bucket keeps its first block even when empty. */
+	for (i = 0; i < ENTRIES_PER_BLOCK; i++)
+		if (block->entries[i].in_use)
+			break;
+	if (b == first || i < ENTRIES_PER_BLOCK)
+		return block_write (dir, b, block);
+
+	/* Link the block before B in the chain past it. */
+	for (prev = first; prev != 0; prev = next) {
+		if (inode_read_at (dir->inode, &next, sizeof next,
+					prev * DISK_SECTOR_SIZE) != sizeof next)
+			return false;
+		if (next == b)
+			break;
+	}
+	if (prev == 0
+			|| inode_write_at (dir->inode, &block->next, sizeof block->next,
+				prev * DISK_SECTOR_SIZE) != sizeof block->next)
+		return false;
+
+	block->next = hdr->free_block;
+	hdr->free_block = b;
+	return block_write (dir, b, block);
+}
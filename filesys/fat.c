@@ -1,8 +1,10 @@
 #include "filesys/fat.h"
 #include "devices/disk.h"
 #include "filesys/filesys.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
+#include <round.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -24,12 +26,32 @@ struct fat_fs {
 	disk_sector_t data_start;
 	cluster_t last_clst;
 	struct lock write_lock;
+	uint64_t *free_bits;     /* Bit set for each free cluster. */
+	unsigned int free_cnt;   /* Number of free clusters. */
+	uint64_t *pending_bits;  /* Freed, but not committed to the journal. */
+	unsigned int pending_cnt;   /* Number of bits set in PENDING_BITS. */
+	uint64_t *dirty_bits;    /* Bit set for each modified FAT sector. */
+	unsigned int dirty_cnt;  /* Number of bits set in DIRTY_BITS. */
 };
 
+/* Number of clusters, or FAT sectors, tracked by each word of the
+ * free and dirty bitmaps. */
+#define FREE_BITS 64
+
+/* Most FAT sectors fat_flush() writes with one disk command. */
+#define FLUSH_RUN 16
+
+/* Number of FAT entries in a sector. */
+#define ENTRIES_PER_SECTOR (DISK_SECTOR_SIZE / sizeof (cluster_t))
+
 static struct fat_fs *fat_fs;
 
 void fat_boot_create (void);
 void fat_fs_init (void);
+static void fat_table_alloc (void);
+static void free_bits_build (void);
+static cluster_t find_run (unsigned int want);
+static bool cluster_free (cluster_t);
 
 void
 fat_init (void) {
@@ -41,7 +63,9 @@ fat_init (void) {
 	unsigned int *bounce = malloc (DISK_SECTOR_SIZE);
 	if (bounce == NULL)
 		PANIC ("FAT init failed");
+	enum disk_io_class old_class = disk_io_class_set (DISK_IO_ALLOC);
 	disk_read (filesys_disk, FAT_BOOT_SECTOR, bounce);
+	disk_io_class_set (old_class);
 	memcpy (&fat_fs->bs, bounce, sizeof (fat_fs->bs));
 	free (bounce);
 
@@ -53,31 +77,15 @@ fat_init (void) {
 
 void
 fat_open (void) {
-	fat_fs->fat = calloc (fat_fs->fat_length, sizeof (cluster_t));
-	if (fat_fs->fat == NULL)
-		PANIC ("FAT load failed");
-
-	// Load FAT directly from the disk
-	uint8_t *buffer = (uint8_t *) fat_fs->fat;
-	off_t bytes_read = 0;
-	off_t bytes_left = sizeof (fat_fs->fat);
-	const off_t fat_size_in_bytes = fat_fs->fat_length * sizeof (cluster_t);
-	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++) {
-		bytes_left = fat_size_in_bytes - bytes_read;
-		if (bytes_left >= DISK_SECTOR_SIZE) {
-			disk_read (filesys_disk, fat_fs->bs.fat_start + i,
-			           buffer + bytes_read);
-			bytes_read += DISK_SECTOR_SIZE;
-		} else {
-			uint8_t *bounce = malloc (DISK_SECTOR_SIZE);
-			if (bounce == NULL)
-				PANIC ("FAT load failed");
-			disk_read (filesys_disk, fat_fs->bs.fat_start + i, bounce);
-			memcpy (buffer + bytes_read, bounce, bytes_left);
-			bytes_read += bytes_left;
-			free (bounce);
-		}
-	}
+	fat_table_alloc ();
+
+	// Load FAT directly from the disk, in one run
+	enum disk_io_class old_class = disk_io_class_set (DISK_IO_ALLOC);
+	disk_read_multiple (filesys_disk, fat_fs->bs.fat_start, fat_fs->fat,
+	                    fat_fs->bs.fat_sectors);
+	disk_io_class_set (old_class);
+
+	free_bits_build ();
 }
 
 void
@@ -87,30 +95,102 @@ fat_close (void) {
 	if (bounce == NULL)
 		PANIC ("FAT close failed");
 	memcpy (bounce, &fat_fs->bs, sizeof (fat_fs->bs));
+	enum disk_io_class old_class = disk_io_class_set (DISK_IO_ALLOC);
 	disk_write (filesys_disk, FAT_BOOT_SECTOR, bounce);
+	disk_io_class_set (old_class);
 	free (bounce);
 
-	// Write FAT directly to the disk
-	uint8_t *buffer = (uint8_t *) fat_fs->fat;
-	off_t bytes_wrote = 0;
-	off_t bytes_left = sizeof (fat_fs->fat);
-	const off_t fat_size_in_bytes = fat_fs->fat_length * sizeof (cluster_t);
-	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++) {
-		bytes_left = fat_size_in_bytes - bytes_wrote;
-		if (bytes_left >= DISK_SECTOR_SIZE) {
-			disk_write (filesys_disk, fat_fs->bs.fat_start + i,
-			            buffer + bytes_wrote);
-			bytes_wrote += DISK_SECTOR_SIZE;
-		} else {
-			bounce = calloc (1, DISK_SECTOR_SIZE);
-			if (bounce == NULL)
-				PANIC ("FAT close failed");
-			memcpy (bounce, buffer + bytes_wrote, bytes_left);
-			disk_write (filesys_disk, fat_fs->bs.fat_start + i, bounce);
-			bytes_wrote += bytes_left;
-			free (bounce);
+	// Write the modified part of the FAT
+	fat_flush ();
+}
+
+/* Returns the number of FAT sectors modified since they were last
+ * written back. */
+unsigned int
+fat_dirty_cnt (void) {
+	return fat_fs != NULL ? fat_fs->dirty_cnt : 0;
+}
+
+/* Returns the number of freed clusters that fat_commit_frees()
+ * has yet to make allocatable. */
+unsigned int
+fat_pending_cnt (void) {
+	return fat_fs != NULL ? fat_fs->pending_cnt : 0;
+}
+
+/* Passes each modified FAT sector to journal_log(), which writes
+ * it home once it has been committed, until the journal is full.
+ * Called by the journal while no metadata is being changed. */
+void
+fat_log_pending (void) {
+	size_t words, w;
+
+	if (fat_fs == NULL || fat_fs->dirty_bits == NULL)
+		return;
+	words = DIV_ROUND_UP (fat_fs->bs.fat_sectors, FREE_BITS);
+	lock_acquire (&fat_fs->write_lock);
+	for (w = 0; w < words; w++) {
+		while (fat_fs->dirty_bits[w] != 0) {
+			uint64_t bits = fat_fs->dirty_bits[w];
+			unsigned b = 0;
+			size_t sector;
+
+			while (!(bits & ((uint64_t) 1 << b)))
+				b++;
+			sector = w * FREE_BITS + b;
+			if (!journal_log (fat_fs->bs.fat_start + sector,
+			                  (uint8_t *) fat_fs->fat + sector * DISK_SECTOR_SIZE,
+			                  DISK_IO_ALLOC))
+				goto done;
+			fat_fs->dirty_bits[w] &= ~((uint64_t) 1 << b);
+			fat_fs->dirty_cnt--;
 		}
 	}
+done:
+	lock_release (&fat_fs->write_lock);
+}
+
+/* Writes the FAT sectors modified since they were last written
+ * back to disk, in ascending order, each run of adjacent ones,
+ * up to FLUSH_RUN sectors, with one disk command.  A run is
+ * copied out under the write lock, so that allocation can go on
+ * while it is being written. */
+void
+fat_flush (void) {
+	size_t sector, cnt;
+	uint8_t *bounce;
+	enum disk_io_class old_class;
+
+	if (fat_fs == NULL || fat_fs->dirty_bits == NULL)
+		return;
+	bounce = malloc (FLUSH_RUN * DISK_SECTOR_SIZE);
+	if (bounce == NULL)
+		PANIC ("FAT flush failed");
+	old_class = disk_io_class_set (DISK_IO_ALLOC);
+	for (sector = 0; sector < fat_fs->bs.fat_sectors; sector += cnt) {
+		lock_acquire (&fat_fs->write_lock);
+		for (cnt = 0; cnt < FLUSH_RUN
+		     && sector + cnt < fat_fs->bs.fat_sectors; cnt++) {
+			size_t s = sector + cnt;
+			uint64_t bit = (uint64_t) 1 << (s % FREE_BITS);
+
+			if (!(fat_fs->dirty_bits[s / FREE_BITS] & bit))
+				break;
+			fat_fs->dirty_bits[s / FREE_BITS] &= ~bit;
+			fat_fs->dirty_cnt--;
+		}
+		memcpy (bounce, (uint8_t *) fat_fs->fat + sector * DISK_SECTOR_SIZE,
+		        cnt * DISK_SECTOR_SIZE);
+		lock_release (&fat_fs->write_lock);
+
+		if (cnt > 0)
+			disk_write_multiple (filesys_disk, fat_fs->bs.fat_start + sector,
+			                     bounce, cnt);
+		else
+			cnt = 1;
+	}
+	disk_io_class_set (old_class);
+	free (bounce);
 }
 
 void
@@ -119,10 +199,12 @@ fat_create (void) {
 	fat_boot_create ();
 	fat_fs_init ();
 
-	// Create FAT table
-	fat_fs->fat = calloc (fat_fs->fat_length, sizeof (cluster_t));
-	if (fat_fs->fat == NULL)
-		PANIC ("FAT creation failed");
+	// Create FAT table, all of which has to be written out
+	fat_table_alloc ();
+	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++)
+		fat_fs->dirty_bits[i / FREE_BITS] |= (uint64_t) 1 << (i % FREE_BITS);
+	fat_fs->dirty_cnt = fat_fs->bs.fat_sectors;
+	free_bits_build ();
 
 	// Set up ROOT_DIR_CLST
 	fat_put (ROOT_DIR_CLUSTER, EOChain);
@@ -131,7 +213,9 @@ fat_create (void) {
 	uint8_t *buf = calloc (1, DISK_SECTOR_SIZE);
 	if (buf == NULL)
 		PANIC ("FAT create failed due to OOM");
+	enum disk_io_class old_class = disk_io_class_set (DISK_IO_DIR);
 	disk_write (filesys_disk, cluster_to_sector (ROOT_DIR_CLUSTER), buf);
+	disk_io_class_set (old_class);
 	free (buf);
 }
 
@@ -152,7 +236,20 @@ fat_boot_create (void) {
 
 void
 fat_fs_init (void) {
-	/* TODO: Your code goes here. */
+	unsigned int data_clusters;
+
+	/* Data clusters follow the FAT, up to the journal at the end
+	 * of the disk.  Cluster numbers start at 1, so that 0 can mean
+	 * "free", and the table has one entry per cluster number, as
+	 * many as fit in the FAT sectors. */
+	fat_fs->data_start = fat_fs->bs.fat_start + fat_fs->bs.fat_sectors;
+	data_clusters = (fat_fs->bs.total_sectors - JOURNAL_SECTORS
+	                 - fat_fs->data_start) / SECTORS_PER_CLUSTER;
+	fat_fs->fat_length = data_clusters + 1;
+	if (fat_fs->fat_length > fat_fs->bs.fat_sectors * ENTRIES_PER_SECTOR)
+		fat_fs->fat_length = fat_fs->bs.fat_sectors * ENTRIES_PER_SECTOR;
+	fat_fs->last_clst = ROOT_DIR_CLUSTER;
+	lock_init (&fat_fs->write_lock);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -164,30 +261,254 @@ fat_fs_init (void) {
  * Returns 0 if fails to allocate a new cluster. */
 cluster_t
 fat_create_chain (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	unsigned int added;
+	return fat_create_chain_run (clst, 1, &added);
+}
+
+/* Adds up to CNT clusters after CLST, or starts a new chain of
+ * them if CLST is 0, and stores the number added in *ADDED.
+ * Clusters are taken in contiguous runs where possible: first
+ * right after CLST, then from the first free run long enough to
+ * hold the rest, searching from where the last allocation ended.
+ * Fewer than CNT clusters are added only if the disk fills up.
+ * Returns the first cluster added, or 0 if none could be.
+ * Adding after a cluster other than the last changes links that
+ * the chain's owner may have cached; it must drop them itself. */
+cluster_t
+fat_create_chain_run (cluster_t clst, unsigned int cnt,
+		unsigned int *added) {
+	cluster_t first = 0, prev = clst, next = EOChain;
+	unsigned int n = 0;
+
+	lock_acquire (&fat_fs->write_lock);
+	if (clst != 0)
+		next = fat_get (clst);
+
+	while (n < cnt && fat_fs->free_cnt > 0) {
+		cluster_t c;
+
+		if (prev != 0 && prev + 1 < fat_fs->fat_length
+				&& cluster_free (prev + 1))
+			c = prev + 1;
+		else
+			c = find_run (cnt - n);
+
+		/* Take as much of the run at C as is needed. */
+		for (; n < cnt && c < fat_fs->fat_length && cluster_free (c); c++) {
+			fat_put (c, EOChain);
+			if (prev != 0)
+				fat_put (prev, c);
+			if (first == 0)
+				first = c;
+			prev = c;
+			n++;
+		}
+		fat_fs->last_clst = prev;
+	}
+	if (n > 0 && next != EOChain)
+		fat_put (prev, next);
+
+	lock_release (&fat_fs->write_lock);
+	*added = n;
+	return first;
 }
 
 /* Remove the chain of clusters starting from CLST.
- * If PCLST is 0, assume CLST as the start of the chain. */
+ * If PCLST is 0, assume CLST as the start of the chain.
+ * Otherwise the chain is cut short at PCLST, and its owner must
+ * drop what it has cached of the links past PCLST. */
 void
 fat_remove_chain (cluster_t clst, cluster_t pclst) {
-	/* TODO: Your code goes here. */
+	lock_acquire (&fat_fs->write_lock);
+	if (pclst != 0)
+		fat_put (pclst, EOChain);
+	while (clst != 0 && clst != EOChain) {
+		cluster_t next = fat_get (clst);
+		fat_put (clst, 0);
+		clst = next;
+	}
+	lock_release (&fat_fs->write_lock);
 }
 
 /* Update a value in the FAT table. */
 void
 fat_put (cluster_t clst, cluster_t val) {
-	/* TODO: Your code goes here. */
+	uint64_t bit = (uint64_t) 1 << (clst % FREE_BITS);
+	cluster_t old;
+
+	ASSERT (clst >= 1 && clst < fat_fs->fat_length);
+	old = fat_fs->fat[clst];
+	if (old == val)
+		return;
+	fat_fs->fat[clst] = val;
+	if (!(fat_fs->dirty_bits[clst / ENTRIES_PER_SECTOR / FREE_BITS]
+	      & ((uint64_t) 1 << (clst / ENTRIES_PER_SECTOR % FREE_BITS)))) {
+		fat_fs->dirty_bits[clst / ENTRIES_PER_SECTOR / FREE_BITS] |=
+			(uint64_t) 1 << (clst / ENTRIES_PER_SECTOR % FREE_BITS);
+		fat_fs->dirty_cnt++;
+	}
+
+	/* Keep the free bitmap in step.  A freed cluster only becomes
+	 * free there once the journal has committed its release. */
+	if (old == 0 && val != 0) {
+		ASSERT (fat_fs->free_bits[clst / FREE_BITS] & bit);
+		fat_fs->free_bits[clst / FREE_BITS] &= ~bit;
+		fat_fs->free_cnt--;
+	} else if (old != 0 && val == 0) {
+		fat_fs->pending_bits[clst / FREE_BITS] |= bit;
+		fat_fs->pending_cnt++;
+	}
 }
 
 /* Fetch a value in the FAT table. */
 cluster_t
 fat_get (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst >= 1 && clst < fat_fs->fat_length);
+	return fat_fs->fat[clst];
 }
 
 /* Covert a cluster # to a sector number. */
 disk_sector_t
 cluster_to_sector (cluster_t clst) {
-	/* TODO: Your code goes here. */
+	ASSERT (clst >= 1 && clst < fat_fs->fat_length);
+	return fat_fs->data_start + (clst - 1) * SECTORS_PER_CLUSTER;
+}
+
+/* Makes the clusters freed before the journal checkpoint that
+ * just finished available for allocation. */
+void
+fat_commit_frees (void) {
+	size_t words, w;
+
+	if (fat_fs == NULL || fat_fs->pending_cnt == 0)
+		return;
+	words = DIV_ROUND_UP (fat_fs->fat_length, FREE_BITS);
+	lock_acquire (&fat_fs->write_lock);
+	for (w = 0; w < words; w++) {
+		fat_fs->free_bits[w] |= fat_fs->pending_bits[w];
+		fat_fs->pending_bits[w] = 0;
+	}
+	fat_fs->free_cnt += fat_fs->pending_cnt;
+	fat_fs->pending_cnt = 0;
+	lock_release (&fat_fs->write_lock);
+}
+
+/* Converts SECTOR, which must be the first sector of a data
+ * cluster, back to the cluster's number. */
+cluster_t
+sector_to_cluster (disk_sector_t sector) {
+	ASSERT (sector >= fat_fs->data_start);
+	ASSERT ((sector - fat_fs->data_start) % SECTORS_PER_CLUSTER == 0);
+	return (sector - fat_fs->data_start) / SECTORS_PER_CLUSTER + 1;
+}
+
+/* Allocates a zeroed FAT table, whole sectors of it so that it can
+ * be read and written in place, and a clean dirty-sector bitmap. */
+static void
+fat_table_alloc (void) {
+	free (fat_fs->fat);
+	free (fat_fs->dirty_bits);
+	fat_fs->fat = calloc (fat_fs->bs.fat_sectors, DISK_SECTOR_SIZE);
+	fat_fs->dirty_bits = calloc (DIV_ROUND_UP (fat_fs->bs.fat_sectors,
+	                                           FREE_BITS),
+	                             sizeof *fat_fs->dirty_bits);
+	if (fat_fs->fat == NULL || fat_fs->dirty_bits == NULL)
+		PANIC ("FAT table allocation failed");
+}
+
+/* Rebuilds the free-cluster bitmap from the FAT, one bitmap word
+ * at a time. */
+static void
+free_bits_build (void) {
+	size_t words = DIV_ROUND_UP (fat_fs->fat_length, FREE_BITS);
+	size_t w;
+
+	free (fat_fs->free_bits);
+	free (fat_fs->pending_bits);
+	fat_fs->free_bits = calloc (words, sizeof *fat_fs->free_bits);
+	fat_fs->pending_bits = calloc (words, sizeof *fat_fs->pending_bits);
+	if (fat_fs->free_bits == NULL || fat_fs->pending_bits == NULL)
+		PANIC ("FAT free map creation failed");
+
+	fat_fs->free_cnt = fat_fs->pending_cnt = 0;
+	for (w = 0; w < words; w++) {
+		const cluster_t *e = fat_fs->fat + w * FREE_BITS;
+		size_t cnt = fat_fs->fat_length - w * FREE_BITS;
+		uint64_t bits = 0;
+		size_t i;
+
+		if (cnt > FREE_BITS)
+			cnt = FREE_BITS;
+		for (i = w == 0 ? 1 : 0; i < cnt; i++)  /* No cluster 0. */
+			if (e[i] == 0) {
+				bits |= (uint64_t) 1 << i;
+				fat_fs->free_cnt++;
+			}
+		fat_fs->free_bits[w] = bits;
+	}
+}
+
+/* Returns the first cluster of the first run of at least WANT
+ * free clusters at or after the next-fit cursor, wrapping around
+ * to the start of the disk.  If there is no run that long, returns
+ * the start of the longest one.  Skips over full bitmap words
+ * without looking at their clusters.  There must be at least one
+ * free cluster. */
+static cluster_t
+find_run (unsigned int want) {
+	size_t words = DIV_ROUND_UP (fat_fs->fat_length, FREE_BITS);
+	size_t start = (fat_fs->last_clst + 1) / FREE_BITS;
+	cluster_t run_start = 0, best = 0;
+	unsigned int run_len = 0, best_len = 0;
+	size_t i;
+
+	ASSERT (fat_fs->free_cnt > 0);
+
+	/* Visit every word once, from START's word round to it again,
+	 * treating the wrap as the end of any run. */
+	for (i = 0; i <= words; i++) {
+		size_t w = (start + i) % words;
+		uint64_t bits = fat_fs->free_bits[w];
+
+		if (w == 0 || bits == 0) {
+			if (run_len > best_len) {
+				best = run_start;
+				best_len = run_len;
+			}
+			run_len = 0;
+			if (bits == 0)
+				continue;
+		}
+		if (bits == UINT64_MAX && run_len + FREE_BITS < want) {
+			/* Whole word free: extend the run without looking. */
+			if (run_len == 0)
+				run_start = w * FREE_BITS;
+			run_len += FREE_BITS;
+			continue;
+		}
+		for (unsigned b = 0; b < FREE_BITS; b++) {
+			if (bits & ((uint64_t) 1 << b)) {
+				if (run_len++ == 0)
+					run_start = w * FREE_BITS + b;
+				if (run_len >= want)
+					return run_start;
+			} else {
+				if (run_len > best_len) {
+					best = run_start;
+					best_len = run_len;
+				}
+				run_len = 0;
+			}
+		}
+	}
+	if (run_len > best_len)
+		best = run_start;
+	return best;
+}
+
+/* Returns true if CLST may be allocated. */
+static bool
+cluster_free (cluster_t clst) {
+	return (fat_fs->free_bits[clst / FREE_BITS]
+	        & ((uint64_t) 1 << (clst % FREE_BITS))) != 0;
 }
@@ -2,8 +2,10 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/buffer-cache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "devices/disk.h"
@@ -12,6 +14,7 @@
 struct disk *filesys_disk;
 
 static void do_format (void);
+static bool do_create (const char *name, off_t initial_size);
 
 /* Initializes the file system module.
  * If FORMAT is true, reformats the file system. */
@@ -21,7 +24,11 @@ filesys_init (bool format) {
 	if (filesys_disk == NULL)
 		PANIC ("hd0:1 (hdb) not present, file system initialization failed");
 
+	buffer_cache_init ();
 	inode_init ();
+	file_init ();
+	dir_init ();
+	journal_init (format);
 
 #ifdef EFILESYS
 	fat_init ();
@@ -39,18 +46,23 @@ filesys_init (bool format) {
 
 	free_map_open ();
 #endif
+
+	pagecache_init ();
 }
 
 /* Shuts down the file system module, writing any unwritten data
  * to disk. */
 void
 filesys_done (void) {
+	journal_checkpoint ();
+
 	/* Original FS */
 #ifdef EFILESYS
 	fat_close ();
 #else
 	free_map_close ();
 #endif
+	buffer_cache_done ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -59,15 +71,31 @@ filesys_done (void) {
  * or if internal memory allocation fails. */
 bool
 filesys_create (const char *name, off_t initial_size) {
+	/* Recently freed space only becomes allocatable at the next
+	 * checkpoint, so a create that ran out of space may succeed
+	 * after one. */
+	return do_create (name, initial_size)
+		|| (free_map_reclaim () && do_create (name, initial_size));
+}
+
+/* Creates a file named NAME with the given INITIAL_SIZE in one
+ * journal operation. */
+static bool
+do_create (const char *name, off_t initial_size) {
 	disk_sector_t inode_sector = 0;
-	struct dir *dir = dir_open_root ();
-	bool success = (dir != NULL
+	struct dir *dir;
+	bool success;
+
+	journal_begin ();
+	dir = dir_open_root ();
+	success = (dir != NULL
 			&& free_map_allocate (1, &inode_sector)
 			&& inode_create (inode_sector, initial_size)
 			&& dir_add (dir, name, inode_sector));
 	if (!success && inode_sector != 0)
 		free_map_release (inode_sector, 1);
 	dir_close (dir);
+	journal_end ();
 
 	return success;
 }
@@ -95,9 +123,14 @@ filesys_open (const char *name) {
  * or if an internal memory allocation fails. */
 bool
 filesys_remove (const char *name) {
-	struct dir *dir = dir_open_root ();
-	bool success = dir != NULL && dir_remove (dir, name);
+	struct dir *dir;
+	bool success;
+
+	journal_begin ();
+	dir = dir_open_root ();
+	success = dir != NULL && dir_remove (dir, name);
 	dir_close (dir);
+	journal_end ();
 
 	return success;
 }
@@ -108,8 +141,11 @@ do_format (void) {
 	printf ("Formatting file system...");
 
 #ifdef EFILESYS
-	/* Create FAT and save it to the disk. */
+	/* Create FAT and the root directory, and save them to the
+	 * disk. */
 	fat_create ();
+	if (!dir_create (ROOT_DIR_SECTOR, 16))
+		PANIC ("root directory creation failed");
 	fat_close ();
 #else
 	free_map_create ();
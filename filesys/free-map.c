@@ -1,47 +1,188 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
+#ifdef EFILESYS
+#include "filesys/fat.h"
+#endif
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
 
+/* Sectors that may be allocated: those free in FREE_MAP, except
+ * ones released since the last journal checkpoint.  Until the
+ * release is committed, a crash could bring back the file that
+ * used them, so they must not be overwritten yet. */
+static struct bitmap *alloc_map;
+
+/* Free map bits held by one sector of the free map file. */
+#define BLOCK_BITS (DISK_SECTOR_SIZE * 8)
+
+/* One bit per sector of the free map file, set if FREE_MAP has
+ * changed there since it was last written.  Only those sectors
+ * are written, once per operation, by free_map_flush(). */
+static struct bitmap *dirty_blocks;
+
+/* Index of the runs of sectors free in ALLOC_MAP, so that
+ * allocation does not have to scan the bitmap.
+ *
+ * Each run is on the list of its size class, the runs whose
+ * length has the same highest bit, kept in order of address.
+ * Allocating CNT sectors takes the first run long enough in the
+ * class of CNT, or failing that, the first run of the smallest
+ * larger class that has one, and carves the sectors off its
+ * start.  This is close to best fit, and of the runs that fit
+ * equally well it picks the lowest, which keeps files that are
+ * written together close together.
+ *
+ * Both ends of every run are also hashed, so that a released run
+ * can be merged with the free runs right before and after it. */
+#define RUN_CLASS_CNT 32
+
+struct free_run {
+	disk_sector_t start;             /* First sector. */
+	disk_sector_t length;            /* Number of sectors. */
+	struct list_elem class_elem;     /* In a RUN_CLASSES list. */
+	struct hash_elem start_elem;     /* In RUNS_BY_START. */
+	struct hash_elem end_elem;       /* In RUNS_BY_END. */
+};
+
+static struct list run_classes[RUN_CLASS_CNT];
+static struct hash runs_by_start;
+static struct hash runs_by_end;
+static struct kmem_cache *run_cache;
+
+/* Set if a run could not be indexed for lack of memory.  Runs
+ * missing from the index are still free in ALLOC_MAP, so
+ * allocation falls back to scanning it, until the index is
+ * rebuilt at the next commit. */
+static bool index_incomplete;
+
+/* Released runs, waiting for the next commit to become
+ * allocatable.  Each is a struct free_run that is in no index. */
+static struct list released;
+
+/* Protects everything above. */
+static struct lock free_map_lock;
+
+static void alloc_map_sync (void);
+static void index_rebuild (void);
+static void index_insert (disk_sector_t, disk_sector_t length);
+static void index_add (struct free_run *);
+static void index_remove (struct free_run *);
+#ifndef EFILESYS
+static void mark_dirty (disk_sector_t, size_t cnt);
+static disk_sector_t index_allocate (size_t cnt);
+#endif
+static uint64_t run_start_hash (const struct hash_elem *, void *);
+static bool run_start_less (const struct hash_elem *,
+		const struct hash_elem *, void *);
+static uint64_t run_end_hash (const struct hash_elem *, void *);
+static bool run_end_less (const struct hash_elem *,
+		const struct hash_elem *, void *);
+
 /* Initializes the free map. */
 void
 free_map_init (void) {
+	size_t i;
+
 	free_map = bitmap_create (disk_size (filesys_disk));
-	if (free_map == NULL)
+	alloc_map = bitmap_create (disk_size (filesys_disk));
+	dirty_blocks = bitmap_create (DIV_ROUND_UP (disk_size (filesys_disk),
+				BLOCK_BITS));
+	if (run_cache == NULL)
+		run_cache = kmem_cache_create ("free_run", sizeof (struct free_run),
+				NULL);
+	if (free_map == NULL || alloc_map == NULL || dirty_blocks == NULL
+			|| run_cache == NULL
+			|| !hash_init (&runs_by_start, run_start_hash, run_start_less, NULL)
+			|| !hash_init (&runs_by_end, run_end_hash, run_end_less, NULL))
 		PANIC ("bitmap creation failed--disk is too large");
+	for (i = 0; i < RUN_CLASS_CNT; i++)
+		list_init (&run_classes[i]);
+	list_init (&released);
+	lock_init (&free_map_lock);
+
 	bitmap_mark (free_map, FREE_MAP_SECTOR);
 	bitmap_mark (free_map, ROOT_DIR_SECTOR);
+	bitmap_set_multiple (free_map, journal_start (), JOURNAL_SECTORS, true);
+	alloc_map_sync ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
  * the first into *SECTORP.
  * Returns true if successful, false if all sectors were
- * available. */
+ * available.
+ * With the FAT file system, the sectors are those of a new
+ * one-cluster chain, so CNT may be at most SECTORS_PER_CLUSTER. */
 bool
 free_map_allocate (size_t cnt, disk_sector_t *sectorp) {
-	disk_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-	if (sector != BITMAP_ERROR
-			&& free_map_file != NULL
-			&& !bitmap_write (free_map, free_map_file)) {
-		bitmap_set_multiple (free_map, sector, cnt, false);
-		sector = BITMAP_ERROR;
+#ifdef EFILESYS
+	cluster_t clst;
+
+	ASSERT (cnt <= SECTORS_PER_CLUSTER);
+	clst = fat_create_chain (0);
+	if (clst == 0)
+		return false;
+	*sectorp = cluster_to_sector (clst);
+	return true;
+#else
+	disk_sector_t sector;
+
+	lock_acquire (&free_map_lock);
+	sector = index_allocate (cnt);
+	if (sector == BITMAP_ERROR && index_incomplete) {
+		/* The run found may be in the index in part, so the index
+		   has to be rebuilt around it. */
+		sector = bitmap_scan (alloc_map, 0, cnt, false);
+		if (sector != BITMAP_ERROR) {
+			bitmap_set_multiple (alloc_map, sector, cnt, true);
+			index_rebuild ();
+		}
 	}
-	if (sector != BITMAP_ERROR)
+	if (sector != BITMAP_ERROR) {
+		bitmap_set_multiple (alloc_map, sector, cnt, true);
+		bitmap_set_multiple (free_map, sector, cnt, true);
+		mark_dirty (sector, cnt);
 		*sectorp = sector;
+	}
+	lock_release (&free_map_lock);
 	return sector != BITMAP_ERROR;
+#endif
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Makes CNT sectors starting at SECTOR available for use, once
+ * the release has been committed to the journal. */
 void
 free_map_release (disk_sector_t sector, size_t cnt) {
+#ifdef EFILESYS
+	ASSERT (cnt <= SECTORS_PER_CLUSTER);
+	fat_remove_chain (sector_to_cluster (sector), 0);
+#else
+	struct free_run *r;
+
+	lock_acquire (&free_map_lock);
 	ASSERT (bitmap_all (free_map, sector, cnt));
 	bitmap_set_multiple (free_map, sector, cnt, false);
-	bitmap_write (free_map, free_map_file);
+	mark_dirty (sector, cnt);
+	r = kmem_cache_alloc (run_cache);
+	if (r != NULL) {
+		r->start = sector;
+		r->length = cnt;
+		list_push_back (&released, &r->class_elem);
+	} else
+		index_incomplete = true;
+	lock_release (&free_map_lock);
+#endif
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -50,8 +191,295 @@ free_map_open (void) {
 	free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
 	if (free_map_file == NULL)
 		PANIC ("can't open free map");
+	inode_set_metadata (file_get_inode (free_map_file));
 	if (!bitmap_read (free_map, free_map_file))
 		PANIC ("can't read free map");
+	alloc_map_sync ();
+}
+
+/* Writes the sectors of the free map file that hold changes to
+ * the free map.  Called by journal_end() at the end of every
+ * operation, while it still counts as in progress, so that the
+ * writes join the same transaction as the changes that caused
+ * them. */
+void
+free_map_flush (void) {
+#ifndef EFILESYS
+	size_t block;
+
+	if (free_map_file == NULL)
+		return;
+
+	lock_acquire (&free_map_lock);
+	while ((block = bitmap_scan_and_flip (dirty_blocks, 0, 1, true))
+			!= BITMAP_ERROR) {
+		size_t start = block * BLOCK_BITS;
+		size_t cnt = bitmap_size (free_map) - start < BLOCK_BITS
+			? bitmap_size (free_map) - start : BLOCK_BITS;
+
+		if (!bitmap_write_part (free_map, free_map_file, start, cnt))
+			PANIC ("can't write free map");
+	}
+	lock_release (&free_map_lock);
+#endif
+}
+
+/* Lets sectors released before the journal checkpoint that just
+ * finished be allocated again.  Called by the journal while no
+ * metadata is being changed. */
+void
+free_map_commit (void) {
+#ifdef EFILESYS
+	fat_commit_frees ();
+#else
+	if (free_map == NULL)
+		return;
+
+	lock_acquire (&free_map_lock);
+	if (index_incomplete)
+		alloc_map_sync ();
+	else
+		while (!list_empty (&released)) {
+			struct free_run *r = list_entry (list_pop_front (&released),
+					struct free_run, class_elem);
+
+			bitmap_set_multiple (alloc_map, r->start, r->length, false);
+			index_insert (r->start, r->length);
+			kmem_cache_free (run_cache, r);
+		}
+	lock_release (&free_map_lock);
+#endif
+}
+
+/* Checkpoints the journal if space released since the last
+ * checkpoint is waiting for it, so that the space can be
+ * allocated.  Returns true if it did, in which case an allocation
+ * that failed is worth retrying.  Does nothing inside a journal
+ * operation, since the checkpoint would wait for it to end. */
+bool
+free_map_reclaim (void) {
+	bool pending;
+
+	if (thread_current ()->journal_depth > 0)
+		return false;
+#ifdef EFILESYS
+	pending = fat_pending_cnt () > 0;
+#else
+	lock_acquire (&free_map_lock);
+	pending = !list_empty (&released) || index_incomplete;
+	lock_release (&free_map_lock);
+#endif
+	if (!pending)
+		return false;
+	journal_checkpoint ();
+	return true;
+}
+
+/* Makes ALLOC_MAP a copy of FREE_MAP, forgetting any released
+ * runs, and rebuilds the index from it. */
+static void
+alloc_map_sync (void) {
+	size_t sector = 0;
+
+	while (!list_empty (&released))
+		kmem_cache_free (run_cache, list_entry (list_pop_front (&released),
+					struct free_run, class_elem));
+
+	bitmap_set_all (alloc_map, true);
+	while ((sector = bitmap_scan (free_map, sector, 1, false))
+			!= BITMAP_ERROR) {
+		size_t end = bitmap_scan (free_map, sector, 1, true);
+
+		if (end == BITMAP_ERROR)
+			end = bitmap_size (free_map);
+		bitmap_set_multiple (alloc_map, sector, end - sector, false);
+		sector = end;
+	}
+	index_rebuild ();
+}
+
+#ifndef EFILESYS
+/* Notes that the CNT bits of FREE_MAP starting at SECTOR have
+ * changed. */
+static void
+mark_dirty (disk_sector_t sector, size_t cnt) {
+	size_t first = sector / BLOCK_BITS;
+	size_t last = (sector + cnt - 1) / BLOCK_BITS;
+
+	if (cnt > 0)
+		bitmap_set_multiple (dirty_blocks, first, last - first + 1, true);
+}
+#endif
+
+/* Empties the index and fills it again with the runs free in
+ * ALLOC_MAP. */
+static void
+index_rebuild (void) {
+	size_t sector = 0;
+	size_t i;
+
+	for (i = 0; i < RUN_CLASS_CNT; i++)
+		while (!list_empty (&run_classes[i])) {
+			struct free_run *r = list_entry (list_front (&run_classes[i]),
+					struct free_run, class_elem);
+
+			index_remove (r);
+			kmem_cache_free (run_cache, r);
+		}
+	index_incomplete = false;
+
+	while ((sector = bitmap_scan (alloc_map, sector, 1, false))
+			!= BITMAP_ERROR) {
+		size_t end = bitmap_scan (alloc_map, sector, 1, true);
+
+		if (end == BITMAP_ERROR)
+			end = bitmap_size (alloc_map);
+		index_insert (sector, end - sector);
+		sector = end;
+	}
+}
+
+/* Returns the size class of runs of LENGTH sectors. */
+static size_t
+run_class (disk_sector_t length) {
+	ASSERT (length > 0);
+	return 31 - __builtin_clz (length);
+}
+
+/* Adds the LENGTH free sectors starting at START to the index,
+ * merging them with the runs they adjoin. */
+static void
+index_insert (disk_sector_t start, disk_sector_t length) {
+	struct free_run key, *r;
+	struct hash_elem *e;
+
+	/* The run that ends where this one starts. */
+	key.start = start;
+	key.length = 0;
+	e = hash_find (&runs_by_end, &key.end_elem);
+	if (e != NULL) {
+		r = hash_entry (e, struct free_run, end_elem);
+		index_remove (r);
+		start = r->start;
+		length += r->length;
+		kmem_cache_free (run_cache, r);
+	}
+
+	/* The run that starts where this one ends. */
+	key.start = start + length;
+	e = hash_find (&runs_by_start, &key.start_elem);
+	if (e != NULL) {
+		r = hash_entry (e, struct free_run, start_elem);
+		index_remove (r);
+		length += r->length;
+		kmem_cache_free (run_cache, r);
+	}
+
+	r = kmem_cache_alloc (run_cache);
+	if (r == NULL) {
+		index_incomplete = true;
+		return;
+	}
+	r->start = start;
+	r->length = length;
+	index_add (r);
+}
+
+/* Returns true if run A starts before run B. */
+static bool
+run_addr_less (const struct list_elem *a, const struct list_elem *b,
+		void *aux UNUSED) {
+	return list_entry (a, struct free_run, class_elem)->start
+		< list_entry (b, struct free_run, class_elem)->start;
+}
+
+/* Puts R into the index. */
+static void
+index_add (struct free_run *r) {
+	list_insert_ordered (&run_classes[run_class (r->length)], &r->class_elem,
+			run_addr_less, NULL);
+	hash_insert (&runs_by_start, &r->start_elem);
+	hash_insert (&runs_by_end, &r->end_elem);
+}
+
+/* Takes R out of the index. */
+static void
+index_remove (struct free_run *r) {
+	list_remove (&r->class_elem);
+	hash_delete (&runs_by_start, &r->start_elem);
+	hash_delete (&runs_by_end, &r->end_elem);
+}
+
+#ifndef EFILESYS
+/* Takes CNT sectors out of the index and returns the first of
+ * them, or BITMAP_ERROR if no indexed run is long enough. */
+static disk_sector_t
+index_allocate (size_t cnt) {
+	struct free_run *r = NULL;
+	disk_sector_t sector;
+	size_t class;
+
+	if (cnt == 0)
+		return 0;
+	for (class = run_class (cnt); class < RUN_CLASS_CNT && r == NULL;
+			class++) {
+		struct list_elem *e;
+
+		for (e = list_begin (&run_classes[class]);
+				e != list_end (&run_classes[class]); e = list_next (e)) {
+			struct free_run *c = list_entry (e, struct free_run, class_elem);
+
+			if (c->length >= cnt) {
+				r = c;
+				break;
+			}
+		}
+	}
+	if (r == NULL)
+		return BITMAP_ERROR;
+
+	/* Carve the sectors off the start of the run. */
+	index_remove (r);
+	sector = r->start;
+	r->start += cnt;
+	r->length -= cnt;
+	if (r->length > 0)
+		index_add (r);
+	else
+		kmem_cache_free (run_cache, r);
+	return sector;
+}
+#endif
+
+/* Hashes a run by its first sector. */
+static uint64_t
+run_start_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct free_run *r = hash_entry (e, struct free_run, start_elem);
+	return hash_int (r->start);
+}
+
+/* Orders runs by their first sector. */
+static bool
+run_start_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct free_run, start_elem)->start
+		< hash_entry (b, struct free_run, start_elem)->start;
+}
+
+/* Hashes a run by the sector just past its end. */
+static uint64_t
+run_end_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct free_run *r = hash_entry (e, struct free_run, end_elem);
+	return hash_int (r->start + r->length);
+}
+
+/* Orders runs by the sector just past their end. */
+static bool
+run_end_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	const struct free_run *ra = hash_entry (a, struct free_run, end_elem);
+	const struct free_run *rb = hash_entry (b, struct free_run, end_elem);
+	return ra->start + ra->length < rb->start + rb->length;
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -72,6 +500,8 @@ free_map_create (void) {
 	free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
 	if (free_map_file == NULL)
 		PANIC ("can't open free map");
+	inode_set_metadata (file_get_inode (free_map_file));
 	if (!bitmap_write (free_map, free_map_file))
 		PANIC ("can't write free map");
+	bitmap_set_all (dirty_blocks, false);
 }
@@ -1,23 +1,95 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/buffer-cache.h"
+#ifdef EFILESYS
+#include "filesys/fat.h"
+#endif
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of sectors to read ahead of a sequential reader. */
+#define READ_AHEAD_SECTORS 4
+
+/* Number of closed inodes kept in memory for reopening. */
+#define UNUSED_INODES 64
+
+/* Most sectors a write adds to a file in one journaled operation,
+ * which keeps the metadata it logs within what the journal
+ * reserves for an operation. */
+#define GROW_SECTORS 8
+
+#ifndef EFILESYS
+/* Number of sectors reserved past the end of a growing file, so
+ * that later appends stay contiguous with it. */
+#define PREALLOC_SECTORS 16
+
+/* A file's data is kept as a sorted list of extents, each mapping
+ * a run of file sectors onto a run of contiguous disk sectors.
+ * The first INLINE_EXTENTS live in the inode; the rest live in a
+ * chain of indirect extent blocks, BLOCK_EXTENTS to a block.
+ * While an inode is open, all of its extents are kept in memory
+ * in one array, which byte_to_sector() binary searches. */
+struct extent {
+	uint32_t logical;                   /* First file sector covered. */
+	disk_sector_t start;                /* First disk sector. */
+	uint32_t length;                    /* Number of sectors. */
+};
+
+#define INLINE_EXTENTS 41
+#define BLOCK_EXTENTS 42
+
+/* On-disk inode.
+ * Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct inode_disk {
+	off_t length;                       /* File size in bytes. */
+	unsigned magic;                     /* Magic number. */
+	uint32_t extent_cnt;                /* Number of extents in all. */
+	disk_sector_t indirect;             /* First indirect extent block. */
+	struct extent extents[INLINE_EXTENTS];  /* First extents. */
+	uint32_t unused;                    /* Not used. */
+};
+
+/* Indirect extent block.
+ * Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct extent_block {
+	disk_sector_t next;                 /* Next block, 0 if last. */
+	uint32_t cnt;                       /* Extents used in this block. */
+	struct extent extents[BLOCK_EXTENTS];   /* Extents. */
+};
+
+#else /* EFILESYS */
+/* With the FAT file system, a file's data is a chain of clusters
+ * in the FAT, starting at the cluster named in its inode.  Since
+ * finding the Nth cluster of a chain means following N links, an
+ * open inode keeps an index of every INDEX_STRIDE'th cluster of
+ * its chain, filled in lazily as far as accesses have reached.
+ * A lookup then follows at most INDEX_STRIDE - 1 links from the
+ * nearest indexed cluster, however long the file is. */
+#define INDEX_STRIDE 8
+
+/* Bytes per cluster. */
+#define CLUSTER_SIZE (SECTORS_PER_CLUSTER * DISK_SECTOR_SIZE)
+
 /* On-disk inode.
  * Must be exactly DISK_SECTOR_SIZE bytes long. */
 struct inode_disk {
-	disk_sector_t start;                /* First data sector. */
 	off_t length;                       /* File size in bytes. */
 	unsigned magic;                     /* Magic number. */
+	cluster_t start;                    /* First data cluster, 0 if none. */
 	uint32_t unused[125];               /* Not used. */
 };
+#endif /* EFILESYS */
 
 /* Returns the number of sectors to allocate for an inode SIZE
  * bytes long. */
@@ -28,35 +100,523 @@ bytes_to_sectors (off_t size) {
 
 /* In-memory inode. */
 struct inode {
-	struct list_elem elem;              /* Element in inode list. */
+	struct hash_elem elem;              /* Element in inode_table. */
+	struct list_elem unused_elem;       /* Element in unused_inodes. */
 	disk_sector_t sector;               /* Sector number of disk location. */
-	int open_cnt;                       /* Number of openers. */
+	int open_cnt;                       /* Number of openers, 0 if unused. */
 	bool removed;                       /* True if deleted, false otherwise. */
+	bool loading;                       /* Still being read in? */
+	bool metadata;                      /* Journal writes to its data? */
 	int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+	struct lock dir_lock;               /* Serializes a directory's changes. */
+	struct lock lock;                   /* Protects the members below. */
+	off_t ra_next;                      /* Where a sequential read would start. */
+	off_t ra_end;                       /* End of the read-ahead already posted. */
+#ifndef EFILESYS
+	struct extent *extents;             /* All DATA.EXTENT_CNT extents. */
+	size_t extent_cap;                  /* Capacity of EXTENTS. */
+	disk_sector_t *blocks;              /* Indirect extent block sectors. */
+	size_t block_cnt;                   /* Number of BLOCKS. */
+	disk_sector_t prealloc_start;       /* Sectors reserved for appends. */
+	size_t prealloc_cnt;                /* Number of reserved sectors. */
+#else
+	cluster_t *index;                   /* Cluster INDEX_STRIDE * i at [i]. */
+	size_t index_cnt;                   /* Number of entries in INDEX. */
+	size_t index_cap;                   /* Capacity of INDEX. */
+#endif
 	struct inode_disk data;             /* Inode content. */
 };
 
+/* Returns the I/O class of INODE's data: the free map's, a
+ * directory's, or a regular file's. */
+static enum disk_io_class
+data_class (const struct inode *inode) {
+	if (!inode->metadata)
+		return DISK_IO_DATA;
+	return inode->sector == FREE_MAP_SECTOR ? DISK_IO_ALLOC : DISK_IO_DIR;
+}
+
+#ifndef EFILESYS
+/* Returns the disk sector that contains byte offset POS within
+ * INODE.
+ * Returns -1 if INODE does not contain data for a byte at offset
+ * POS. */
+static disk_sector_t
+byte_to_sector (struct inode *inode, off_t pos) {
+	disk_sector_t sector = -1;
+
+	ASSERT (inode != NULL);
+	lock_acquire (&inode->lock);
+	if (pos < inode->data.length) {
+		uint32_t target = pos / DISK_SECTOR_SIZE;
+		size_t lo = 0, hi = inode->data.extent_cnt;
+
+		/* Find the last extent that starts at or before TARGET. */
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (inode->extents[mid].logical <= target)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo > 0) {
+			const struct extent *e = &inode->extents[lo - 1];
+			if (target - e->logical < e->length)
+				sector = e->start + (target - e->logical);
+		}
+	}
+	lock_release (&inode->lock);
+	return sector;
+}
+
+/* Returns the number of file sectors INODE's extents map. */
+static size_t
+mapped_sectors (const struct inode *inode) {
+	const struct extent *last;
+
+	if (inode->data.extent_cnt == 0)
+		return 0;
+	last = &inode->extents[inode->data.extent_cnt - 1];
+	return last->logical + last->length;
+}
+
+/* Reads INODE's extents from the inode and its indirect extent
+ * blocks into memory.  Returns false if memory is short. */
+static bool
+map_load (struct inode *inode) {
+	size_t cnt = inode->data.extent_cnt;
+	size_t i, copied;
+	disk_sector_t next;
+
+	inode->extent_cap = cnt > INLINE_EXTENTS ? cnt : INLINE_EXTENTS;
+	inode->extents = malloc (inode->extent_cap * sizeof *inode->extents);
+	inode->blocks = NULL;
+	inode->block_cnt = 0;
+	if (inode->extents == NULL)
+		return false;
+
+	copied = cnt < INLINE_EXTENTS ? cnt : INLINE_EXTENTS;
+	memcpy (inode->extents, inode->data.extents,
+			copied * sizeof *inode->extents);
+
+	for (next = inode->data.indirect; copied < cnt && next != 0; ) {
+		struct extent_block block;
+		disk_sector_t *blocks = realloc (inode->blocks,
+				(inode->block_cnt + 1) * sizeof *inode->blocks);
+
+		if (blocks == NULL)
+			return false;
+		inode->blocks = blocks;
+		inode->blocks[inode->block_cnt++] = next;
+
+		buffer_cache_read (next, &block, 0, DISK_SECTOR_SIZE);
+		for (i = 0; i < block.cnt && copied < cnt; i++)
+			inode->extents[copied++] = block.extents[i];
+		next = block.next;
+	}
+	return copied == cnt;
+}
+
+/* Writes INODE and those of its indirect extent blocks that hold
+ * extent FIRST or a later one back to the buffer cache,
+ * allocating blocks as needed.  Returns false if out of disk
+ * space. */
+static bool
+extents_sync (struct inode *inode, size_t first) {
+	size_t cnt = inode->data.extent_cnt;
+	size_t block_need, b;
+	enum disk_io_class old_class;
+
+	memcpy (inode->data.extents, inode->extents,
+			(cnt < INLINE_EXTENTS ? cnt : INLINE_EXTENTS)
+			* sizeof *inode->extents);
+
+	block_need = cnt > INLINE_EXTENTS
+		? DIV_ROUND_UP (cnt - INLINE_EXTENTS, BLOCK_EXTENTS) : 0;
+	while (inode->block_cnt < block_need) {
+		disk_sector_t *blocks = realloc (inode->blocks,
+				(inode->block_cnt + 1) * sizeof *inode->blocks);
+		if (blocks == NULL)
+			return false;
+		inode->blocks = blocks;
+		if (!free_map_allocate (1, &inode->blocks[inode->block_cnt]))
+			return false;
+		inode->block_cnt++;
+	}
+
+	old_class = disk_io_class_set (DISK_IO_INODE);
+	b = first < INLINE_EXTENTS ? 0 : (first - INLINE_EXTENTS) / BLOCK_EXTENTS;
+	for (; b < block_need; b++) {
+		struct extent_block block;
+		size_t base = INLINE_EXTENTS + b * BLOCK_EXTENTS;
+
+		memset (&block, 0, sizeof block);
+		block.next = b + 1 < inode->block_cnt ? inode->blocks[b + 1] : 0;
+		block.cnt = cnt - base < BLOCK_EXTENTS ? cnt - base : BLOCK_EXTENTS;
+		memcpy (block.extents, inode->extents + base,
+				block.cnt * sizeof *block.extents);
+		buffer_cache_write_logged (inode->blocks[b], &block, 0,
+				DISK_SECTOR_SIZE);
+	}
+
+	inode->data.indirect = inode->block_cnt > 0 ? inode->blocks[0] : 0;
+	buffer_cache_write_logged (inode->sector, &inode->data, 0,
+			DISK_SECTOR_SIZE);
+	disk_io_class_set (old_class);
+	return true;
+}
+
+/* Maps the CNT disk sectors starting at START onto the end of
+ * INODE's data, extending the last extent if they follow it on
+ * disk.  Returns false if memory is short. */
+static bool
+extent_append (struct inode *inode, disk_sector_t start, size_t cnt) {
+	size_t n = inode->data.extent_cnt;
+	struct extent *last = n > 0 ? &inode->extents[n - 1] : NULL;
+
+	if (last != NULL && last->start + last->length == start) {
+		last->length += cnt;
+		return true;
+	}
+
+	if (n == inode->extent_cap) {
+		size_t cap = inode->extent_cap * 2;
+		struct extent *extents = realloc (inode->extents,
+				cap * sizeof *extents);
+		if (extents == NULL)
+			return false;
+		inode->extents = extents;
+		inode->extent_cap = cap;
+	}
+	inode->extents[n].logical = mapped_sectors (inode);
+	inode->extents[n].start = start;
+	inode->extents[n].length = cnt;
+	inode->data.extent_cnt++;
+	return true;
+}
+
+/* Allocates a run of up to WANT contiguous free sectors, halving
+ * the request until one fits, and stores its first sector in
+ * *START.  Returns the number of sectors allocated, 0 if the disk
+ * is full. */
+static size_t
+alloc_run (size_t want, disk_sector_t *start) {
+	for (; want > 0; want /= 2)
+		if (free_map_allocate (want, start))
+			return want;
+	return 0;
+}
+
+/* Gives back the sectors INODE has reserved for appends. */
+static void
+prealloc_release (struct inode *inode) {
+	if (inode->prealloc_cnt > 0) {
+		free_map_release (inode->prealloc_start, inode->prealloc_cnt);
+		inode->prealloc_cnt = 0;
+	}
+}
+
+/* Extends INODE to LENGTH bytes, allocating and zeroing the
+ * sectors that this needs.  Appends are served first from the
+ * sectors reserved past the end of the file; when those run out,
+ * a fresh run of PREALLOC_SECTORS more than needed is reserved,
+ * so that a file written in small pieces still ends up mostly
+ * contiguous.  When no contiguous run is large enough, smaller
+ * ones are used.  Returns false if the disk or memory is full, in
+ * which case INODE is extended as far as possible. */
+static bool
+inode_grow (struct inode *inode, off_t length) {
+	size_t need = bytes_to_sectors (length);
+	size_t have, first;
+	bool success = true;
+	enum disk_io_class old_class;
+
+	lock_acquire (&inode->lock);
+	if (length <= inode->data.length) {
+		lock_release (&inode->lock);
+		return true;
+	}
+	old_class = disk_io_class_set (data_class (inode));
+
+	have = mapped_sectors (inode);
+	first = inode->data.extent_cnt > 0 ? inode->data.extent_cnt - 1 : 0;
+	while (have < need) {
+		size_t want = need - have, got, i;
+		disk_sector_t start;
+
+		if (inode->prealloc_cnt > 0) {
+			got = want < inode->prealloc_cnt ? want : inode->prealloc_cnt;
+			start = inode->prealloc_start;
+			inode->prealloc_start += got;
+			inode->prealloc_cnt -= got;
+		} else {
+			got = alloc_run (want + PREALLOC_SECTORS, &start);
+			if (got == 0) {
+				success = false;
+				break;
+			}
+			if (got > want) {
+				inode->prealloc_start = start + want;
+				inode->prealloc_cnt = got - want;
+				got = want;
+			}
+		}
+
+		if (!extent_append (inode, start, got)) {
+			free_map_release (start, got);
+			success = false;
+			break;
+		}
+		for (i = 0; i < got; i++)
+			buffer_cache_zero (start + i);
+		have += got;
+	}
+
+	if (have * DISK_SECTOR_SIZE < (size_t) length)
+		length = have * DISK_SECTOR_SIZE;
+	if (length > inode->data.length)
+		inode->data.length = length;
+	if (!extents_sync (inode, first))
+		success = false;
+	disk_io_class_set (old_class);
+	lock_release (&inode->lock);
+	return success;
+}
+
+/* Frees all of INODE's data sectors and indirect extent blocks. */
+static void
+inode_release_data (struct inode *inode) {
+	size_t i;
+
+	prealloc_release (inode);
+	for (i = 0; i < inode->data.extent_cnt; i++)
+		free_map_release (inode->extents[i].start, inode->extents[i].length);
+	for (i = 0; i < inode->block_cnt; i++)
+		free_map_release (inode->blocks[i], 1);
+	inode->data.extent_cnt = 0;
+	inode->block_cnt = 0;
+}
+
+/* Frees the in-memory copy of INODE's extents and gives back the
+ * sectors it has reserved for appends. */
+static void
+map_unload (struct inode *inode) {
+	prealloc_release (inode);
+	free (inode->extents);
+	free (inode->blocks);
+}
+
+/* Gives back the sectors INODE has reserved for appends, as its
+ * last opener closes it, but keeps its extents in memory. */
+static void
+map_idle (struct inode *inode) {
+	lock_acquire (&inode->lock);
+	prealloc_release (inode);
+	lock_release (&inode->lock);
+}
+#else /* EFILESYS */
+/* Returns the cluster that holds cluster N of INODE's data, or 0
+ * if INODE's chain is shorter than that.  Extends INODE's cluster
+ * index as far as it needs to, starting over if the chain no
+ * longer starts where the index does.  Only INODE changes links
+ * of its own chain, and it only appends to it or frees all of it,
+ * which leaves what the index holds valid.  INODE's lock must be
+ * held. */
+static cluster_t
+file_cluster (struct inode *inode, size_t n) {
+	size_t slot = n / INDEX_STRIDE;
+	cluster_t clst;
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&inode->lock));
+
+	if (inode->index_cnt > 0 && inode->index[0] != inode->data.start)
+		inode->index_cnt = 0;
+	if (inode->index_cnt == 0) {
+		if (inode->data.start == 0)
+			return 0;
+		if (inode->index_cap == 0) {
+			inode->index = malloc (sizeof *inode->index);
+			if (inode->index == NULL)
+				return 0;
+			inode->index_cap = 1;
+		}
+		inode->index[inode->index_cnt++] = inode->data.start;
+	}
+
+	/* Index the chain up to slot SLOT. */
+	while (inode->index_cnt <= slot) {
+		clst = inode->index[inode->index_cnt - 1];
+		for (i = 0; i < INDEX_STRIDE; i++) {
+			clst = fat_get (clst);
+			if (clst == EOChain || clst == 0)
+				return 0;
+		}
+		if (inode->index_cnt == inode->index_cap) {
+			size_t cap = inode->index_cap * 2;
+			cluster_t *index = realloc (inode->index, cap * sizeof *index);
+			if (index == NULL)
+				return 0;
+			inode->index = index;
+			inode->index_cap = cap;
+		}
+		inode->index[inode->index_cnt++] = clst;
+	}
+
+	/* Walk the rest of the way from there. */
+	clst = inode->index[slot];
+	for (i = slot * INDEX_STRIDE; i < n; i++) {
+		clst = fat_get (clst);
+		if (clst == EOChain || clst == 0)
+			return 0;
+	}
+	return clst;
+}
+
 /* Returns the disk sector that contains byte offset POS within
  * INODE.
  * Returns -1 if INODE does not contain data for a byte at offset
  * POS. */
 static disk_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) {
+byte_to_sector (struct inode *inode, off_t pos) {
+	disk_sector_t sector = -1;
+
 	ASSERT (inode != NULL);
-	if (pos < inode->data.length)
-		return inode->data.start + pos / DISK_SECTOR_SIZE;
-	else
-		return -1;
+	lock_acquire (&inode->lock);
+	if (pos < inode->data.length) {
+		cluster_t clst = file_cluster (inode, pos / CLUSTER_SIZE);
+		if (clst != 0)
+			sector = cluster_to_sector (clst)
+				+ pos % CLUSTER_SIZE / DISK_SECTOR_SIZE;
+	}
+	lock_release (&inode->lock);
+	return sector;
+}
+
+/* Reads nothing: INODE's cluster index is built on demand. */
+static bool
+map_load (struct inode *inode) {
+	inode->index = NULL;
+	inode->index_cnt = inode->index_cap = 0;
+	return true;
+}
+
+/* Frees INODE's cluster index. */
+static void
+map_unload (struct inode *inode) {
+	free (inode->index);
+}
+
+/* Keeps INODE's cluster index while it is unused. */
+static void
+map_idle (struct inode *inode UNUSED) {
+}
+
+/* Extends INODE to LENGTH bytes, appending zeroed clusters to its
+ * chain.  The clusters are asked for all at once, so that they
+ * come out as contiguous as free space allows.  Returns false if
+ * the disk or memory is full, in which case INODE is extended as
+ * far as possible. */
+static bool
+inode_grow (struct inode *inode, off_t length) {
+	size_t need = DIV_ROUND_UP (length, CLUSTER_SIZE);
+	size_t have;
+	cluster_t tail = 0;
+	bool success = true;
+	enum disk_io_class old_class;
+
+	lock_acquire (&inode->lock);
+	if (length <= inode->data.length) {
+		lock_release (&inode->lock);
+		return true;
+	}
+
+	have = DIV_ROUND_UP (inode->data.length, CLUSTER_SIZE);
+	if (have > 0 && (tail = file_cluster (inode, have - 1)) == 0) {
+		lock_release (&inode->lock);
+		return false;
+	}
+	if (have < need) {
+		unsigned int added, i, j;
+		cluster_t clst = fat_create_chain_run (tail, need - have, &added);
+
+		if (tail == 0 && added > 0)
+			inode->data.start = clst;
+		old_class = disk_io_class_set (data_class (inode));
+		for (i = 0; i < added; i++, clst = fat_get (clst))
+			for (j = 0; j < SECTORS_PER_CLUSTER; j++)
+				buffer_cache_zero (cluster_to_sector (clst) + j);
+		disk_io_class_set (old_class);
+		have += added;
+		success = have == need;
+	}
+
+	if (have * CLUSTER_SIZE < (size_t) length)
+		length = have * CLUSTER_SIZE;
+	if (length > inode->data.length)
+		inode->data.length = length;
+	old_class = disk_io_class_set (DISK_IO_INODE);
+	buffer_cache_write_logged (inode->sector, &inode->data, 0,
+			DISK_SECTOR_SIZE);
+	disk_io_class_set (old_class);
+	lock_release (&inode->lock);
+	return success;
+}
+
+/* Frees INODE's chain of data clusters. */
+static void
+inode_release_data (struct inode *inode) {
+	if (inode->data.start != 0) {
+		fat_remove_chain (inode->data.start, 0);
+		inode->data.start = 0;
+	}
+	inode->index_cnt = 0;
 }
+#endif /* EFILESYS */
+
+/* In-memory inodes, indexed by sector, so that opening a single
+ * inode twice returns the same `struct inode'.
+ *
+ * When the last opener closes an inode that has not been
+ * removed, it stays in the table, with its disk inode and data
+ * map, on the UNUSED_INODES list of unused inodes.  Reopening it
+ * then reads nothing from disk.  Past UNUSED_INODES, the least
+ * recently closed one is freed.
+ *
+ * An inode being read in is already in the table, marked LOADING,
+ * so that the disk is read without INODE_TABLE_LOCK held, and
+ * others opening the same inode wait on INODE_LOADED for it
+ * instead of reading it again.
+ *
+ * INODE_TABLE_LOCK protects the table, the list, and every
+ * inode's OPEN_CNT and LOADING. */
+static struct hash inode_table;
+static struct list unused_inodes;       /* Most recently closed first. */
+static size_t unused_cnt;               /* Length of UNUSED_INODES. */
+static struct lock inode_table_lock;
+static struct condition inode_loaded;   /* Signaled when LOADING clears. */
 
-/* List of open inodes, so that opening a single inode twice
- * returns the same `struct inode'. */
-static struct list open_inodes;
+/* Slab cache for struct inode. */
+static struct kmem_cache *inode_cache;
+
+static uint64_t inode_hash (const struct hash_elem *, void *);
+static bool inode_less (const struct hash_elem *, const struct hash_elem *,
+		void *);
+static struct inode *inode_find (disk_sector_t);
+static void inode_free (struct inode *);
 
 /* Initializes the inode module. */
 void
 inode_init (void) {
-	list_init (&open_inodes);
+	if (!hash_init (&inode_table, inode_hash, inode_less, NULL))
+		PANIC ("inode_init: out of memory");
+	list_init (&unused_inodes);
+	unused_cnt = 0;
+	lock_init (&inode_table_lock);
+	cond_init (&inode_loaded);
+	inode_cache = kmem_cache_create ("inode", sizeof (struct inode), NULL);
+	if (inode_cache == NULL)
+		PANIC ("inode_init: out of memory");
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -67,31 +627,55 @@ inode_init (void) {
 bool
 inode_create (disk_sector_t sector, off_t length) {
 	struct inode_disk *disk_inode = NULL;
+	struct inode *inode;
+	enum disk_io_class old_class;
 	bool success = false;
 
 	ASSERT (length >= 0);
 
-	/* If this assertion fails, the inode structure is not exactly
-	 * one sector in size, and you should fix that. */
+	/* If these assertions fail, the inode structure or an extent
+	 * block is not exactly one sector in size, and you should fix
+	 * that. */
 	ASSERT (sizeof *disk_inode == DISK_SECTOR_SIZE);
+#ifndef EFILESYS
+	ASSERT (sizeof (struct extent_block) == DISK_SECTOR_SIZE);
+#endif
 
+	/* Write an empty inode, then grow it to LENGTH.  An unused
+	 * inode still cached for SECTOR, from a file whose creation
+	 * failed, is stale. */
 	disk_inode = calloc (1, sizeof *disk_inode);
 	if (disk_inode != NULL) {
-		size_t sectors = bytes_to_sectors (length);
-		disk_inode->length = length;
+		struct inode *stale;
+
+		lock_acquire (&inode_table_lock);
+		stale = inode_find (sector);
+		if (stale != NULL) {
+			ASSERT (stale->open_cnt == 0);
+			hash_delete (&inode_table, &stale->elem);
+			list_remove (&stale->unused_elem);
+			unused_cnt--;
+		}
+		lock_release (&inode_table_lock);
+		if (stale != NULL)
+			inode_free (stale);
+
+		disk_inode->length = 0;
 		disk_inode->magic = INODE_MAGIC;
-		if (free_map_allocate (sectors, &disk_inode->start)) {
-			disk_write (filesys_disk, sector, disk_inode);
-			if (sectors > 0) {
-				static char zeros[DISK_SECTOR_SIZE];
-				size_t i;
-
-				for (i = 0; i < sectors; i++) 
-					disk_write (filesys_disk, disk_inode->start + i, zeros); 
-			}
-			success = true; 
-		} 
+		journal_begin ();
+		old_class = disk_io_class_set (DISK_IO_INODE);
+		buffer_cache_write_logged (sector, disk_inode, 0, DISK_SECTOR_SIZE);
+		disk_io_class_set (old_class);
 		free (disk_inode);
+
+		inode = inode_open (sector);
+		if (inode != NULL) {
+			success = inode_grow (inode, length);
+			if (!success)
+				inode_release_data (inode);
+			inode_close (inode);
+		}
+		journal_end ();
 	}
 	return success;
 }
@@ -101,39 +685,77 @@ inode_create (disk_sector_t sector, off_t length) {
  * Returns a null pointer if memory allocation fails. */
 struct inode *
 inode_open (disk_sector_t sector) {
-	struct list_elem *e;
 	struct inode *inode;
+	enum disk_io_class old_class;
+	bool loaded;
 
-	/* Check whether this inode is already open. */
-	for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-			e = list_next (e)) {
-		inode = list_entry (e, struct inode, elem);
-		if (inode->sector == sector) {
-			inode_reopen (inode);
-			return inode; 
+	/* Check whether this inode is already open or cached, waiting
+	 * for it if someone else is reading it in. */
+	lock_acquire (&inode_table_lock);
+	while ((inode = inode_find (sector)) != NULL && inode->loading)
+		cond_wait (&inode_loaded, &inode_table_lock);
+	if (inode != NULL) {
+		if (inode->open_cnt++ == 0) {
+			list_remove (&inode->unused_elem);
+			unused_cnt--;
+			inode->ra_next = inode->ra_end = 0;
 		}
+		lock_release (&inode_table_lock);
+		return inode;
 	}
 
 	/* Allocate memory. */
-	inode = malloc (sizeof *inode);
-	if (inode == NULL)
+	inode = kmem_cache_alloc (inode_cache);
+	if (inode == NULL) {
+		lock_release (&inode_table_lock);
 		return NULL;
+	}
 
 	/* Initialize. */
-	list_push_front (&open_inodes, &inode->elem);
 	inode->sector = sector;
 	inode->open_cnt = 1;
 	inode->deny_write_cnt = 0;
 	inode->removed = false;
-	disk_read (filesys_disk, inode->sector, &inode->data);
+	inode->loading = true;
+	inode->metadata = false;
+	inode->ra_next = inode->ra_end = 0;
+	lock_init (&inode->lock);
+	lock_init (&inode->dir_lock);
+#ifndef EFILESYS
+	inode->prealloc_cnt = 0;
+#endif
+	hash_insert (&inode_table, &inode->elem);
+	lock_release (&inode_table_lock);
+
+	/* Read it in. */
+	old_class = disk_io_class_set (DISK_IO_INODE);
+	buffer_cache_read (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+	loaded = map_load (inode);
+	disk_io_class_set (old_class);
+
+	/* Let those waiting for it have it, or look for it again. */
+	lock_acquire (&inode_table_lock);
+	inode->loading = false;
+	if (!loaded)
+		hash_delete (&inode_table, &inode->elem);
+	cond_broadcast (&inode_loaded, &inode_table_lock);
+	lock_release (&inode_table_lock);
+	if (!loaded) {
+		inode_free (inode);
+		return NULL;
+	}
 	return inode;
 }
 
 /* Reopens and returns INODE. */
 struct inode *
 inode_reopen (struct inode *inode) {
-	if (inode != NULL)
+	if (inode != NULL) {
+		lock_acquire (&inode_table_lock);
+		ASSERT (inode->open_cnt > 0);
 		inode->open_cnt++;
+		lock_release (&inode_table_lock);
+	}
 	return inode;
 }
 
@@ -144,28 +766,123 @@ inode_get_inumber (const struct inode *inode) {
 }
 
 /* Closes INODE and writes it to disk.
- * If this was the last reference to INODE, frees its memory.
- * If INODE was also a removed inode, frees its blocks. */
+ * If this was the last reference to INODE and it was removed,
+ * frees its blocks and its memory; otherwise keeps it cached as
+ * unused, freeing the least recently closed unused inode if
+ * there are too many. */
 void
 inode_close (struct inode *inode) {
+	struct inode *victim = NULL;
+	bool idle;
+
 	/* Ignore null pointer. */
 	if (inode == NULL)
 		return;
 
-	/* Release resources if this was the last opener. */
-	if (--inode->open_cnt == 0) {
-		/* Remove from inode list and release lock. */
-		list_remove (&inode->elem);
+	/* An inode about to become unused gives back what it holds
+	 * only while open first, while this reference still keeps it
+	 * from being freed.  Should it be reopened meanwhile, it just
+	 * loses its reservation early. */
+	lock_acquire (&inode_table_lock);
+	idle = !inode->removed && inode->open_cnt == 1;
+	lock_release (&inode_table_lock);
+	if (idle) {
+		journal_begin ();
+		map_idle (inode);
+		journal_end ();
+	}
 
-		/* Deallocate blocks if removed. */
-		if (inode->removed) {
-			free_map_release (inode->sector, 1);
-			free_map_release (inode->data.start,
-					bytes_to_sectors (inode->data.length)); 
-		}
+	lock_acquire (&inode_table_lock);
+	ASSERT (inode->open_cnt > 0);
+	if (--inode->open_cnt > 0) {
+		lock_release (&inode_table_lock);
+		return;
+	}
+
+	/* This was the last opener. */
+	if (inode->removed) {
+		hash_delete (&inode_table, &inode->elem);
+		lock_release (&inode_table_lock);
 
-		free (inode); 
+		/* Deallocate blocks. */
+		journal_begin ();
+		free_map_release (inode->sector, 1);
+		inode_release_data (inode);
+		inode_free (inode);
+		journal_end ();
+		return;
+	}
+
+	list_push_front (&unused_inodes, &inode->unused_elem);
+	if (++unused_cnt > UNUSED_INODES) {
+		victim = list_entry (list_pop_back (&unused_inodes), struct inode,
+				unused_elem);
+		hash_delete (&inode_table, &victim->elem);
+		unused_cnt--;
 	}
+	lock_release (&inode_table_lock);
+
+	if (victim != NULL) {
+		journal_begin ();
+		inode_free (victim);
+		journal_end ();
+	}
+}
+
+/* Frees INODE, which must be in no table or list, and its data
+ * map. */
+static void
+inode_free (struct inode *inode) {
+	map_unload (inode);
+	kmem_cache_free (inode_cache, inode);
+}
+
+/* Returns the inode in the table for SECTOR, or a null pointer if
+ * there is none.  INODE_TABLE_LOCK must be held. */
+static struct inode *
+inode_find (disk_sector_t sector) {
+	struct inode key;
+	struct hash_elem *e;
+
+	key.sector = sector;
+	e = hash_find (&inode_table, &key.elem);
+	return e != NULL ? hash_entry (e, struct inode, elem) : NULL;
+}
+
+/* Returns a hash value for inode E. */
+static uint64_t
+inode_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Returns true if inode A has a lower sector than inode B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct inode, elem)->sector
+		< hash_entry (b, struct inode, elem)->sector;
+}
+
+/* Marks INODE as holding file system metadata, such as a
+ * directory or the free map, so that writes to its data go
+ * through the journal. */
+void
+inode_set_metadata (struct inode *inode) {
+	inode->metadata = true;
+}
+
+/* Locks directory INODE against other changes to its entries, and
+ * against lookups that could see a change half made.  Inside a
+ * journal operation, must be called after journal_begin(). */
+void
+inode_lock_dir (struct inode *inode) {
+	lock_acquire (&inode->dir_lock);
+}
+
+/* Unlocks directory INODE. */
+void
+inode_unlock_dir (struct inode *inode) {
+	lock_release (&inode->dir_lock);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -173,7 +890,32 @@ inode_close (struct inode *inode) {
 void
 inode_remove (struct inode *inode) {
 	ASSERT (inode != NULL);
+	lock_acquire (&inode_table_lock);
 	inode->removed = true;
+	lock_release (&inode_table_lock);
+}
+
+/* Asks for the READ_AHEAD_SECTORS sectors of INODE that follow
+ * byte offset POS to be read into the buffer cache in the
+ * background, skipping those already asked for. */
+static void
+inode_read_ahead (struct inode *inode, off_t pos) {
+	off_t ofs = ROUND_UP (pos, DISK_SECTOR_SIZE);
+	off_t end = ofs + READ_AHEAD_SECTORS * DISK_SECTOR_SIZE;
+
+	/* Claim the range first, so that concurrent readers do not
+	   post the same sectors. */
+	lock_acquire (&inode->lock);
+	if (end > ROUND_UP (inode->data.length, DISK_SECTOR_SIZE))
+		end = ROUND_UP (inode->data.length, DISK_SECTOR_SIZE);
+	if (ofs < inode->ra_end)
+		ofs = inode->ra_end;
+	if (end > inode->ra_end)
+		inode->ra_end = end;
+	lock_release (&inode->lock);
+
+	for (; ofs < end; ofs += DISK_SECTOR_SIZE)
+		buffer_cache_readahead (byte_to_sector (inode, ofs));
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -183,7 +925,14 @@ off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 	uint8_t *buffer = buffer_;
 	off_t bytes_read = 0;
-	uint8_t *bounce = NULL;
+	bool sequential;
+	enum disk_io_class old_class = disk_io_class_set (data_class (inode));
+
+	lock_acquire (&inode->lock);
+	sequential = offset == inode->ra_next;
+	if (!sequential)
+		inode->ra_end = 0;
+	lock_release (&inode->lock);
 
 	while (size > 0) {
 		/* Disk sector to read, starting byte offset within sector. */
@@ -200,45 +949,83 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 		if (chunk_size <= 0)
 			break;
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Read full sector directly into caller's buffer. */
-			disk_read (filesys_disk, sector_idx, buffer + bytes_read); 
-		} else {
-			/* Read sector into bounce buffer, then partially copy
-			 * into caller's buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
-			disk_read (filesys_disk, sector_idx, bounce);
-			memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-		}
+		/* Copy the chunk out of the buffer cache. */
+		buffer_cache_read (sector_idx, buffer + bytes_read, sector_ofs,
+				chunk_size);
 
 		/* Advance. */
 		size -= chunk_size;
 		offset += chunk_size;
 		bytes_read += chunk_size;
 	}
-	free (bounce);
 
+	/* A reader that picks up where it left off will likely go on,
+	   so fetch what it needs next while it works on this. */
+	lock_acquire (&inode->lock);
+	inode->ra_next = offset;
+	lock_release (&inode->lock);
+	if (sequential && bytes_read > 0)
+		inode_read_ahead (inode, offset);
+
+	disk_io_class_set (old_class);
 	return bytes_read;
 }
 
+/* Extends INODE to LENGTH bytes like inode_grow(), as one
+ * journaled operation for each GROW_SECTORS sectors.  Returns
+ * false if the disk or memory is full. */
+static bool
+inode_grow_stepwise (struct inode *inode, off_t length) {
+	bool success = true;
+
+	while (success && inode_length (inode) < length) {
+		off_t step = ROUND_UP (inode_length (inode), DISK_SECTOR_SIZE)
+			+ GROW_SECTORS * DISK_SECTOR_SIZE;
+
+		if (step > length)
+			step = length;
+
+		journal_begin ();
+		success = inode_grow (inode, step);
+		journal_end ();
+
+		/* Space freed since the last checkpoint cannot be allocated
+		   until a checkpoint commits the free. */
+		if (!success && free_map_reclaim ()) {
+			journal_begin ();
+			success = inode_grow (inode, step);
+			journal_end ();
+		}
+	}
+	return success;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
  * Returns the number of bytes actually written, which may be
- * less than SIZE if end of file is reached or an error occurs.
- * (Normally a write at end of file would extend the inode, but
- * growth is not yet implemented.) */
+ * less than SIZE if the disk fills up or an error occurs.
+ * A write past end of file extends the inode, filling any gap
+ * with zeros. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		off_t offset) {
 	const uint8_t *buffer = buffer_;
 	off_t bytes_written = 0;
-	uint8_t *bounce = NULL;
+	bool grows = size > 0 && offset + size > inode_length (inode);
+	enum disk_io_class old_class;
 
 	if (inode->deny_write_cnt)
 		return 0;
+	old_class = disk_io_class_set (data_class (inode));
+
+	/* Any write to a metadata inode's data changes metadata. */
+	if (inode->metadata)
+		journal_begin ();
+
+	/* Extend the file if the write ends past its end, a few
+	   sectors per operation.  If not all of it fits on disk, write
+	   what does. */
+	if (grows)
+		inode_grow_stepwise (inode, offset + size);
 
 	while (size > 0) {
 		/* Sector to write, starting byte offset within sector. */
@@ -255,35 +1042,24 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		if (chunk_size <= 0)
 			break;
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
-			/* Write full sector directly to disk. */
-			disk_write (filesys_disk, sector_idx, buffer + bytes_written); 
-		} else {
-			/* We need a bounce buffer. */
-			if (bounce == NULL) {
-				bounce = malloc (DISK_SECTOR_SIZE);
-				if (bounce == NULL)
-					break;
-			}
-
-			/* If the sector contains data before or after the chunk
-			   we're writing, then we need to read in the sector
-			   first.  Otherwise we start with a sector of all zeros. */
-			if (sector_ofs > 0 || chunk_size < sector_left) 
-				disk_read (filesys_disk, sector_idx, bounce);
-			else
-				memset (bounce, 0, DISK_SECTOR_SIZE);
-			memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-			disk_write (filesys_disk, sector_idx, bounce); 
-		}
+		/* Copy the chunk into the buffer cache.  It reads the
+		   sector in first only if the chunk does not cover it. */
+		if (inode->metadata)
+			buffer_cache_write_logged (sector_idx, buffer + bytes_written,
+					sector_ofs, chunk_size);
+		else
+			buffer_cache_write (sector_idx, buffer + bytes_written, sector_ofs,
+					chunk_size);
 
 		/* Advance. */
 		size -= chunk_size;
 		offset += chunk_size;
 		bytes_written += chunk_size;
 	}
-	free (bounce);
 
+	if (inode->metadata)
+		journal_end ();
+	disk_io_class_set (old_class);
 	return bytes_written;
 }
 
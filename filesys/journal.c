@@ -0,0 +1,333 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/buffer-cache.h"
+#ifdef EFILESYS
+#include "filesys/fat.h"
+#endif
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Metadata journal.
+
+   A physical redo log kept in the last JOURNAL_SECTORS sectors of
+   the file system disk.  Every operation that changes metadata,
+   that is, inodes, directories, the free map or the FAT, runs
+   between journal_begin() and journal_end().  Its metadata writes
+   go to the buffer cache marked "logged", which keeps them from
+   reaching their home sectors on disk until they have been
+   committed here.
+
+   Operations are not committed one by one.  Instead,
+   journal_checkpoint(), which the writeback daemon calls
+   periodically and journal_end() calls once JOURNAL_HIGH sectors
+   are pending, waits until no operation is in progress and then
+   commits everything pending as one transaction:
+
+     1. Dirty file data is flushed, so that committed metadata
+        never points to data that is not on disk yet.
+
+     2. The pending sectors are copied into the log and written
+        out in one sequential run: a header naming their home
+        sectors, with a checksum over their contents, followed by
+        the contents.  Once this is on disk, the transaction has
+        committed.
+
+     3. The sectors are written to their home locations, in
+        whatever order the disk driver finds best.
+
+     4. The header is cleared, so that the log is empty again.
+
+   At boot, journal_init() replays a committed transaction whose
+   header and checksum are intact by writing its sectors home
+   again; a crash during step 2 leaves a bad checksum and nothing
+   else to undo, and a crash during step 3 is repaired by the
+   replay. */
+
+/* Identifies a journal header. */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+/* Pending sectors at which journal_end() checkpoints. */
+#define JOURNAL_HIGH 24
+
+/* Buffer cache entries reserved for each operation in progress,
+   at least as many as any one operation leaves logged: an inode,
+   two of its extent blocks, a directory header and the blocks of
+   the bucket it changes or splits, and the free map sectors its
+   allocations touch.  Files grow by at most GROW_SECTORS sectors
+   per operation (see inode.c) to stay within this. */
+#define JOURNAL_OP_SECTORS 16
+
+/* Most entries that may be logged or reserved at once.  Logged
+   entries cannot be evicted, so the rest of the cache is left
+   for the entries operations pin while they read and write. */
+#define JOURNAL_LOGGED_MAX (BUFFER_CACHE_SIZE - JOURNAL_OP_SECTORS)
+
+/* Journal header, in the first sector of the journal region.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_header {
+	unsigned magic;                     /* JOURNAL_MAGIC. */
+	uint32_t seq;                       /* Transaction number. */
+	uint32_t cnt;                       /* Logged sectors, 0 if empty. */
+	uint32_t checksum;                  /* Over SECTORS and the contents. */
+	disk_sector_t sectors[JOURNAL_MAX]; /* Home sector of each one. */
+};
+
+static struct lock journal_lock;        /* Protects the members below. */
+static struct condition journal_quiet;  /* Signaled when ACTIVE drops to 0. */
+static struct condition journal_open;   /* Signaled when COMMITTING clears. */
+static int active;                      /* Operations in progress. */
+static bool committing;                 /* Checkpoint in progress? */
+
+/* The transaction being committed.  Only the thread that set
+   COMMITTING uses these. */
+static struct journal_header *header;
+static uint8_t *log_data;               /* JOURNAL_MAX sectors of data. */
+
+static uint32_t seq;                    /* Last transaction number used. */
+
+/* Requests write_home() queues, one per logged sector, and the
+   I/O class each sector's writes are accounted to. */
+static struct disk_request home_reqs[JOURNAL_MAX];
+static enum disk_io_class home_class[JOURNAL_MAX];
+
+static void header_write (uint32_t cnt);
+static uint32_t checksum (uint32_t cnt);
+static void write_home (void);
+
+/* Initializes the journal.  Unless FORMAT is true, first replays
+   the transaction left in the log by a crash, if any. */
+void
+journal_init (bool format) {
+	size_t pages = (JOURNAL_SECTORS * DISK_SECTOR_SIZE + PGSIZE - 1) / PGSIZE;
+	uint8_t *mem = palloc_get_multiple (PAL_ASSERT | PAL_ZERO, pages);
+	enum disk_io_class old_class = disk_io_class_set (DISK_IO_JOURNAL);
+	uint32_t i;
+
+	ASSERT (sizeof *header == DISK_SECTOR_SIZE);
+
+	lock_init (&journal_lock);
+	cond_init (&journal_quiet);
+	cond_init (&journal_open);
+	active = 0;
+	committing = false;
+	header = (struct journal_header *) mem;
+	log_data = mem + DISK_SECTOR_SIZE;
+
+	if (!format) {
+		disk_read (filesys_disk, journal_start (), header);
+		if (header->magic == JOURNAL_MAGIC && header->cnt > 0
+				&& header->cnt <= JOURNAL_MAX) {
+			disk_read_multiple (filesys_disk, journal_start () + 1, log_data,
+					header->cnt);
+			if (checksum (header->cnt) == header->checksum) {
+				printf ("journal: replaying transaction %u, %u sectors\n",
+						header->seq, header->cnt);
+				for (i = 0; i < header->cnt; i++)
+					home_class[i] = DISK_IO_JOURNAL;
+				write_home ();
+			}
+		}
+		if (header->magic != JOURNAL_MAGIC)
+			PANIC ("file system disk has no journal; format it with -f");
+		seq = header->seq;
+	}
+	header_write (0);
+	disk_io_class_set (old_class);
+}
+
+/* Returns the first sector of the journal region. */
+disk_sector_t
+journal_start (void) {
+	return disk_size (filesys_disk) - JOURNAL_SECTORS;
+}
+
+/* Starts an operation that changes metadata.  Waits if a
+   checkpoint is in progress.  Also waits, and checkpoints once no
+   operation is left in progress, unless the entries already
+   logged and those reserved for the operations in progress leave
+   JOURNAL_OP_SECTORS more for this one within JOURNAL_LOGGED_MAX.
+   Otherwise logged entries could fill the cache while operations
+   are still in progress, so that these wait forever for a free
+   entry and the checkpoint waits forever for them.  Operations
+   may nest; only the outermost one counts. */
+void
+journal_begin (void) {
+	struct thread *t = thread_current ();
+
+	if (t->journal_depth > 0) {
+		t->journal_depth++;
+		return;
+	}
+
+	lock_acquire (&journal_lock);
+	for (;;) {
+		while (committing)
+			cond_wait (&journal_open, &journal_lock);
+		if (header == NULL || buffer_cache_logged_cnt ()
+				+ (active + 1) * JOURNAL_OP_SECTORS <= JOURNAL_LOGGED_MAX)
+			break;
+		if (active > 0)
+			cond_wait (&journal_quiet, &journal_lock);
+		else {
+			lock_release (&journal_lock);
+			journal_checkpoint ();
+			lock_acquire (&journal_lock);
+		}
+	}
+	active++;
+	lock_release (&journal_lock);
+	t->journal_depth = 1;
+}
+
+/* Ends an operation started with journal_begin(), checkpointing
+   if enough is pending.  The outermost operation first writes
+   out the free map changes made during it. */
+void
+journal_end (void) {
+	struct thread *t = thread_current ();
+	size_t pending;
+
+	ASSERT (t->journal_depth > 0);
+	if (t->journal_depth == 1)
+		free_map_flush ();
+	if (--t->journal_depth > 0)
+		return;
+
+	lock_acquire (&journal_lock);
+	if (--active == 0)
+		cond_broadcast (&journal_quiet, &journal_lock);
+	lock_release (&journal_lock);
+
+	pending = buffer_cache_logged_cnt ();
+#ifdef EFILESYS
+	pending += fat_dirty_cnt ();
+#endif
+	if (pending >= JOURNAL_HIGH)
+		journal_checkpoint ();
+}
+
+/* Adds DATA, the new contents of SECTOR, to the transaction being
+   committed.  Its write home is accounted to IO_CLASS.  Returns
+   false if the transaction is full.  Only called back from
+   buffer_cache_log_pending() and fat_log_pending() during a
+   checkpoint. */
+bool
+journal_log (disk_sector_t sector, const void *data,
+		enum disk_io_class io_class) {
+	ASSERT (committing);
+
+	if (header->cnt == JOURNAL_MAX)
+		return false;
+	header->sectors[header->cnt] = sector;
+	home_class[header->cnt] = io_class;
+	memcpy (log_data + header->cnt * DISK_SECTOR_SIZE, data,
+			DISK_SECTOR_SIZE);
+	header->cnt++;
+	return true;
+}
+
+/* Commits all pending metadata to the log and then writes it to
+   its home sectors.  Waits for operations in progress to finish,
+   and holds off new ones until done.  Must not be called inside
+   an operation. */
+void
+journal_checkpoint (void) {
+	if (header == NULL)
+		return;
+	ASSERT (thread_current ()->journal_depth == 0);
+
+	lock_acquire (&journal_lock);
+	while (committing)
+		cond_wait (&journal_open, &journal_lock);
+	committing = true;
+	while (active > 0)
+		cond_wait (&journal_quiet, &journal_lock);
+	lock_release (&journal_lock);
+
+	/* Data first. */
+	buffer_cache_flush ();
+
+	/* Logged cache entries always fit in one transaction, since
+	   they cannot outnumber the cache.  The FAT may need more, in
+	   which case its sectors past the first transaction are
+	   committed in further ones. */
+	for (;;) {
+		header->cnt = 0;
+		buffer_cache_log_pending ();
+#ifdef EFILESYS
+		fat_log_pending ();
+#endif
+		if (header->cnt == 0)
+			break;
+
+		header_write (header->cnt);
+		write_home ();
+		buffer_cache_release_logged ();
+		header_write (0);
+	}
+
+	/* Space freed by what was just committed can be reused now. */
+	free_map_commit ();
+
+	lock_acquire (&journal_lock);
+	committing = false;
+	cond_broadcast (&journal_open, &journal_lock);
+	lock_release (&journal_lock);
+}
+
+/* Writes the journal header, marking CNT sectors as committed,
+   followed by the contents of those sectors, in one run.  LOG_DATA
+   directly follows HEADER in memory, as on disk. */
+static void
+header_write (uint32_t cnt) {
+	enum disk_io_class old_class = disk_io_class_set (DISK_IO_JOURNAL);
+
+	header->magic = JOURNAL_MAGIC;
+	header->cnt = cnt;
+	if (cnt > 0) {
+		header->seq = ++seq;
+		header->checksum = checksum (cnt);
+	}
+	disk_write_multiple (filesys_disk, journal_start (), header, 1 + cnt);
+	disk_io_class_set (old_class);
+}
+
+/* Returns the FNV-1a hash of the first CNT home sector numbers in
+   the header and the first CNT sectors of logged data. */
+static uint32_t
+checksum (uint32_t cnt) {
+	const uint8_t *p;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	p = (const uint8_t *) header->sectors;
+	for (i = 0; i < cnt * sizeof *header->sectors; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	for (i = 0; i < cnt * DISK_SECTOR_SIZE; i++)
+		hash = (hash ^ log_data[i]) * 16777619u;
+	return hash;
+}
+
+/* Writes each sector of the transaction in the header to its
+   home location.  All of them are queued as disk requests before
+   waiting for any, so that the disk driver can put them in
+   order and merge adjacent ones. */
+static void
+write_home (void) {
+	uint32_t i;
+
+	for (i = 0; i < header->cnt; i++) {
+		disk_request_init (&home_reqs[i], filesys_disk, header->sectors[i],
+				1, true, log_data + i * DISK_SECTOR_SIZE);
+		home_reqs[i].io_class = home_class[i];
+		disk_submit (&home_reqs[i]);
+	}
+	for (i = 0; i < header->cnt; i++)
+		disk_wait (&home_reqs[i]);
+}
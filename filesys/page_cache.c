@@ -1,6 +1,11 @@
 /* page_cache.c: Implementation of Page Cache (Buffer Cache). */
 
 #include "vm/vm.h"
+#include "filesys/buffer-cache.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 static bool page_cache_readahead (struct page *page, void *kva);
 static bool page_cache_writeback (struct page *page);
 static void page_cache_destroy (struct page *page);
@@ -15,10 +20,77 @@ static const struct page_operations page_cache_op = {
 
 tid_t page_cache_workerd;
 
-/* The initializer of file vm */
+/* The worker daemon writes dirty buffer cache entries back to
+ * disk and reads ahead the sectors that readers are expected to
+ * ask for next.  It sleeps on KWORKER_SEMA, which is raised for
+ * each read-ahead request, when the cache runs short of clean
+ * entries, and every WRITEBACK_TICKS by a small timer thread. */
+
+/* Ticks between two periodic writebacks. */
+#define WRITEBACK_TICKS TIMER_FREQ
+
+/* Capacity of the read-ahead queue.  Requests beyond it are
+ * dropped; read-ahead is only a hint. */
+#define RA_QUEUE_SIZE 32
+
+static bool kworker_started;
+static struct semaphore kworker_sema;
+static bool flush_wanted;               /* Writeback requested? */
+
+static struct lock ra_lock;             /* Protects the queue below. */
+static disk_sector_t ra_queue[RA_QUEUE_SIZE];
+static size_t ra_head;                  /* Index of oldest request. */
+static size_t ra_cnt;                   /* Number of requests. */
+
+static void page_cache_kworkerd (void *aux);
+static void page_cache_tickerd (void *aux);
+
+/* The initializer of file vm.  Starts the worker daemon for the
+ * page cache.  Safe to call more than once. */
 void
 pagecache_init (void) {
-	/* TODO: Create a worker daemon for page cache with page_cache_kworkerd */
+	if (kworker_started)
+		return;
+	kworker_started = true;
+
+	sema_init (&kworker_sema, 0);
+	lock_init (&ra_lock);
+	page_cache_workerd = thread_create ("kworkerd", PRI_DEFAULT,
+			page_cache_kworkerd, NULL);
+	thread_create ("kworkerd-tick", PRI_DEFAULT, page_cache_tickerd, NULL);
+}
+
+/* Queues SECTOR to be read into the buffer cache by the worker. */
+void
+page_cache_post_readahead (disk_sector_t sector) {
+	if (!kworker_started)
+		return;
+
+	lock_acquire (&ra_lock);
+	if (ra_cnt < RA_QUEUE_SIZE) {
+		ra_queue[(ra_head + ra_cnt) % RA_QUEUE_SIZE] = sector;
+		ra_cnt++;
+	}
+	lock_release (&ra_lock);
+	sema_up (&kworker_sema);
+}
+
+/* Asks the worker to write back dirty buffers now. */
+void
+page_cache_kick (void) {
+	if (!kworker_started)
+		return;
+
+	flush_wanted = true;
+	sema_up (&kworker_sema);
+}
+
+/* Wakes the worker to write back dirty buffers if the buffer
+ * cache is under pressure, without committing the journal. */
+void
+page_cache_wake (void) {
+	if (kworker_started)
+		sema_up (&kworker_sema);
 }
 
 /* Initialize the page cache */
@@ -44,7 +116,56 @@ static void
 page_cache_destroy (struct page *page) {
 }
 
+/* Takes the oldest request off the read-ahead queue, along with
+ * the requests right behind it for the sectors that follow it,
+ * and stores the first sector in *SECTOR and their number in
+ * *CNT.  Returns false if the queue is empty. */
+static bool
+ra_pop (disk_sector_t *sector, size_t *cnt) {
+	lock_acquire (&ra_lock);
+	*cnt = 0;
+	if (ra_cnt > 0) {
+		*sector = ra_queue[ra_head];
+		do {
+			ra_head = (ra_head + 1) % RA_QUEUE_SIZE;
+			ra_cnt--;
+			++*cnt;
+		} while (ra_cnt > 0 && ra_queue[ra_head] == *sector + *cnt);
+	}
+	lock_release (&ra_lock);
+	return *cnt > 0;
+}
+
 /* Worker thread for page cache */
 static void
-page_cache_kworkerd (void *aux) {
+page_cache_kworkerd (void *aux UNUSED) {
+	disk_sector_t sector;
+	size_t cnt;
+
+	/* What this thread reads is read-ahead.  What it writes back
+	   is accounted to whoever dirtied it. */
+	disk_io_class_set (DISK_IO_PAGE_CACHE);
+	for (;;) {
+		sema_down (&kworker_sema);
+
+		/* Read-ahead first: a reader is likely to want it soon. */
+		while (ra_pop (&sector, &cnt))
+			buffer_cache_prefetch (sector, cnt);
+
+		/* Periodic writeback also commits the metadata journal. */
+		if (flush_wanted) {
+			flush_wanted = false;
+			journal_checkpoint ();
+		} else if (buffer_cache_under_pressure ())
+			buffer_cache_flush ();
+	}
+}
+
+/* Wakes the worker up for periodic writeback. */
+static void
+page_cache_tickerd (void *aux UNUSED) {
+	for (;;) {
+		timer_sleep (WRITEBACK_TICKS);
+		page_cache_kick ();
+	}
 }
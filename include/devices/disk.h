@@ -2,7 +2,11 @@
 #define DEVICES_DISK_H
 
 #include <inttypes.h>
+#include <list.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "threads/synch.h"
 
 /* Size of a disk sector in bytes. */
 #define DISK_SECTOR_SIZE 512
@@ -15,13 +19,69 @@ typedef uint32_t disk_sector_t;
  * printf ("sector=%"PRDSNu"\n", sector); */
 #define PRDSNu PRIu32
 
+/* What a disk request is for, to account disk traffic to the
+   subsystem that causes it.  Each thread has a current class,
+   which requests it makes take on; see disk_io_class_set(). */
+enum disk_io_class {
+	DISK_IO_OTHER,              /* Unclassified. */
+	DISK_IO_INODE,              /* On-disk inodes and their index blocks. */
+	DISK_IO_DATA,               /* Regular file data. */
+	DISK_IO_DIR,                /* Directory contents. */
+	DISK_IO_ALLOC,              /* FAT or free map. */
+	DISK_IO_JOURNAL,            /* Metadata journal log. */
+	DISK_IO_SWAP,               /* Swapped-out pages. */
+	DISK_IO_PAGE_CACHE,         /* Read-ahead by the page cache worker. */
+	DISK_IO_CLASS_CNT
+};
+
+/* An asynchronous disk request. */
+struct disk_request {
+	struct disk *disk;          /* Disk. */
+	disk_sector_t sector;       /* First sector. */
+	size_t cnt;                 /* Number of sectors. */
+	bool write;                 /* Write, or else read? */
+	void *buffer;               /* CNT sectors of data, or null. */
+	void *const *buffers;       /* If non-null, one buffer per sector. */
+	void (*callback) (struct disk_request *);   /* Called when done. */
+	void *aux;                  /* For CALLBACK's use. */
+	enum disk_io_class io_class;    /* What it is for. */
+
+	/* Owned by the disk driver. */
+	struct list_elem elem;      /* Element in channel's queue. */
+	int64_t deadline;           /* Tick by which to serve it. */
+	uint64_t submit_tsc;        /* TSC when submitted. */
+	uint64_t start_tsc;         /* TSC when sent to the device. */
+	size_t parts;               /* Parts still outstanding (virtio). */
+	struct semaphore done;      /* Up'd when done, if no CALLBACK. */
+};
+
+/* -rd: disks to serve from RAM, e.g. "hd0:1,hd1:1", or null. */
+extern const char *disk_ramdisk_slots;
+
 void disk_init (void);
 void disk_print_stats (void);
 
 struct disk *disk_get (int chan_no, int dev_no);
+struct disk *disk_get_by_name (const char *);
 disk_sector_t disk_size (struct disk *);
 void disk_read (struct disk *, disk_sector_t, void *);
 void disk_write (struct disk *, disk_sector_t, const void *);
+void disk_read_multiple (struct disk *, disk_sector_t, void *, size_t cnt);
+void disk_write_multiple (struct disk *, disk_sector_t, const void *,
+		size_t cnt);
+void disk_readv (struct disk *, disk_sector_t, void *const[], size_t cnt);
+void disk_writev (struct disk *, disk_sector_t, const void *const[],
+		size_t cnt);
+
+void disk_request_init (struct disk_request *, struct disk *, disk_sector_t,
+		size_t cnt, bool write, void *buffer);
+void disk_submit (struct disk_request *);
+void disk_wait (struct disk_request *);
+void disk_request_complete (struct disk_request *);
+
+enum disk_io_class disk_io_class_get (void);
+enum disk_io_class disk_io_class_set (enum disk_io_class);
+const char *disk_io_class_name (enum disk_io_class);
 
 void 	register_disk_inspect_intr ();
 #endif /* devices/disk.h */
@@ -0,0 +1,36 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Location of a PCI function. */
+struct pci_addr {
+	uint8_t bus;                /* Bus number. */
+	uint8_t dev;                /* Device number on the bus. */
+	uint8_t func;               /* Function number within the device. */
+};
+
+/* Offsets in a function's configuration space header. */
+#define PCI_VENDOR_ID 0x00      /* Vendor ID, 16 bits. */
+#define PCI_COMMAND 0x04        /* Command register, 16 bits. */
+#define PCI_CLASS 0x08          /* Revision, prog-if, subclass, class. */
+#define PCI_HEADER_TYPE 0x0e    /* Header type, 8 bits. */
+#define PCI_BAR0 0x10           /* First base address register. */
+#define PCI_INTERRUPT_LINE 0x3c /* IRQ line, 8 bits. */
+
+/* Command register bits. */
+#define PCI_COMMAND_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_COMMAND_MEMORY 0x0002   /* Respond to memory space accesses. */
+#define PCI_COMMAND_MASTER 0x0004   /* Allow bus mastering. */
+
+uint32_t pci_read_config (struct pci_addr, uint8_t reg);
+void pci_write_config (struct pci_addr, uint8_t reg, uint32_t value);
+uint16_t pci_read_config16 (struct pci_addr, uint8_t reg);
+void pci_write_config16 (struct pci_addr, uint8_t reg, uint16_t value);
+bool pci_find_class (uint8_t class, uint8_t subclass, struct pci_addr *);
+bool pci_find_device (uint16_t vendor, uint16_t device, struct pci_addr *);
+bool pci_find_next_device (uint16_t vendor, uint16_t device,
+		struct pci_addr *);
+
+#endif /* devices/pci.h */
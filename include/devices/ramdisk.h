@@ -0,0 +1,17 @@
+#ifndef DEVICES_RAMDISK_H
+#define DEVICES_RAMDISK_H
+
+#include <stddef.h>
+#include "devices/disk.h"
+
+struct ramdisk;
+
+struct ramdisk *ramdisk_create (disk_sector_t capacity);
+disk_sector_t ramdisk_capacity (const struct ramdisk *);
+size_t ramdisk_page_cnt (const struct ramdisk *);
+void ramdisk_read (struct ramdisk *, disk_sector_t, void *, size_t cnt);
+void ramdisk_write (struct ramdisk *, disk_sector_t, const void *,
+		size_t cnt);
+void ramdisk_submit (struct ramdisk *, struct disk_request *);
+
+#endif /* devices/ramdisk.h */
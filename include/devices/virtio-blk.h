@@ -0,0 +1,18 @@
+#ifndef DEVICES_VIRTIO_BLK_H
+#define DEVICES_VIRTIO_BLK_H
+
+#include <stddef.h>
+#include "devices/disk.h"
+
+/* Length of a virtio-blk device's ID string, without the null
+   terminator. */
+#define VIRTIO_BLK_ID_LEN 20
+
+struct virtio_blk;
+
+size_t virtio_blk_probe (struct virtio_blk *[], size_t max);
+disk_sector_t virtio_blk_capacity (const struct virtio_blk *);
+void virtio_blk_get_id (struct virtio_blk *, char id[VIRTIO_BLK_ID_LEN + 1]);
+void virtio_blk_submit (struct virtio_blk *, struct disk_request *);
+
+#endif /* devices/virtio-blk.h */
@@ -0,0 +1,34 @@
+#ifndef FILESYS_BUFFER_CACHE_H
+#define FILESYS_BUFFER_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/disk.h"
+
+/* Number of sectors the buffer cache holds. */
+#define BUFFER_CACHE_SIZE 64
+
+void buffer_cache_init (void);
+void buffer_cache_read (disk_sector_t, void *buffer, int ofs, int size);
+void buffer_cache_write (disk_sector_t, const void *buffer, int ofs,
+		int size);
+void buffer_cache_write_logged (disk_sector_t, const void *buffer, int ofs,
+		int size);
+void buffer_cache_zero (disk_sector_t);
+void buffer_cache_zero_logged (disk_sector_t);
+void buffer_cache_readahead (disk_sector_t);
+void buffer_cache_prefetch (disk_sector_t, size_t cnt);
+void buffer_cache_flush (void);
+bool buffer_cache_under_pressure (void);
+size_t buffer_cache_logged_cnt (void);
+void buffer_cache_log_pending (void);
+void buffer_cache_release_logged (void);
+void buffer_cache_done (void);
+
+/* Background writeback and read-ahead worker, in page_cache.c. */
+void pagecache_init (void);
+void page_cache_post_readahead (disk_sector_t);
+void page_cache_kick (void);
+void page_cache_wake (void);
+
+#endif /* filesys/buffer-cache.h */
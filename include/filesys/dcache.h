@@ -0,0 +1,24 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdint.h>
+#include "devices/disk.h"
+
+/* Result of a dentry cache lookup. */
+enum dcache_result {
+	DCACHE_MISS,                /* Nothing cached; look on disk. */
+	DCACHE_FOUND,               /* Name exists; child sector returned. */
+	DCACHE_ABSENT               /* Name is known not to exist. */
+};
+
+void dcache_init (void);
+enum dcache_result dcache_lookup (disk_sector_t parent, const char *name,
+		disk_sector_t *child, uint32_t *gen);
+void dcache_insert (disk_sector_t parent, const char *name,
+		disk_sector_t child, uint32_t gen);
+void dcache_insert_absent (disk_sector_t parent, const char *name,
+		uint32_t gen);
+void dcache_invalidate (disk_sector_t parent, const char *name);
+void dcache_invalidate_dir (disk_sector_t parent);
+
+#endif /* filesys/dcache.h */
@@ -22,11 +22,17 @@ void fat_init (void);
 void fat_open (void);
 void fat_close (void);
 void fat_create (void);
-void fat_close (void);
+void fat_flush (void);
+unsigned int fat_dirty_cnt (void);
+unsigned int fat_pending_cnt (void);
+void fat_log_pending (void);
+void fat_commit_frees (void);
 
 cluster_t fat_create_chain (
     cluster_t clst /* Cluster # to stretch, 0: Create a new chain */
 );
+cluster_t fat_create_chain_run (cluster_t clst, unsigned int cnt,
+    unsigned int *added);
 void fat_remove_chain (
     cluster_t clst, /* Cluster # to be removed */
     cluster_t pclst /* Previous cluster of clst, 0: clst is the start of chain */
@@ -34,5 +40,6 @@ void fat_remove_chain (
 cluster_t fat_get (cluster_t clst);
 void fat_put (cluster_t clst, cluster_t val);
 disk_sector_t cluster_to_sector (cluster_t clst);
+cluster_t sector_to_cluster (disk_sector_t sector);
 
 #endif /* filesys/fat.h */
@@ -13,5 +13,8 @@ void free_map_close (void);
 
 bool free_map_allocate (size_t, disk_sector_t *);
 void free_map_release (disk_sector_t, size_t);
+void free_map_commit (void);
+bool free_map_reclaim (void);
+void free_map_flush (void);
 
 #endif /* filesys/free-map.h */
@@ -0,0 +1,21 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/disk.h"
+
+/* Most sectors one transaction can log. */
+#define JOURNAL_MAX 124
+
+/* Size of the journal region at the end of the disk: a header
+   followed by room for JOURNAL_MAX logged sectors. */
+#define JOURNAL_SECTORS (1 + JOURNAL_MAX)
+
+void journal_init (bool format);
+disk_sector_t journal_start (void);
+void journal_begin (void);
+void journal_end (void);
+bool journal_log (disk_sector_t, const void *data, enum disk_io_class);
+void journal_checkpoint (void);
+
+#endif /* filesys/journal.h */
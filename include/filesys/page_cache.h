@@ -7,6 +7,6 @@ enum vm_type;
 
 struct page_cache {};
 
-void page_cache_init (void);
+void pagecache_init (void);
 bool page_cache_initializer (struct page *page, enum vm_type type, void *kva);
 #endif
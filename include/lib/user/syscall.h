@@ -78,4 +78,18 @@ get_fs_disk_write_cnt (void) {
 	return write_cnt;
 }
 
+/* Returns the sectors the file system disk has read, or written
+ * if WRITE is true, for I/O class IO_CLASS, one of the values of
+ * enum disk_io_class in devices/disk.h, or -1 if there is no such
+ * class. */
+static inline long long
+get_fs_disk_class_cnt (int io_class, bool write) {
+	long long cnt;
+	asm volatile ("int $0x45"
+			: "=a" (cnt)
+			: "d" (0L), "c" (1L), "S" ((long) io_class), "D" ((long) write)
+			: "memory");
+	return cnt;
+}
+
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,28 @@
+#ifndef THREADS_SLAB_H
+#define THREADS_SLAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* An object cache.  Opaque outside threads/slab.c. */
+struct kmem_cache;
+
+/* Constructor, run once on each object when its slab is created.
+   Objects must be returned to the cache in constructed state. */
+typedef void kmem_ctor_func (void *obj);
+
+void slab_init (void);
+struct kmem_cache *kmem_cache_create (const char *name, size_t size,
+		kmem_ctor_func *ctor);
+void *kmem_cache_alloc (struct kmem_cache *);
+void *kmem_cache_zalloc (struct kmem_cache *);
+void kmem_cache_free (struct kmem_cache *, void *obj);
+size_t kmem_cache_size (const struct kmem_cache *);
+
+bool kmem_is_slab_object (const void *obj);
+void kmem_free (void *obj);
+size_t kmem_object_size (const void *obj);
+
+void kmem_print_stats (void);
+
+#endif /* threads/slab.h */
@@ -116,7 +116,14 @@ struct thread /* TCB 영역의 구성 */
 #ifdef VM
 	/* Table for whole virtual memory owned by thread. */
 	struct supplemental_page_table spt;
+	struct file *exec_file;             /* Executable being run. */
 #endif
+#ifdef FILESYS
+	/* Owned by filesys/journal.c. */
+	int journal_depth;                  /* Nested journal_begin() calls. */
+#endif
+	/* Owned by devices/disk.c. */
+	int io_class;                       /* enum disk_io_class of its I/O. */
 
 	/* Owned by thread.c. */
 	struct intr_frame tf;               /* Information for switching */
@@ -178,8 +185,6 @@ int thread_get_load_avg (void);
 
 void do_iret (struct intr_frame *tf);
 
-#endif /* threads/thread.h */
-
 /* ********** ********** ********** new functions below ********** ********** ********** */
 /* ********** ********** ********** project 1 : alarm clock ********** ********** ********** */
 void thread_sleep(int64_t ticks);
@@ -202,3 +207,5 @@ void mlfqs_calculate_load_avg (void);
 void mlfqs_increment_recent_cpu (void);
 void mlfqs_recalculate_recent_cpu (void);
 void mlfqs_recalculate_priority (void);
+
+#endif /* threads/thread.h */
@@ -1,12 +1,18 @@
 #ifndef VM_ANON_H
 #define VM_ANON_H
+#include <stddef.h>
 #include "vm/vm.h"
 struct page;
 enum vm_type;
 
 struct anon_page {
+	size_t swap_slot;           /* Swap slot holding the page, or
+	                               BITMAP_ERROR if it is not swapped out. */
 };
 
+/* -swap: disks to stripe swap across, or null for hd1:1. */
+extern const char *vm_swap_disks;
+
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
 
@@ -5,6 +5,9 @@
 struct page;
 enum vm_type;
 
+/* Fills a page on its first fault.  AUX, if not null, was
+ * allocated with malloc() and is owned by the page, which frees it
+ * once the initializer has run or if the page is never touched. */
 typedef bool vm_initializer (struct page *, void *aux);
 
 /* Uninitlialized page. The type for implementing the
@@ -1,6 +1,8 @@
 #ifndef VM_VM_H
 #define VM_VM_H
 #include <stdbool.h>
+#include <hash.h>
+#include <list.h>
 #include "threads/palloc.h"
 
 enum vm_type {
@@ -34,6 +36,19 @@ enum vm_type {
 struct page_operations;
 struct thread;
 
+/* What a page fault turned out to be, as decided by
+ * vm_try_handle_fault(). */
+enum vm_fault_class {
+	VM_FAULT_ZERO,      /* First touch of an anonymous zero-fill page. */
+	VM_FAULT_LAZY,      /* First touch of a page with an initializer. */
+	VM_FAULT_STACK,     /* Stack growth. */
+	VM_FAULT_COW,       /* Write to a copy-on-write page, resolved. */
+	VM_FAULT_SWAP,      /* Anonymous page brought back from swap. */
+	VM_FAULT_MMAP,      /* File-backed page of a memory mapping. */
+	VM_FAULT_INVALID,   /* Not a valid access; the process dies. */
+	VM_FAULT_CLASS_CNT
+};
+
 #define VM_TYPE(type) ((type) & 7)
 
 /* The representation of "page".
@@ -46,6 +61,9 @@ struct page {
 	struct frame *frame;   /* Back reference for frame */
 
 	/* Your implementation */
+	struct hash_elem spt_elem;   /* Element in the owner's spt. */
+	bool writable;               /* Mapped read/write? */
+	bool evicting;               /* Being written out by an evictor? */
 
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
@@ -63,6 +81,8 @@ struct page {
 struct frame {
 	void *kva;
 	struct page *page;
+	struct thread *owner;        /* Thread whose spt holds PAGE. */
+	struct list_elem elem;       /* Element in the frame table. */
 };
 
 /* The function table for page operations.
@@ -85,8 +105,21 @@ struct page_operations {
  * We don't want to force you to obey any specific design for this struct.
  * All designs up to you for this. */
 struct supplemental_page_table {
+	struct hash pages;           /* Pages keyed by user virtual address. */
+
+	/* Resident-set accounting, see vm.c. */
+	size_t rss;                  /* Frames currently held. */
+	size_t rss_peak;             /* Largest RSS observed. */
+	size_t rss_limit;            /* Frame quota, 0 if unlimited. */
+	size_t wss;                  /* Last working-set sample, in pages. */
+	long long fault_cnt;         /* Page faults served. */
+	int64_t start_ticks;         /* Timer tick when the spt was set up. */
 };
 
+/* Default per-process RSS limit in pages; 0 means unlimited.
+ * Controlled by kernel command-line option "-rss=PAGES". */
+extern size_t vm_rss_limit;
+
 #include "threads/thread.h"
 void supplemental_page_table_init (struct supplemental_page_table *spt);
 bool supplemental_page_table_copy (struct supplemental_page_table *dst,
@@ -98,8 +131,11 @@ bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
 
 void vm_init (void);
+void vm_sample_working_set (struct thread *);
+void vm_print_rss (struct thread *);
 bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
-		bool write, bool not_present);
+		bool write, bool not_present, enum vm_fault_class *class);
+const char *vm_fault_class_name (enum vm_fault_class);
 
 #define vm_alloc_page(type, upage, writable) \
 	vm_alloc_page_with_initializer ((type), (upage), (writable), NULL, NULL)
@@ -63,6 +63,63 @@ last_mask (const struct bitmap *b) {
 	return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Returns a mask with the bits of an element from bit START up
+   to, but not including, bit END set, where 0 <= START < END <=
+   ELEM_BITS. */
+static inline elem_type
+range_mask (size_t start, size_t end) {
+	elem_type high = end < ELEM_BITS
+		? ((elem_type) 1 << end) - 1 : (elem_type) -1;
+	return high & ~(((elem_type) 1 << start) - 1);
+}
+
+/* Returns element E with every bit flipped if VALUE is false, so
+   that the bits set to VALUE in E are the ones set in the
+   result. */
+static inline elem_type
+match (elem_type e, bool value) {
+	return value ? e : ~e;
+}
+
+/* Returns the index of the lowest set bit in E, which must not be
+   0.  Compiles to a single BSF instruction. */
+static inline size_t
+elem_ctz (elem_type e) {
+	return __builtin_ctzl (e);
+}
+
+/* Returns the number of bits set in E.  Done by hand, because the
+   kernel is not linked with libgcc's __popcountdi2 and cannot
+   assume the POPCNT instruction. */
+static inline size_t
+elem_popcount (elem_type e) {
+	e = e - ((e >> 1) & 0x5555555555555555UL);
+	e = (e & 0x3333333333333333UL) + ((e >> 2) & 0x3333333333333333UL);
+	e = (e + (e >> 4)) & 0x0f0f0f0f0f0f0f0fUL;
+	return (e * 0x0101010101010101UL) >> 56;
+}
+
+/* Returns the index of the first bit in B between START and END,
+   exclusive, that is set to VALUE, or END if there is none.
+   Skips a whole element at a time while it has no such bit. */
+static size_t
+find_next (const struct bitmap *b, size_t start, size_t end, bool value) {
+	size_t idx;
+	elem_type e;
+
+	if (start >= end)
+		return end;
+	idx = elem_idx (start);
+	e = match (b->bits[idx], value) & ~(bit_mask (start) - 1);
+	while (e == 0) {
+		if (++idx >= elem_cnt (end))
+			return end;
+		e = match (b->bits[idx], value);
+	}
+	start = idx * ELEM_BITS + elem_ctz (e);
+	return start < end ? start : end;
+}
+
 /* Creation and destruction. */
 
 /* Initializes B to be a bitmap of BIT_CNT bits
@@ -194,33 +251,57 @@ bitmap_set_all (struct bitmap *b, bool value) {
 	bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   The partial elements at either end are updated atomically, as
+   by bitmap_mark() and bitmap_reset(), and the whole elements in
+   between are stored at once. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) {
-	size_t i;
+	size_t end = start + cnt;
 
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 	ASSERT (start + cnt <= b->bit_cnt);
 
-	for (i = 0; i < cnt; i++)
-		bitmap_set (b, start + i, value);
+	while (start < end) {
+		size_t idx = elem_idx (start);
+		size_t ofs = start % ELEM_BITS;
+		size_t n = end - start < ELEM_BITS - ofs
+			? end - start : ELEM_BITS - ofs;
+
+		if (n == ELEM_BITS)
+			b->bits[idx] = value ? (elem_type) -1 : 0;
+		else if (value)
+			asm ("lock orq %1, %0" : "+m" (b->bits[idx])
+					: "r" (range_mask (ofs, ofs + n)) : "cc");
+		else
+			asm ("lock andq %1, %0" : "+m" (b->bits[idx])
+					: "r" (~range_mask (ofs, ofs + n)) : "cc");
+		start += n;
+	}
 }
 
 /* Returns the number of bits in B between START and START + CNT,
    exclusive, that are set to VALUE. */
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) {
-	size_t i, value_cnt;
+	size_t end = start + cnt;
+	size_t value_cnt = 0;
 
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 	ASSERT (start + cnt <= b->bit_cnt);
 
-	value_cnt = 0;
-	for (i = 0; i < cnt; i++)
-		if (bitmap_test (b, start + i) == value)
-			value_cnt++;
+	while (start < end) {
+		size_t idx = elem_idx (start);
+		size_t ofs = start % ELEM_BITS;
+		size_t n = end - start < ELEM_BITS - ofs
+			? end - start : ELEM_BITS - ofs;
+
+		value_cnt += elem_popcount (match (b->bits[idx], value)
+				& range_mask (ofs, ofs + n));
+		start += n;
+	}
 	return value_cnt;
 }
 
@@ -228,16 +309,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) {
    exclusive, are set to VALUE, and false otherwise. */
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) {
-	size_t i;
-
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 	ASSERT (start + cnt <= b->bit_cnt);
 
-	for (i = 0; i < cnt; i++)
-		if (bitmap_test (b, start + i) == value)
-			return true;
-	return false;
+	return find_next (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -266,18 +342,30 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt) {
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+
+   Works run by run rather than bit by bit: finds the next bit set
+   to VALUE, then the first bit after it that is not, and if the
+   run between them is too short, carries on from its end.  Both
+   searches skip whole elements that cannot hold what they look
+   for. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) {
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 
-	if (cnt <= b->bit_cnt) {
-		size_t last = b->bit_cnt - cnt;
-		size_t i;
-		for (i = start; i <= last; i++)
-			if (!bitmap_contains (b, i, cnt, !value))
-				return i;
+	if (cnt == 0)
+		return start;
+	while (cnt <= b->bit_cnt - start) {
+		size_t end;
+
+		start = find_next (b, start, b->bit_cnt - cnt + 1, value);
+		if (start > b->bit_cnt - cnt)
+			break;
+		end = find_next (b, start, start + cnt, !value);
+		if (end == start + cnt)
+			return start;
+		start = end;
 	}
 	return BITMAP_ERROR;
 }
@@ -326,6 +414,23 @@ bitmap_write (const struct bitmap *b, struct file *file) {
 	off_t size = byte_cnt (b->bit_cnt);
 	return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the part of B that holds the CNT bits starting at START
+   to the same place in FILE that bitmap_write() would.  START
+   must be a multiple of the number of bits in an element.
+   Returns true if successful, false otherwise. */
+bool
+bitmap_write_part (const struct bitmap *b, struct file *file, size_t start,
+		size_t cnt) {
+	off_t ofs, size;
+
+	ASSERT (start % ELEM_BITS == 0);
+	ASSERT (start + cnt <= b->bit_cnt);
+
+	ofs = elem_idx (start) * sizeof (elem_type);
+	size = byte_cnt (start + cnt) - ofs;
+	return file_write_at (file, b->bits + elem_idx (start), size, ofs) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
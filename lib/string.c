@@ -1,5 +1,23 @@
 #include <string.h>
 #include <debug.h>
+#include <stdint.h>
+
+/* The block operations below move 8 bytes at a time, with the
+   x86-64 string instructions where they can.  Both the kernel,
+   on every entry, and the C calling convention keep the
+   direction flag clear, so they run upward unless told not to.
+   SSE would be faster still for large blocks, but the kernel does
+   not save the user's SSE registers and is built with -mno-sse. */
+
+/* An 8-byte word that may alias anything. */
+typedef uint64_t __attribute__ ((__may_alias__)) word_t;
+
+/* Each byte of a word set to 0x01, or to 0x80. */
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* Blocks at least this long are worth aligning DST for. */
+#define ALIGN_MIN 64
 
 /* Copies SIZE bytes from SRC to DST, which must not overlap.
    Returns DST. */
@@ -7,12 +25,23 @@ void *
 memcpy (void *dst_, const void *src_, size_t size) {
 	unsigned char *dst = dst_;
 	const unsigned char *src = src_;
+	size_t cnt;
 
 	ASSERT (dst != NULL || size == 0);
 	ASSERT (src != NULL || size == 0);
 
-	while (size-- > 0)
-		*dst++ = *src++;
+	/* Bring DST to a word boundary, then copy words, then the
+	   bytes left over. */
+	cnt = size >= ALIGN_MIN ? -(uintptr_t) dst % 8 : 0;
+	size -= cnt;
+	asm volatile ("rep movsb"
+			: "+D" (dst), "+S" (src), "+c" (cnt) : : "memory");
+	cnt = size / 8;
+	asm volatile ("rep movsq"
+			: "+D" (dst), "+S" (src), "+c" (cnt) : : "memory");
+	cnt = size % 8;
+	asm volatile ("rep movsb"
+			: "+D" (dst), "+S" (src), "+c" (cnt) : : "memory");
 
 	return dst_;
 }
@@ -23,21 +52,29 @@ void *
 memmove (void *dst_, const void *src_, size_t size) {
 	unsigned char *dst = dst_;
 	const unsigned char *src = src_;
+	size_t cnt;
 
 	ASSERT (dst != NULL || size == 0);
 	ASSERT (src != NULL || size == 0);
 
-	if (dst < src) {
-		while (size-- > 0)
-			*dst++ = *src++;
-	} else {
-		dst += size;
-		src += size;
-		while (size-- > 0)
-			*--dst = *--src;
-	}
+	if (dst <= src || dst >= src + size)
+		return memcpy (dst_, src_, size);
+
+	/* DST overlaps the end of SRC, so copy downward, from the
+	   last byte: first the bytes past the last whole word, then
+	   the words. */
+	dst += size - 1;
+	src += size - 1;
+	cnt = size % 8;
+	asm volatile ("std; rep movsb; cld"
+			: "+D" (dst), "+S" (src), "+c" (cnt) : : "memory");
+	dst -= 7;
+	src -= 7;
+	cnt = size / 8;
+	asm volatile ("std; rep movsq; cld"
+			: "+D" (dst), "+S" (src), "+c" (cnt) : : "memory");
 
-	return dst;
+	return dst_;
 }
 
 /* Find the first differing byte in the two blocks of SIZE bytes
@@ -52,6 +89,12 @@ memcmp (const void *a_, const void *b_, size_t size) {
 	ASSERT (a != NULL || size == 0);
 	ASSERT (b != NULL || size == 0);
 
+	/* Skip over equal words; the bytes of the first word that
+	   differs are compared below. */
+	for (; size >= 8 && *(const word_t *) a == *(const word_t *) b;
+			size -= 8, a += 8, b += 8)
+		continue;
+
 	for (; size-- > 0; a++, b++)
 		if (*a != *b)
 			return *a > *b ? +1 : -1;
@@ -257,11 +300,21 @@ strtok_r (char *s, const char *delimiters, char **save_ptr) {
 void *
 memset (void *dst_, int value, size_t size) {
 	unsigned char *dst = dst_;
+	uint64_t word = (unsigned char) value * ONES;
+	size_t cnt;
 
 	ASSERT (dst != NULL || size == 0);
 
-	while (size-- > 0)
-		*dst++ = value;
+	cnt = size >= ALIGN_MIN ? -(uintptr_t) dst % 8 : 0;
+	size -= cnt;
+	asm volatile ("rep stosb"
+			: "+D" (dst), "+c" (cnt) : "a" (word) : "memory");
+	cnt = size / 8;
+	asm volatile ("rep stosq"
+			: "+D" (dst), "+c" (cnt) : "a" (word) : "memory");
+	cnt = size % 8;
+	asm volatile ("rep stosb"
+			: "+D" (dst), "+c" (cnt) : "a" (word) : "memory");
 
 	return dst_;
 }
@@ -270,10 +323,20 @@ memset (void *dst_, int value, size_t size) {
 size_t
 strlen (const char *string) {
 	const char *p;
+	const word_t *w;
 
 	ASSERT (string);
 
-	for (p = string; *p != '\0'; p++)
+	/* Up to a word boundary byte by byte, so that no word read
+	   below crosses into a page the string does not reach. */
+	for (p = string; (uintptr_t) p % 8 != 0; p++)
+		if (*p == '\0')
+			return p - string;
+
+	/* Then a word at a time, until one has a zero byte. */
+	for (w = (const word_t *) p; ((*w - ONES) & ~*w & HIGHS) == 0; w++)
+		continue;
+	for (p = (const char *) w; *p != '\0'; p++)
 		continue;
 	return p - string;
 }
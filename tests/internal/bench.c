@@ -0,0 +1,81 @@
+#include "tests/internal/bench.h"
+#include <debug.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+struct bench
+  {
+    const char *name;
+    bench_func *function;
+  };
+
+static const struct bench benches[] =
+  {
+    {"palloc-bench", bench_palloc},
+    {"bitmap-bench", bench_bitmap},
+    {"string-bench", bench_string},
+#ifdef FILESYS
+    {"fs-bench", bench_fs},
+#endif
+  };
+
+static const char *bench_name;
+
+/* Runs the benchmark named NAME. */
+void
+run_bench (const char *name)
+{
+  const struct bench *b;
+
+  for (b = benches; b < benches + sizeof benches / sizeof *benches; b++)
+    if (!strcmp (name, b->name))
+      {
+        bench_name = name;
+        bench_msg ("begin");
+        b->function ();
+        bench_msg ("end");
+        return;
+      }
+  PANIC ("no benchmark named \"%s\"", name);
+}
+
+/* Prints FORMAT as if with printf(),
+   prefixing the output by the name of the benchmark
+   and following it with a new-line character. */
+void
+bench_msg (const char *format, ...)
+{
+  va_list args;
+
+  printf ("(%s) ", bench_name);
+  va_start (args, format);
+  vprintf (format, args);
+  va_end (args);
+  putchar ('\n');
+}
+
+/* Prints failure message FORMAT as if with printf(),
+   prefixing the output by the name of the benchmark and FAIL:
+   and following it with a new-line character,
+   and then panics the kernel. */
+void
+bench_fail (const char *format, ...)
+{
+  va_list args;
+
+  printf ("(%s) FAIL: ", bench_name);
+  va_start (args, format);
+  vprintf (format, args);
+  va_end (args);
+  putchar ('\n');
+
+  PANIC ("benchmark failed");
+}
+
+/* Prints a message indicating the current benchmark finished. */
+void
+bench_pass (void)
+{
+  printf ("(%s) PASS\n", bench_name);
+}
@@ -0,0 +1,21 @@
+#ifndef TESTS_INTERNAL_BENCH_H
+#define TESTS_INTERNAL_BENCH_H
+
+/* Benchmarks, run with the "bench" kernel action.  They are not
+   tests: none of them is graded, and what they print depends on
+   the host. */
+
+void run_bench (const char *);
+
+typedef void bench_func (void);
+
+extern bench_func bench_palloc;
+extern bench_func bench_bitmap;
+extern bench_func bench_string;
+extern bench_func bench_fs;
+
+void bench_msg (const char *, ...);
+void bench_fail (const char *, ...);
+void bench_pass (void);
+
+#endif /* tests/internal/bench.h */
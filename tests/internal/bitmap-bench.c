@@ -0,0 +1,106 @@
+/* Microbenchmark for lib/kernel/bitmap.c.
+
+   Fills a bitmap of BENCH_BITS bits to several levels, setting
+   each bit at random with the given probability, and at each one
+   measures how many operations per second the bitmap can do:
+   bitmap_scan() for a single clear bit and for a run of 16, from
+   a random starting point, and bitmap_count() over the whole map.
+
+   This is not a test we will run on your submitted projects.
+   The numbers it prints depend on the host. */
+
+#include <bitmap.h>
+#include <random.h>
+#include <stdio.h>
+#include "tests/internal/bench.h"
+#include "devices/timer.h"
+
+/* Number of bits in the bitmap. */
+#define BENCH_BITS (1024 * 1024)
+
+/* Number of timer ticks to spend on each measurement. */
+#define BENCH_TICKS 50
+
+static struct bitmap *map;
+
+static void fill (int pct);
+static void scan_1 (void);
+static void scan_16 (void);
+static void count_all (void);
+static long long measure (void (*op) (void));
+
+void
+bench_bitmap (void)
+{
+  static const int fill_pct[] = {0, 50, 90, 99};
+  size_t i;
+
+  map = bitmap_create (BENCH_BITS);
+  if (map == NULL)
+    bench_fail ("out of memory for %d-bit map", BENCH_BITS);
+
+  bench_msg ("%d-bit map", BENCH_BITS);
+  for (i = 0; i < sizeof fill_pct / sizeof *fill_pct; i++)
+    {
+      fill (fill_pct[i]);
+      bench_msg ("%2d%% full: %lld scan/s (1), %lld scan/s (16), "
+                 "%lld count/s", fill_pct[i], measure (scan_1),
+                 measure (scan_16), measure (count_all));
+    }
+  bitmap_destroy (map);
+  bench_pass ();
+}
+
+/* Sets each bit of the map with a probability of PCT percent. */
+static void
+fill (int pct)
+{
+  size_t i;
+
+  bitmap_set_all (map, false);
+  for (i = 0; i < BENCH_BITS; i++)
+    if (random_ulong () % 100 < (unsigned long) pct)
+      bitmap_mark (map, i);
+}
+
+/* Looks for one clear bit from a random place. */
+static void
+scan_1 (void)
+{
+  bitmap_scan (map, random_ulong () % BENCH_BITS, 1, false);
+}
+
+/* Looks for 16 consecutive clear bits from a random place. */
+static void
+scan_16 (void)
+{
+  bitmap_scan (map, random_ulong () % BENCH_BITS, 16, false);
+}
+
+/* Counts the set bits in the whole map. */
+static void
+count_all (void)
+{
+  bitmap_count (map, 0, BENCH_BITS, true);
+}
+
+/* Runs OP repeatedly for BENCH_TICKS ticks and returns how many
+   times per second it ran. */
+static long long
+measure (void (*op) (void))
+{
+  long long ops = 0;
+  int64_t start, elapsed;
+
+  timer_sleep (1);
+  start = timer_ticks ();
+  do
+    {
+      op ();
+      ops++;
+      elapsed = timer_elapsed (start);
+    }
+  while (elapsed < BENCH_TICKS);
+
+  return ops * TIMER_FREQ / elapsed;
+}
@@ -0,0 +1,128 @@
+/* Benchmark for the file system.
+
+   Times sequential writes and reads of one file, and the
+   creation, lookup, and removal of many small files, including
+   the write-back that each phase causes.  Run it with the file
+   system disk in RAM (-rd=hd0:1) to measure the file system code
+   alone, without the cost of an emulated disk, and without to
+   see what the disk adds.
+
+   This is not a test we will run on your submitted projects.
+   The numbers it prints depend on the host. */
+
+#ifdef FILESYS
+#include <stdio.h>
+#include <string.h>
+#include "tests/internal/bench.h"
+#include "devices/timer.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+
+/* Size of the file written and read, in bytes. */
+#define FILE_SIZE (512 * 1024)
+
+/* Size of each write or read. */
+#define CHUNK_SIZE 4096
+
+/* Number of small files created, looked up, and removed. */
+#define FILE_CNT 100
+
+static int64_t start_phase (void);
+static void end_phase (const char *name, int64_t start, long long ops,
+                       const char *unit);
+
+void
+bench_fs (void)
+{
+  char *chunk = malloc (CHUNK_SIZE);
+  struct file *f;
+  char name[16];
+  int64_t start;
+  off_t ofs;
+  int i;
+
+  if (chunk == NULL)
+    bench_fail ("out of memory");
+  memset (chunk, 0x5a, CHUNK_SIZE);
+
+  /* Sequential write, then read. */
+  if (!filesys_create ("bench", 0))
+    bench_fail ("create \"bench\" failed");
+  f = filesys_open ("bench");
+  if (f == NULL)
+    bench_fail ("open \"bench\" failed");
+  start = start_phase ();
+  for (ofs = 0; ofs < FILE_SIZE; ofs += CHUNK_SIZE)
+    if (file_write (f, chunk, CHUNK_SIZE) != CHUNK_SIZE)
+      bench_fail ("write failed at offset %d", (int) ofs);
+  journal_checkpoint ();
+  end_phase ("sequential write", start, FILE_SIZE / 1024, "kB");
+
+  file_seek (f, 0);
+  start = start_phase ();
+  for (ofs = 0; ofs < FILE_SIZE; ofs += CHUNK_SIZE)
+    if (file_read (f, chunk, CHUNK_SIZE) != CHUNK_SIZE)
+      bench_fail ("read failed at offset %d", (int) ofs);
+  end_phase ("sequential read", start, FILE_SIZE / 1024, "kB");
+  file_close (f);
+  filesys_remove ("bench");
+
+  /* Small files. */
+  start = start_phase ();
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      snprintf (name, sizeof name, "small%d", i);
+      if (!filesys_create (name, 512))
+        bench_fail ("create \"%s\" failed", name);
+    }
+  journal_checkpoint ();
+  end_phase ("create", start, FILE_CNT, "files");
+
+  start = start_phase ();
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      snprintf (name, sizeof name, "small%d", i);
+      f = filesys_open (name);
+      if (f == NULL)
+        bench_fail ("open \"%s\" failed", name);
+      file_close (f);
+    }
+  end_phase ("open", start, FILE_CNT, "files");
+
+  start = start_phase ();
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      snprintf (name, sizeof name, "small%d", i);
+      if (!filesys_remove (name))
+        bench_fail ("remove \"%s\" failed", name);
+    }
+  journal_checkpoint ();
+  end_phase ("remove", start, FILE_CNT, "files");
+
+  free (chunk);
+  bench_pass ();
+}
+
+/* Waits for the start of a timer tick and returns it. */
+static int64_t
+start_phase (void)
+{
+  timer_sleep (1);
+  return timer_ticks ();
+}
+
+/* Reports the phase NAME, which began at tick START and handled
+   OPS units named UNIT. */
+static void
+end_phase (const char *name, int64_t start, long long ops, const char *unit)
+{
+  int64_t elapsed = timer_elapsed (start);
+
+  if (elapsed == 0)
+    elapsed = 1;
+  bench_msg ("%s: %lld %s in %lld ticks, %lld %s/s", name, ops, unit,
+             (long long) elapsed, ops * TIMER_FREQ / elapsed, unit);
+}
+#endif /* FILESYS */
@@ -0,0 +1,128 @@
+/* Microbenchmark for threads/palloc.c.
+
+   Fills the user pool to several levels and, at each one,
+   measures how many page allocations per second palloc can hand
+   out, both through palloc_get_page(), which is served from the
+   per-CPU magazine, and through palloc_get_multiple() with a
+   count of 1, which always goes to the buddy allocator.
+
+   This is not a test we will run on your submitted projects.
+   The numbers it prints depend on the host. */
+
+#include <stdio.h>
+#include "tests/internal/bench.h"
+#include "threads/palloc.h"
+#include "devices/timer.h"
+
+/* Number of timer ticks to spend on each measurement. */
+#define BENCH_TICKS 50
+
+/* Pages allocated and then freed in each round. */
+#define ROUND_PAGES 64
+
+/* Pages held while measuring, chained through their first word. */
+static void *held;
+
+static void hold (size_t page_cnt);
+static void release (void);
+static size_t count_free (void);
+static long long measure (bool single);
+
+void
+bench_palloc (void)
+{
+  static const int fill_pct[] = {0, 50, 90, 99};
+  size_t total = count_free ();
+  size_t i;
+
+  bench_msg ("user pool: %zu free pages", total);
+  for (i = 0; i < sizeof fill_pct / sizeof *fill_pct; i++)
+    {
+      hold (total * fill_pct[i] / 100);
+      bench_msg ("%2d%% full: %lld allocs/s (get_page), "
+                 "%lld allocs/s (get_multiple)",
+                 fill_pct[i], measure (true), measure (false));
+      release ();
+    }
+  bench_pass ();
+}
+
+/* Allocates PAGE_CNT user pages and keeps them until release(). */
+static void
+hold (size_t page_cnt)
+{
+  while (page_cnt-- > 0)
+    {
+      void **page = palloc_get_page (PAL_USER);
+      if (page == NULL)
+        bench_fail ("out of pages while filling pool");
+      *page = held;
+      held = page;
+    }
+}
+
+/* Frees every page taken by hold(). */
+static void
+release (void)
+{
+  while (held != NULL)
+    {
+      void **page = held;
+      held = *page;
+      palloc_free_page (page);
+    }
+}
+
+/* Returns the number of pages that can currently be allocated
+   from the user pool. */
+static size_t
+count_free (void)
+{
+  size_t cnt = 0;
+  void **page;
+
+  while ((page = palloc_get_page (PAL_USER)) != NULL)
+    {
+      *page = held;
+      held = page;
+      cnt++;
+    }
+  release ();
+  return cnt;
+}
+
+/* Allocates and frees rounds of ROUND_PAGES single pages for
+   BENCH_TICKS ticks and returns the allocation rate.  Uses
+   palloc_get_page() if SINGLE is true, palloc_get_multiple()
+   otherwise. */
+static long long
+measure (bool single)
+{
+  void *pages[ROUND_PAGES];
+  long long allocs = 0;
+  int64_t start, elapsed;
+  size_t i, cnt;
+
+  timer_sleep (1);
+  start = timer_ticks ();
+  do
+    {
+      for (cnt = 0; cnt < ROUND_PAGES; cnt++)
+        {
+          pages[cnt] = single ? palloc_get_page (PAL_USER)
+                              : palloc_get_multiple (PAL_USER, 1);
+          if (pages[cnt] == NULL)
+            break;
+        }
+      for (i = 0; i < cnt; i++)
+        if (single)
+          palloc_free_page (pages[i]);
+        else
+          palloc_free_multiple (pages[i], 1);
+      allocs += cnt;
+      elapsed = timer_elapsed (start);
+    }
+  while (elapsed < BENCH_TICKS);
+
+  return allocs * TIMER_FREQ / elapsed;
+}
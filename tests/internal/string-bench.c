@@ -0,0 +1,113 @@
+/* Microbenchmark for the block operations in lib/string.c.
+
+   Measures the throughput of memcpy(), memset() and memcmp() over
+   blocks of several sizes, with the blocks page-aligned and with
+   them misaligned by a few bytes, next to a plain byte loop doing
+   the same work.  For whole pages, also measures copy_page() and
+   clear_page().
+
+   This is not a test we will run on your submitted projects.
+   The numbers it prints depend on the host. */
+
+#include <stdio.h>
+#include <string.h>
+#include "tests/internal/bench.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
+
+/* Number of timer ticks to spend on each measurement. */
+#define BENCH_TICKS 20
+
+/* Largest block measured, and pages to hold it at an offset. */
+#define MAX_SIZE (64 * 1024)
+#define BUF_PAGES (MAX_SIZE / PGSIZE + 1)
+
+enum op
+  {
+    OP_MEMCPY, OP_MEMSET, OP_MEMCMP,
+    OP_BYTE_COPY,                       /* Byte loop, for comparison. */
+    OP_COPY_PAGE, OP_CLEAR_PAGE
+  };
+
+static uint8_t *src_buf, *dst_buf;
+
+static long long measure (enum op, size_t size, size_t ofs);
+
+void
+bench_string (void)
+{
+  static const size_t sizes[] = {16, 256, 4096, MAX_SIZE};
+  static const size_t offsets[] = {0, 3};
+  size_t i, j;
+
+  src_buf = palloc_get_multiple (PAL_ZERO, BUF_PAGES);
+  dst_buf = palloc_get_multiple (PAL_ZERO, BUF_PAGES);
+  if (src_buf == NULL || dst_buf == NULL)
+    bench_fail ("out of memory for buffers");
+
+  bench_msg ("throughput in MB/s");
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++)
+    for (j = 0; j < sizeof offsets / sizeof *offsets; j++)
+      bench_msg ("%6zu bytes, offset %zu: memcpy %lld, memset %lld, "
+                 "memcmp %lld, byte loop %lld",
+                 sizes[i], offsets[j],
+                 measure (OP_MEMCPY, sizes[i], offsets[j]),
+                 measure (OP_MEMSET, sizes[i], offsets[j]),
+                 measure (OP_MEMCMP, sizes[i], offsets[j]),
+                 measure (OP_BYTE_COPY, sizes[i], offsets[j]));
+  bench_msg ("  page: copy_page %lld, clear_page %lld",
+             measure (OP_COPY_PAGE, PGSIZE, 0),
+             measure (OP_CLEAR_PAGE, PGSIZE, 0));
+
+  palloc_free_multiple (src_buf, BUF_PAGES);
+  palloc_free_multiple (dst_buf, BUF_PAGES);
+  bench_pass ();
+}
+
+/* Runs OP on SIZE-byte blocks, OFS bytes past the start of the
+   buffers, for BENCH_TICKS ticks and returns the throughput in
+   MB/s. */
+static long long
+measure (enum op op, size_t size, size_t ofs)
+{
+  uint8_t *dst = dst_buf + ofs;
+  const uint8_t *src = src_buf + ofs;
+  long long bytes = 0;
+  int64_t start, elapsed;
+  size_t i;
+
+  timer_sleep (1);
+  start = timer_ticks ();
+  do
+    {
+      switch (op)
+        {
+        case OP_MEMCPY:
+          memcpy (dst, src, size);
+          break;
+        case OP_MEMSET:
+          memset (dst, 0, size);
+          break;
+        case OP_MEMCMP:
+          if (memcmp (dst, src, size) != 0)
+            bench_fail ("buffers differ");
+          break;
+        case OP_BYTE_COPY:
+          for (i = 0; i < size; i++)
+            dst[i] = src[i];
+          break;
+        case OP_COPY_PAGE:
+          copy_page (dst, src);
+          break;
+        case OP_CLEAR_PAGE:
+          clear_page (dst);
+          break;
+        }
+      bytes += size;
+      elapsed = timer_elapsed (start);
+    }
+  while (elapsed < BENCH_TICKS);
+
+  return bytes * TIMER_FREQ / elapsed / (1024 * 1024);
+}
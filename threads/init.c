@@ -20,6 +20,7 @@
 #include "threads/mmu.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
+#include "threads/slab.h"
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/process.h"
@@ -29,6 +30,7 @@
 #include "userprog/tss.h"
 #endif
 #include "tests/threads/tests.h"
+#include "tests/internal/bench.h"
 #ifdef VM
 #include "vm/vm.h"
 #endif
@@ -220,6 +222,8 @@ parse_options (char **argv) {
 #ifdef FILESYS
 		else if (!strcmp (name, "-f"))
 			format_filesys = true;
+		else if (!strcmp (name, "-rd"))
+			disk_ramdisk_slots = value;
 #endif
 		else if (!strcmp (name, "-rs"))
 			random_init (atoi (value));
@@ -230,6 +234,12 @@ parse_options (char **argv) {
 			user_page_limit = atoi (value);
 		else if (!strcmp (name, "-threads-tests"))
 			thread_tests = true;
+#endif
+#ifdef VM
+		else if (!strcmp (name, "-rss"))
+			vm_rss_limit = atoi (value);
+		else if (!strcmp (name, "-swap"))
+			vm_swap_disks = value;
 #endif
 		else
 			PANIC ("unknown option `%s' (use -h for help)", name);
@@ -256,6 +266,12 @@ run_task (char **argv) {
 	printf ("Execution of '%s' complete.\n", task);
 }
 
+/* Runs the benchmark named in ARGV[1]. */
+static void
+run_benchmark (char **argv) {
+	run_bench (argv[1]);
+}
+
 /* Executes all of the actions specified in ARGV[]
    up to the null pointer sentinel. */
 static void
@@ -270,6 +286,7 @@ run_actions (char **argv) {
 	/* Table of supported actions. */
 	static const struct action actions[] = {
 		{"run", 2, run_task},
+		{"bench", 2, run_benchmark},
 #ifdef FILESYS
 		{"ls", 1, fsutil_ls},
 		{"cat", 2, fsutil_cat},
@@ -316,6 +333,7 @@ usage (void) {
 #else
 			"  run TEST           Run TEST.\n"
 #endif
+			"  bench NAME         Run benchmark NAME.\n"
 #ifdef FILESYS
 			"  ls                 List files in the root directory.\n"
 			"  cat FILE           Print FILE to the console.\n"
@@ -328,10 +346,17 @@ usage (void) {
 			"  -h                 Print this help message and power off.\n"
 			"  -q                 Power off VM after actions or on panic.\n"
 			"  -f                 Format file system disk during startup.\n"
+#ifdef FILESYS
+			"  -rd=DISK[,DISK...] Serve DISKs (e.g. hd0:1) from a copy in RAM.\n"
+#endif
 			"  -rs=SEED           Set random number seed to SEED.\n"
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+			"  -rss=PAGES         Limit each process to PAGES resident frames.\n"
+			"  -swap=DISK[,DISK...] Stripe swap across DISKs (default hd1:1).\n"
 #endif
 			);
 	power_off ();
@@ -358,6 +383,7 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	kmem_print_stats ();
 #ifdef FILESYS
 	disk_print_stats ();
 #endif
@@ -2,12 +2,14 @@
 #include <bitmap.h>
 #include <debug.h>
 #include <inttypes.h>
+#include <list.h>
 #include <round.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/loader.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -24,13 +26,61 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Each pool is a binary buddy allocator.  Free memory is kept as
+   blocks of 2**ORDER pages, aligned to their size relative to the
+   pool base, on one free list per order.  An allocation takes the
+   smallest block that fits, splitting larger ones as needed, and
+   gives back the pages it does not use.  Freeing merges a block
+   with its buddy for as long as the buddy is free too, so large
+   contiguous runs reappear as soon as their pages are released.
+   Neither operation depends on how full the pool is.
+
+   The free list links live in the first page of each free block.
+   ORDERS records, for every page that starts a free block, the
+   order of that block, which is all that is needed to find out
+   whether a buddy can be merged.
+
+   The free lists are protected by disabling interrupts, not by a
+   lock, because the scheduler frees the pages of dying threads
+   with interrupts already off and must not sleep.  This is cheap
+   enough since no buddy operation does more than MAX_ORDER splits
+   or merges per block.
+
+   Single pages, by far the most common request, are served from a
+   small per-CPU magazine in front of each pool.  Pintos has only
+   one CPU, so there is one magazine per pool, and disabling
+   interrupts is enough to protect it: the common case does not
+   touch the buddy lists.  An empty magazine is refilled with one
+   block of MAG_BATCH pages, and a full one drained MAG_BATCH pages
+   at a time.  Pages sitting in a magazine count as allocated as
+   far as the buddy allocator is concerned. */
+
+/* Largest block is 2**MAX_ORDER pages. */
+#define MAX_ORDER 20
+
+/* ORDERS[] value for a page that does not start a free block. */
+#define NOT_FREE 0xff
+
+/* Per-CPU magazine of free single pages. */
+#define MAG_SIZE 32             /* Capacity of a magazine. */
+#define MAG_BATCH 16            /* Pages moved per refill or drain. */
+
+struct magazine {
+	size_t cnt;                     /* Number of pages in PAGES. */
+	void *pages[MAG_SIZE];          /* Free pages, used as a stack. */
+};
 
 /* A memory pool. */
 struct pool {
-	struct lock lock;               /* Mutual exclusion. */
-	struct bitmap *used_map;        /* Bitmap of free pages. */
+	struct bitmap *used_map;        /* Used pages, for debugging only. */
 	uint8_t *base;                  /* Base of pool. */
+	size_t page_cnt;                /* Number of pages in pool. */
+	uint8_t *orders;                /* Per page: order of the free block
+	                                   starting there, or NOT_FREE. */
+	struct list free_lists[MAX_ORDER + 1];  /* Free blocks by order. */
+	struct magazine mag;            /* Single-page cache. */
 };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -42,6 +92,7 @@ static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end);
 
 static bool page_from_pool (const struct pool *, void *page);
+static void pool_free_range (struct pool *, size_t page_idx, size_t page_cnt);
 
 /* multiboot info */
 struct multiboot_info {
@@ -219,16 +270,16 @@ split:
 			else
 				NOT_REACHED ();
 
-			pool_end = pool->base + bitmap_size (pool->used_map) * PGSIZE;
+			pool_end = pool->base + pool->page_cnt * PGSIZE;
 			page_idx = pg_no (start) - pg_no (pool->base);
 			if ((uint64_t) pool_end < end) {
 				page_cnt = ((uint64_t) pool_end - start) / PGSIZE;
-				bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+				pool_free_range (pool, page_idx, page_cnt);
 				start = (uint64_t) pool_end;
 				goto split;
 			} else {
 				page_cnt = ((uint64_t) end - start) / PGSIZE;
-				bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+				pool_free_range (pool, page_idx, page_cnt);
 			}
 		}
 	}
@@ -253,6 +304,129 @@ palloc_init (void) {
 	return ext_mem.end;
 }
 
+/* Returns the smallest order whose blocks hold PAGE_CNT pages. */
+static unsigned
+order_for (size_t page_cnt) {
+	unsigned order = 0;
+
+	while (((size_t) 1 << order) < page_cnt)
+		order++;
+	return order;
+}
+
+/* Returns the free list element stored in page PAGE_IDX of POOL. */
+static struct list_elem *
+block_elem (const struct pool *pool, size_t page_idx) {
+	return (struct list_elem *) (pool->base + PGSIZE * page_idx);
+}
+
+/* Returns the index of the page that holds free list element E. */
+static size_t
+block_idx (const struct pool *pool, struct list_elem *e) {
+	return pg_no (e) - pg_no (pool->base);
+}
+
+/* Puts the block of 2**ORDER pages at PAGE_IDX on POOL's free
+ * lists, first merging it with its buddy as long as the buddy is a
+ * free block of the same order. */
+static void
+free_block (struct pool *pool, size_t page_idx, unsigned order) {
+	while (order < MAX_ORDER) {
+		size_t buddy = page_idx ^ ((size_t) 1 << order);
+
+		if (buddy + ((size_t) 1 << order) > pool->page_cnt
+				|| pool->orders[buddy] != order)
+			break;
+		list_remove (block_elem (pool, buddy));
+		pool->orders[buddy] = NOT_FREE;
+		if (buddy < page_idx)
+			page_idx = buddy;
+		order++;
+	}
+	pool->orders[page_idx] = order;
+	list_push_front (&pool->free_lists[order], block_elem (pool, page_idx));
+}
+
+/* Frees the PAGE_CNT pages starting at PAGE_IDX in POOL, which need
+ * not form a single block, by splitting the range into the largest
+ * aligned blocks it contains.  Interrupts must be off. */
+static void
+pool_free_range (struct pool *pool, size_t page_idx, size_t page_cnt) {
+	ASSERT (intr_get_level () == INTR_OFF);
+
+#ifndef NDEBUG
+	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
+	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+#endif
+
+	while (page_cnt > 0) {
+		unsigned order = 0;
+
+		while (order < MAX_ORDER
+				&& page_idx % ((size_t) 2 << order) == 0
+				&& ((size_t) 2 << order) <= page_cnt)
+			order++;
+		free_block (pool, page_idx, order);
+		page_idx += (size_t) 1 << order;
+		page_cnt -= (size_t) 1 << order;
+	}
+}
+
+/* Takes PAGE_CNT contiguous pages out of POOL and returns the index
+ * of the first one, or BITMAP_ERROR if no free block is large
+ * enough.  Interrupts must be off. */
+static size_t
+pool_alloc (struct pool *pool, size_t page_cnt) {
+	unsigned want = order_for (page_cnt);
+	unsigned order;
+	size_t page_idx;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	if (want > MAX_ORDER)
+		return BITMAP_ERROR;
+	for (order = want; order <= MAX_ORDER; order++)
+		if (!list_empty (&pool->free_lists[order]))
+			break;
+	if (order > MAX_ORDER)
+		return BITMAP_ERROR;
+
+	page_idx = block_idx (pool, list_pop_front (&pool->free_lists[order]));
+	pool->orders[page_idx] = NOT_FREE;
+
+	/* Split off upper halves until the block has the wanted order. */
+	while (order > want) {
+		order--;
+		free_block (pool, page_idx + ((size_t) 1 << order), order);
+	}
+
+#ifndef NDEBUG
+	ASSERT (bitmap_none (pool->used_map, page_idx, (size_t) 1 << want));
+	bitmap_set_multiple (pool->used_map, page_idx, (size_t) 1 << want, true);
+#endif
+
+	/* Give back the pages beyond PAGE_CNT. */
+	pool_free_range (pool, page_idx + page_cnt,
+			((size_t) 1 << want) - page_cnt);
+	return page_idx;
+}
+
+/* Returns every page in POOL's magazine to the buddy lists, so
+   that they can be merged into larger blocks.  Interrupts must be
+   off.  Returns true if any pages were returned. */
+static bool
+mag_drain (struct pool *pool) {
+	struct magazine *mag = &pool->mag;
+	size_t cnt = mag->cnt;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	while (mag->cnt > 0) {
+		void *page = mag->pages[--mag->cnt];
+		pool_free_range (pool, pg_no (page) - pg_no (pool->base), 1);
+	}
+	return cnt > 0;
+}
+
 /* Obtains and returns a group of PAGE_CNT contiguous free pages.
    If PAL_USER is set, the pages are obtained from the user pool,
    otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
@@ -262,10 +436,16 @@ palloc_init (void) {
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
-
-	lock_acquire (&pool->lock);
-	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-	lock_release (&pool->lock);
+	size_t page_idx = BITMAP_ERROR;
+	enum intr_level old_level;
+
+	if (page_cnt > 0) {
+		old_level = intr_disable ();
+		page_idx = pool_alloc (pool, page_cnt);
+		if (page_idx == BITMAP_ERROR && mag_drain (pool))
+			page_idx = pool_alloc (pool, page_cnt);
+		intr_set_level (old_level);
+	}
 	void *pages;
 
 	if (page_idx != BITMAP_ERROR)
@@ -284,6 +464,57 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	return pages;
 }
 
+/* Pops a page off POOL's magazine, refilling it from the buddy
+   lists first if it is empty.  Returns a null pointer if the pool
+   has no free pages at all.  Never sleeps. */
+static void *
+mag_get (struct pool *pool) {
+	struct magazine *mag = &pool->mag;
+	enum intr_level old_level;
+	void *page = NULL;
+	size_t page_idx, i;
+
+	old_level = intr_disable ();
+	if (mag->cnt == 0) {
+		/* Refill with one block of MAG_BATCH pages, which takes a
+		   single buddy operation, or with one page if no block that
+		   large is left. */
+		page_idx = pool_alloc (pool, MAG_BATCH);
+		if (page_idx != BITMAP_ERROR)
+			for (i = MAG_BATCH; i-- > 0; )
+				mag->pages[mag->cnt++] = pool->base + PGSIZE * (page_idx + i);
+		else if ((page_idx = pool_alloc (pool, 1)) != BITMAP_ERROR)
+			mag->pages[mag->cnt++] = pool->base + PGSIZE * page_idx;
+	}
+	if (mag->cnt > 0)
+		page = mag->pages[--mag->cnt];
+	intr_set_level (old_level);
+	return page;
+}
+
+/* Pushes PAGE onto POOL's magazine, first draining MAG_BATCH
+   pages back to the buddy lists if it is full.  Never sleeps, so
+   that the scheduler may free pages with interrupts off. */
+static void
+mag_put (struct pool *pool, void *page) {
+	struct magazine *mag = &pool->mag;
+	enum intr_level old_level;
+	size_t i;
+
+	old_level = intr_disable ();
+#ifndef NDEBUG
+	for (i = 0; i < mag->cnt; i++)
+		ASSERT (mag->pages[i] != page);
+#endif
+	if (mag->cnt == MAG_SIZE)
+		for (i = 0; i < MAG_BATCH; i++) {
+			void *old = mag->pages[--mag->cnt];
+			pool_free_range (pool, pg_no (old) - pg_no (pool->base), 1);
+		}
+	mag->pages[mag->cnt++] = page;
+	intr_set_level (old_level);
+}
+
 /* Obtains a single free page and returns its kernel virtual
    address.
    If PAL_USER is set, the page is obtained from the user pool,
@@ -293,7 +524,29 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
    FLAGS, in which case the kernel panics. */
 void *
 palloc_get_page (enum palloc_flags flags) {
-	return palloc_get_multiple (flags, 1);
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	void *page = mag_get (pool);
+
+	if (page) {
+		if (flags & PAL_ZERO)
+			clear_page (page);
+	} else {
+		if (flags & PAL_ASSERT)
+			PANIC ("palloc_get: out of pages");
+	}
+
+	return page;
+}
+
+/* Returns the pool that PAGES belongs to. */
+static struct pool *
+pool_of (void *pages) {
+	if (page_from_pool (&kernel_pool, pages))
+		return &kernel_pool;
+	else if (page_from_pool (&user_pool, pages))
+		return &user_pool;
+	else
+		NOT_REACHED ();
 }
 
 /* Frees the PAGE_CNT pages starting at PAGES. */
@@ -301,48 +554,80 @@ void
 palloc_free_multiple (void *pages, size_t page_cnt) {
 	struct pool *pool;
 	size_t page_idx;
+	enum intr_level old_level;
 
 	ASSERT (pg_ofs (pages) == 0);
 	if (pages == NULL || page_cnt == 0)
 		return;
 
-	if (page_from_pool (&kernel_pool, pages))
-		pool = &kernel_pool;
-	else if (page_from_pool (&user_pool, pages))
-		pool = &user_pool;
-	else
-		NOT_REACHED ();
-
+	pool = pool_of (pages);
 	page_idx = pg_no (pages) - pg_no (pool->base);
 
 #ifndef NDEBUG
 	memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
-	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
-	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	old_level = intr_disable ();
+	pool_free_range (pool, page_idx, page_cnt);
+	intr_set_level (old_level);
 }
 
 /* Frees the page at PAGE. */
 void
 palloc_free_page (void *page) {
-	palloc_free_multiple (page, 1);
+	ASSERT (pg_ofs (page) == 0);
+	if (page == NULL)
+		return;
+
+#ifndef NDEBUG
+	memset (page, 0xcc, PGSIZE);
+#endif
+	mag_put (pool_of (page), page);
+}
+
+/* Copies the page at SRC to the page at DST.  Both must be
+   page-aligned, which lets the whole page go by REP MOVSQ with
+   none of memcpy()'s checks for odd sizes and alignments. */
+void
+copy_page (void *dst, const void *src) {
+	size_t cnt = PGSIZE / sizeof (uint64_t);
+
+	ASSERT (pg_ofs (dst) == 0 && pg_ofs (src) == 0);
+	asm volatile ("rep movsq"
+			: "+D" (dst), "+S" (src), "+c" (cnt) : : "memory");
+}
+
+/* Fills the page-aligned page at PAGE with zeros. */
+void
+clear_page (void *page) {
+	size_t cnt = PGSIZE / sizeof (uint64_t);
+
+	ASSERT (pg_ofs (page) == 0);
+	asm volatile ("rep stosq"
+			: "+D" (page), "+c" (cnt) : "a" (0) : "memory");
 }
 
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
-     and subtract it from the pool's size. */
+  /* We'll put the pool's used_map and order array at *BM_BASE.
+     Calculate the space needed for them and advance *BM_BASE
+     past it. */
 	uint64_t pgcnt = (end - start) / PGSIZE;
-	size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (pgcnt), PGSIZE) * PGSIZE;
+	size_t bm_size = ROUND_UP (bitmap_buf_size (pgcnt), sizeof (void *));
+	size_t bm_pages = DIV_ROUND_UP (bm_size + pgcnt, PGSIZE) * PGSIZE;
+	unsigned order;
 
-	lock_init(&p->lock);
-	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
+	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_size);
 	p->base = (void *) start;
+	p->page_cnt = pgcnt;
+	p->mag.cnt = 0;
+	p->orders = (uint8_t *) *bm_base + bm_size;
+	for (order = 0; order <= MAX_ORDER; order++)
+		list_init (&p->free_lists[order]);
 
 	// Mark all to unusable.
 	bitmap_set_all(p->used_map, true);
+	memset (p->orders, NOT_FREE, pgcnt);
 
 	*bm_base += bm_pages;
 }
@@ -353,6 +638,6 @@ static bool
 page_from_pool (const struct pool *pool, void *page) {
 	size_t page_no = pg_no (page);
 	size_t start_page = pg_no (pool->base);
-	size_t end_page = start_page + bitmap_size (pool->used_map);
+	size_t end_page = start_page + pool->page_cnt;
 	return page_no >= start_page && page_no < end_page;
 }
@@ -0,0 +1,351 @@
+#include "threads/slab.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Slab allocator.
+
+   Each object cache hands out objects of one exact size.  Its
+   memory comes from the page allocator one page, called a
+   "slab", at a time.  A slab starts with a header, followed by
+   an array of free-list links, one per object, followed by the
+   objects themselves.  Keeping the links out of the objects means
+   a free object keeps whatever its constructor put there, so the
+   constructor only runs once per object, when its slab is made.
+
+   A cache sorts its slabs onto three lists: partial slabs, which
+   have both free and used objects and are where allocations go
+   first; full slabs, which are ignored until an object in them is
+   freed; and empty slabs, of which at most KMEM_EMPTY_MAX are
+   kept around before pages go back to palloc.
+
+   Because every slab is exactly one page and starts with a
+   header carrying SLAB_MAGIC, the slab, and hence the cache, of
+   any object can be found by rounding its address down to a page
+   boundary.  free() relies on this. */
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* Number of empty slabs a cache keeps instead of freeing. */
+#define KMEM_EMPTY_MAX 1
+
+/* Marks the end of a slab's free list. */
+#define FREE_END UINT16_MAX
+
+/* Objects are aligned to this many bytes. */
+#define KMEM_ALIGN 8
+
+/* Object cache. */
+struct kmem_cache {
+	char name[16];              /* Name, for statistics. */
+	size_t obj_size;            /* Size of each object in bytes. */
+	size_t obj_cnt;             /* Number of objects per slab. */
+	size_t obj_ofs;             /* Offset of first object in slab. */
+	kmem_ctor_func *ctor;       /* Constructor, or null. */
+	struct lock lock;           /* Protects everything below. */
+	struct list partial;        /* Slabs with free and used objects. */
+	struct list full;           /* Slabs with no free objects. */
+	struct list empty;          /* Slabs with no used objects. */
+	size_t empty_cnt;           /* Length of EMPTY. */
+
+	/* Statistics. */
+	size_t slab_cnt;            /* Slabs currently owned. */
+	size_t slab_peak;           /* Most slabs ever owned at once. */
+	size_t in_use;              /* Objects currently allocated. */
+	long long alloc_cnt;        /* Total allocations. */
+	long long free_cnt;         /* Total frees. */
+
+	struct list_elem elem;      /* Element in cache_list. */
+};
+
+/* Slab header, at the start of each slab's page. */
+struct slab {
+	unsigned magic;             /* Always set to SLAB_MAGIC. */
+	struct kmem_cache *cache;   /* Owning cache. */
+	struct list_elem elem;      /* Element in one of the cache's lists. */
+	uint16_t in_use;            /* Number of allocated objects. */
+	uint16_t free;              /* Index of first free object. */
+	uint16_t next[];            /* Free-list link for each object. */
+};
+
+/* The cache that struct kmem_cache objects come from. */
+static struct kmem_cache cache_cache;
+
+/* All caches, for statistics. */
+static struct list cache_list;
+static struct lock cache_list_lock;
+
+static void cache_init (struct kmem_cache *, const char *name, size_t size,
+		kmem_ctor_func *);
+static struct slab *slab_create (struct kmem_cache *);
+static void slab_destroy (struct kmem_cache *, struct slab *);
+static struct slab *obj_to_slab (const void *);
+static void *slab_obj (struct kmem_cache *, struct slab *, size_t idx);
+
+/* Initializes the slab allocator.  Must run before any other
+   function in this file. */
+void
+slab_init (void) {
+	list_init (&cache_list);
+	lock_init (&cache_list_lock);
+	cache_init (&cache_cache, "kmem_cache", sizeof (struct kmem_cache), NULL);
+}
+
+/* Creates and returns a cache of objects of SIZE bytes named
+   NAME.  If CTOR is non-null, it is run on each object when its
+   slab is created.  Returns a null pointer if memory is not
+   available.  Panics if SIZE is too large for an object to fit
+   in a slab. */
+struct kmem_cache *
+kmem_cache_create (const char *name, size_t size, kmem_ctor_func *ctor) {
+	struct kmem_cache *cache = kmem_cache_alloc (&cache_cache);
+
+	if (cache != NULL)
+		cache_init (cache, name, size, ctor);
+	return cache;
+}
+
+/* Obtains and returns an object from CACHE.
+   Returns a null pointer if memory is not available. */
+void *
+kmem_cache_alloc (struct kmem_cache *cache) {
+	struct slab *s;
+	void *obj;
+
+	lock_acquire (&cache->lock);
+	if (!list_empty (&cache->partial))
+		s = list_entry (list_front (&cache->partial), struct slab, elem);
+	else if (!list_empty (&cache->empty)) {
+		s = list_entry (list_pop_front (&cache->empty), struct slab, elem);
+		cache->empty_cnt--;
+		list_push_front (&cache->partial, &s->elem);
+	} else {
+		s = slab_create (cache);
+		if (s == NULL) {
+			lock_release (&cache->lock);
+			return NULL;
+		}
+		list_push_front (&cache->partial, &s->elem);
+	}
+
+	ASSERT (s->free != FREE_END);
+	obj = slab_obj (cache, s, s->free);
+	s->free = s->next[s->free];
+	if (++s->in_use == cache->obj_cnt) {
+		list_remove (&s->elem);
+		list_push_front (&cache->full, &s->elem);
+	}
+	cache->in_use++;
+	cache->alloc_cnt++;
+	lock_release (&cache->lock);
+
+	return obj;
+}
+
+/* Like kmem_cache_alloc(), but zeroes the object.  Only useful
+   for caches without a constructor. */
+void *
+kmem_cache_zalloc (struct kmem_cache *cache) {
+	void *obj;
+
+	ASSERT (cache->ctor == NULL);
+	obj = kmem_cache_alloc (cache);
+	if (obj != NULL)
+		memset (obj, 0, cache->obj_size);
+	return obj;
+}
+
+/* Returns OBJ, which must have been allocated from CACHE, to
+   CACHE.  A null OBJ is ignored. */
+void
+kmem_cache_free (struct kmem_cache *cache, void *obj) {
+	struct slab *s;
+	size_t idx;
+
+	if (obj == NULL)
+		return;
+
+	s = obj_to_slab (obj);
+	ASSERT (s->cache == cache);
+	idx = ((uint8_t *) obj - ((uint8_t *) s + cache->obj_ofs))
+		/ cache->obj_size;
+
+#ifndef NDEBUG
+	/* Clear the object to help detect use-after-free bugs, unless
+	   that would destroy its constructed state. */
+	if (cache->ctor == NULL)
+		memset (obj, 0xcc, cache->obj_size);
+#endif
+
+	lock_acquire (&cache->lock);
+	ASSERT (s->in_use > 0);
+	s->next[idx] = s->free;
+	s->free = idx;
+	if (s->in_use-- == cache->obj_cnt) {
+		/* Full -> partial. */
+		list_remove (&s->elem);
+		list_push_front (&cache->partial, &s->elem);
+	}
+	if (s->in_use == 0) {
+		/* Partial -> empty, or back to the page allocator. */
+		list_remove (&s->elem);
+		if (cache->empty_cnt < KMEM_EMPTY_MAX) {
+			list_push_front (&cache->empty, &s->elem);
+			cache->empty_cnt++;
+		} else
+			slab_destroy (cache, s);
+	}
+	cache->in_use--;
+	cache->free_cnt++;
+	lock_release (&cache->lock);
+}
+
+/* Returns the size of CACHE's objects. */
+size_t
+kmem_cache_size (const struct kmem_cache *cache) {
+	return cache->obj_size;
+}
+
+/* Returns true if OBJ lies in a slab, false otherwise. */
+bool
+kmem_is_slab_object (const void *obj) {
+	const struct slab *s = pg_round_down (obj);
+	return s != NULL && s->magic == SLAB_MAGIC;
+}
+
+/* Frees OBJ, which must lie in a slab, back to its cache. */
+void
+kmem_free (void *obj) {
+	kmem_cache_free (obj_to_slab (obj)->cache, obj);
+}
+
+/* Returns the size of the cache that OBJ, which must lie in a
+   slab, was allocated from. */
+size_t
+kmem_object_size (const void *obj) {
+	return obj_to_slab (obj)->cache->obj_size;
+}
+
+/* Prints statistics for every cache that has been used. */
+void
+kmem_print_stats (void) {
+	struct list_elem *e;
+
+	lock_acquire (&cache_list_lock);
+	for (e = list_begin (&cache_list); e != list_end (&cache_list);
+			e = list_next (e)) {
+		struct kmem_cache *c = list_entry (e, struct kmem_cache, elem);
+
+		if (c->alloc_cnt == 0)
+			continue;
+		printf ("Slab %s: %zu B x %zu/slab, %zu in use, %zu slabs (peak %zu), "
+				"%lld allocs, %lld frees\n",
+				c->name, c->obj_size, c->obj_cnt, c->in_use, c->slab_cnt,
+				c->slab_peak, c->alloc_cnt, c->free_cnt);
+	}
+	lock_release (&cache_list_lock);
+}
+
+/* Initializes CACHE for objects of SIZE bytes and adds it to the
+   list of all caches. */
+static void
+cache_init (struct kmem_cache *cache, const char *name, size_t size,
+		kmem_ctor_func *ctor) {
+	size_t obj_size = ROUND_UP (size > 0 ? size : 1, KMEM_ALIGN);
+	size_t obj_cnt;
+
+	/* Find how many objects, with their links, fit in a slab. */
+	obj_cnt = (PGSIZE - sizeof (struct slab)) / (obj_size + sizeof (uint16_t));
+	while (obj_cnt > 0
+			&& ROUND_UP (sizeof (struct slab) + obj_cnt * sizeof (uint16_t),
+				KMEM_ALIGN) + obj_cnt * obj_size > PGSIZE)
+		obj_cnt--;
+	if (obj_cnt == 0)
+		PANIC ("kmem_cache_create: %zu-byte objects for \"%s\" do not fit "
+				"in a slab", size, name);
+
+	strlcpy (cache->name, name, sizeof cache->name);
+	cache->obj_size = obj_size;
+	cache->obj_cnt = obj_cnt;
+	cache->obj_ofs = ROUND_UP (sizeof (struct slab)
+			+ obj_cnt * sizeof (uint16_t), KMEM_ALIGN);
+	cache->ctor = ctor;
+	lock_init (&cache->lock);
+	list_init (&cache->partial);
+	list_init (&cache->full);
+	list_init (&cache->empty);
+	cache->empty_cnt = 0;
+	cache->slab_cnt = cache->slab_peak = cache->in_use = 0;
+	cache->alloc_cnt = cache->free_cnt = 0;
+
+	lock_acquire (&cache_list_lock);
+	list_push_back (&cache_list, &cache->elem);
+	lock_release (&cache_list_lock);
+}
+
+/* Allocates a new slab for CACHE, constructs its objects, and
+   returns it, without putting it on any list.  Returns a null
+   pointer if memory is not available. */
+static struct slab *
+slab_create (struct kmem_cache *cache) {
+	struct slab *s = palloc_get_page (0);
+	size_t i;
+
+	if (s == NULL)
+		return NULL;
+
+	s->magic = SLAB_MAGIC;
+	s->cache = cache;
+	s->in_use = 0;
+	s->free = 0;
+	for (i = 0; i < cache->obj_cnt; i++) {
+		s->next[i] = i + 1 < cache->obj_cnt ? i + 1 : FREE_END;
+		if (cache->ctor != NULL)
+			cache->ctor (slab_obj (cache, s, i));
+	}
+
+	if (++cache->slab_cnt > cache->slab_peak)
+		cache->slab_peak = cache->slab_cnt;
+	return s;
+}
+
+/* Returns slab S, which must be empty and on no list, to the page
+   allocator. */
+static void
+slab_destroy (struct kmem_cache *cache, struct slab *s) {
+	ASSERT (s->in_use == 0);
+
+	s->magic = 0;
+	cache->slab_cnt--;
+	palloc_free_page (s);
+}
+
+/* Returns the slab that OBJ is inside. */
+static struct slab *
+obj_to_slab (const void *obj) {
+	struct slab *s = pg_round_down (obj);
+
+	/* Check that the slab is valid. */
+	ASSERT (s != NULL);
+	ASSERT (s->magic == SLAB_MAGIC);
+
+	/* Check that the object is properly aligned for the slab. */
+	ASSERT (pg_ofs (obj) >= s->cache->obj_ofs);
+	ASSERT ((pg_ofs (obj) - s->cache->obj_ofs) % s->cache->obj_size == 0);
+
+	return s;
+}
+
+/* Returns the IDX'th object in slab S of CACHE. */
+static void *
+slab_obj (struct kmem_cache *cache, struct slab *s, size_t idx) {
+	ASSERT (idx < cache->obj_cnt);
+	return (uint8_t *) s + cache->obj_ofs + idx * cache->obj_size;
+}
@@ -9,6 +9,20 @@
 /* Number of page faults processed. */
 static long long page_fault_cnt;
 
+#ifdef VM
+/* Page faults seen by the VM, by class. */
+static long long fault_class_cnt[VM_FAULT_CLASS_CNT];
+
+/* Histogram of fault handling latency.  Bucket I counts faults that
+ * took less than 2**(I + FAULT_HIST_SHIFT) TSC cycles; the last
+ * bucket also takes everything slower. */
+#define FAULT_HIST_SHIFT 8
+#define FAULT_HIST_CNT 16
+static long long fault_latency_hist[FAULT_HIST_CNT];
+
+static void record_fault (enum vm_fault_class, uint64_t cycles);
+#endif
+
 static void kill (struct intr_frame *);
 static void page_fault (struct intr_frame *);
 
@@ -64,8 +78,39 @@ exception_init (void) {
 void
 exception_print_stats (void) {
 	printf ("Exception: %lld page faults\n", page_fault_cnt);
+#ifdef VM
+	int i;
+
+	for (i = 0; i < VM_FAULT_CLASS_CNT; i++)
+		if (fault_class_cnt[i] != 0)
+			printf ("  %s: %lld\n", vm_fault_class_name (i), fault_class_cnt[i]);
+	for (i = 0; i < FAULT_HIST_CNT; i++)
+		if (fault_latency_hist[i] != 0)
+			printf ("  %s2^%d cycles: %lld\n", i < FAULT_HIST_CNT - 1 ? "<" : ">=",
+					i + FAULT_HIST_SHIFT - (i == FAULT_HIST_CNT - 1),
+					fault_latency_hist[i]);
+#endif
 }
 
+#ifdef VM
+/* Accounts one fault of class CLASS that took CYCLES to handle.
+   Faults are handled with interrupts on, so the counters are
+   updated with them off. */
+static void
+record_fault (enum vm_fault_class class, uint64_t cycles) {
+	enum intr_level old_level;
+	int bucket = 0;
+
+	while (bucket < FAULT_HIST_CNT - 1
+			&& cycles >= (1ULL << (bucket + FAULT_HIST_SHIFT)))
+		bucket++;
+	old_level = intr_disable ();
+	fault_class_cnt[class]++;
+	fault_latency_hist[bucket]++;
+	intr_set_level (old_level);
+}
+#endif
+
 /* Handler for an exception (probably) caused by a user process. */
 static void
 kill (struct intr_frame *f) {
@@ -142,7 +187,13 @@ page_fault (struct intr_frame *f) {
 
 #ifdef VM
 	/* For project 3 and later. */
-	if (vm_try_handle_fault (f, fault_addr, user, write, not_present))
+	enum vm_fault_class class;
+	uint64_t start = rdtsc ();
+	bool handled = vm_try_handle_fault (f, fault_addr, user, write,
+			not_present, &class);
+
+	record_fault (class, rdtsc () - start);
+	if (handled)
 		return;
 #endif
 
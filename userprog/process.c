@@ -13,6 +13,7 @@
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
+#include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
@@ -175,6 +176,9 @@ process_exec (void *f_name) {
 
 	/* We first kill the current context */
 	process_cleanup ();
+#ifdef VM
+	supplemental_page_table_init (&thread_current ()->spt);
+#endif
 
 	/* And then load the binary */
 	success = load (file_name, &_if);
@@ -216,6 +220,10 @@ process_exit (void) {
 	 * TODO: project2/process_termination.html).
 	 * TODO: We recommend you to implement process resource cleanup here. */
 
+#ifdef VM
+	if (curr->pml4 != NULL)
+		vm_print_rss (curr);
+#endif
 	process_cleanup ();
 }
 
@@ -226,6 +234,8 @@ process_cleanup (void) {
 
 #ifdef VM
 	supplemental_page_table_kill (&curr->spt);
+	file_close (curr->exec_file);
+	curr->exec_file = NULL;
 #endif
 
 	uint64_t *pml4;
@@ -341,6 +351,12 @@ load (const char *file_name, struct intr_frame *if_) {
 		printf ("load: %s: open failed\n", file_name);
 		goto done;
 	}
+#ifdef VM
+	/* Segments are read in on demand, so the executable stays
+	 * open, and unwritable, until process_cleanup(). */
+	t->exec_file = file;
+	file_deny_write (file);
+#endif
 
 	/* Read and verify executable header. */
 	if (file_read (file, &ehdr, sizeof ehdr) != sizeof ehdr
@@ -421,7 +437,9 @@ load (const char *file_name, struct intr_frame *if_) {
 
 done:
 	/* We arrive here whether the load is successful or not. */
+#ifndef VM
 	file_close (file);
+#endif
 	return success;
 }
 
@@ -574,11 +592,28 @@ install_page (void *upage, void *kpage, bool writable) {
  * If you want to implement the function for only project 2, implement it on the
  * upper block. */
 
+/* Where the contents of one page of a segment come from.  Passed
+ * to lazy_load_segment() as its AUX, which the page owns. */
+struct lazy_segment {
+	struct file *file;              /* The process's exec_file. */
+	off_t ofs;                      /* Offset in FILE. */
+	size_t read_bytes;              /* Bytes to read from FILE. */
+	size_t zero_bytes;              /* Bytes to zero after them. */
+};
+
+/* Fills PAGE, which has just been given a frame, as AUX, a
+ * struct lazy_segment, describes.  Called on the first fault on
+ * PAGE. */
 static bool
 lazy_load_segment (struct page *page, void *aux) {
-	/* TODO: Load the segment from the file */
-	/* TODO: This called when the first page fault occurs on address VA. */
-	/* TODO: VA is available when calling this function. */
+	struct lazy_segment *seg = aux;
+	uint8_t *kva = page->frame->kva;
+
+	if (file_read_at (seg->file, kva, seg->read_bytes, seg->ofs)
+			!= (off_t) seg->read_bytes)
+		return false;
+	memset (kva + seg->read_bytes, 0, seg->zero_bytes);
+	return true;
 }
 
 /* Loads a segment starting at offset OFS in FILE at address
@@ -609,15 +644,23 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
-		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		void *aux = NULL;
+		struct lazy_segment *aux = malloc (sizeof *aux);
+		if (aux == NULL)
+			return false;
+		aux->file = file;
+		aux->ofs = ofs;
+		aux->read_bytes = page_read_bytes;
+		aux->zero_bytes = page_zero_bytes;
 		if (!vm_alloc_page_with_initializer (VM_ANON, upage,
-					writable, lazy_load_segment, aux))
+					writable, lazy_load_segment, aux)) {
+			free (aux);
 			return false;
+		}
 
 		/* Advance. */
 		read_bytes -= page_read_bytes;
 		zero_bytes -= page_zero_bytes;
+		ofs += page_read_bytes;
 		upage += PGSIZE;
 	}
 	return true;
@@ -629,11 +672,12 @@ setup_stack (struct intr_frame *if_) {
 	bool success = false;
 	void *stack_bottom = (void *) (((uint8_t *) USER_STACK) - PGSIZE);
 
-	/* TODO: Map the stack on stack_bottom and claim the page immediately.
-	 * TODO: If success, set the rsp accordingly.
-	 * TODO: You should mark the page is stack. */
-	/* TODO: Your code goes here */
-
+	/* VM_MARKER_0 marks stack pages, as vm_stack_growth() does. */
+	if (vm_alloc_page (VM_ANON | VM_MARKER_0, stack_bottom, true)
+			&& vm_claim_page (stack_bottom)) {
+		if_->rsp = USER_STACK;
+		success = true;
+	}
 	return success;
 }
 #endif /* VM */
@@ -1,7 +1,20 @@
 /* anon.c: Implementation of page for non-disk image (a.k.a. anonymous page). */
 
 #include "vm/vm.h"
+#include <bitmap.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
 #include "devices/disk.h"
+#include "filesys/filesys.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Number of swap disk sectors that hold one page. */
+#define SECTORS_PER_PAGE (PGSIZE / DISK_SECTOR_SIZE)
+
+/* Most disks swap is striped across. */
+#define SWAP_DISK_MAX 4
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -17,36 +30,164 @@ static const struct page_operations anon_ops = {
 	.type = VM_ANON,
 };
 
+/* -swap: disks to swap to, e.g. "hd1:1,hd1:0", or null for the
+   swap disk alone. */
+const char *vm_swap_disks;
+
+/* Swap is striped across SWAP_DISK_CNT disks, SWAP_DISKS[0] being
+   SWAP_DISK.  Each page is split into SWAP_CHUNK-sector pieces,
+   one per disk, the last one possibly shorter, and slot N holds
+   its piece at sector N * SWAP_CHUNK of each disk.  The pieces are
+   read and written all at once, so that swapping one page keeps
+   every disk, and both ATA channels, busy at the same time. */
+static struct disk *swap_disks[SWAP_DISK_MAX];
+static size_t swap_disk_cnt;
+static size_t swap_chunk;
+
+/* One bit per swap slot, true if in use. */
+static struct bitmap *swap_table;
+static struct lock swap_lock;
+
+static size_t swap_disks_init (void);
+static void swap_io (size_t slot, void *kva, bool write);
+
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
-	/* TODO: Set up the swap_disk. */
-	swap_disk = NULL;
+	size_t slot_cnt = swap_disks_init ();
+
+	swap_disk = swap_disk_cnt > 0 ? swap_disks[0] : NULL;
+	swap_table = bitmap_create (slot_cnt);
+	if (swap_table == NULL)
+		PANIC ("swap table creation failed");
+	lock_init (&swap_lock);
+}
+
+/* Fills SWAP_DISKS from vm_swap_disks, or with hd1:1 if that is
+   not set, and returns the number of slots they hold together. */
+static size_t
+swap_disks_init (void) {
+	char names[64], *name, *save_ptr;
+	size_t slot_cnt = 0;
+	size_t i;
+
+	strlcpy (names, vm_swap_disks != NULL ? vm_swap_disks : "hd1:1",
+			sizeof names);
+	for (name = strtok_r (names, ",", &save_ptr); name != NULL;
+			name = strtok_r (NULL, ",", &save_ptr)) {
+		struct disk *d = disk_get_by_name (name);
+
+		for (i = 0; i < swap_disk_cnt; i++)
+			if (swap_disks[i] == d)
+				d = NULL;
+		if (d == NULL || d == filesys_disk) {
+			if (vm_swap_disks != NULL)
+				printf ("swap: cannot swap to %s\n", name);
+			continue;
+		}
+		if (swap_disk_cnt == SWAP_DISK_MAX) {
+			printf ("swap: striping across %d disks at most\n", SWAP_DISK_MAX);
+			break;
+		}
+		swap_disks[swap_disk_cnt++] = d;
+	}
+	if (swap_disk_cnt == 0)
+		return 0;
+
+	/* The slots are limited by the smallest disk. */
+	swap_chunk = DIV_ROUND_UP (SECTORS_PER_PAGE, swap_disk_cnt);
+	for (i = 0; i < swap_disk_cnt; i++) {
+		size_t cnt = disk_size (swap_disks[i]) / swap_chunk;
+
+		if (i == 0 || cnt < slot_cnt)
+			slot_cnt = cnt;
+	}
+	if (swap_disk_cnt > 1)
+		printf ("swap: %zu slots striped across %zu disks\n", slot_cnt,
+				swap_disk_cnt);
+	return slot_cnt;
+}
+
+/* Reads the page in swap slot SLOT into KVA, or writes KVA to it
+   if WRITE is true.  One request per disk is queued before
+   waiting for any of them.  Returns only once all of them are
+   done, so a page being swapped out still costs its evictor the
+   whole write. */
+static void
+swap_io (size_t slot, void *kva, bool write) {
+	struct disk_request reqs[SWAP_DISK_MAX];
+	enum disk_io_class old_class = disk_io_class_set (DISK_IO_SWAP);
+	size_t cnt = 0, ofs, i;
+
+	for (ofs = 0; ofs < SECTORS_PER_PAGE; ofs += swap_chunk) {
+		size_t len = SECTORS_PER_PAGE - ofs < swap_chunk
+			? SECTORS_PER_PAGE - ofs : swap_chunk;
+
+		disk_request_init (&reqs[cnt], swap_disks[cnt], slot * swap_chunk,
+				len, write, (uint8_t *) kva + ofs * DISK_SECTOR_SIZE);
+		disk_submit (&reqs[cnt++]);
+	}
+	for (i = 0; i < cnt; i++)
+		disk_wait (&reqs[i]);
+	disk_io_class_set (old_class);
 }
 
 /* Initialize the file mapping */
 bool
-anon_initializer (struct page *page, enum vm_type type, void *kva) {
+anon_initializer (struct page *page, enum vm_type type UNUSED,
+		void *kva UNUSED) {
 	/* Set up the handler */
 	page->operations = &anon_ops;
 
 	struct anon_page *anon_page = &page->anon;
+	anon_page->swap_slot = BITMAP_ERROR;
+	return true;
 }
 
 /* Swap in the page by read contents from the swap disk. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	struct anon_page *anon_page = &page->anon;
+	size_t slot = anon_page->swap_slot;
+
+	if (slot == BITMAP_ERROR)
+		return false;
+
+	swap_io (slot, kva, false);
+
+	lock_acquire (&swap_lock);
+	bitmap_reset (swap_table, slot);
+	lock_release (&swap_lock);
+	anon_page->swap_slot = BITMAP_ERROR;
+	return true;
 }
 
 /* Swap out the page by writing contents to the swap disk. */
 static bool
 anon_swap_out (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+	size_t slot;
+
+	lock_acquire (&swap_lock);
+	slot = bitmap_scan_and_flip (swap_table, 0, 1, false);
+	lock_release (&swap_lock);
+	if (slot == BITMAP_ERROR)
+		return false;
+
+	swap_io (slot, page->frame->kva, true);
+
+	anon_page->swap_slot = slot;
+	return true;
 }
 
 /* Destroy the anonymous page. PAGE will be freed by the caller. */
 static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+
+	if (anon_page->swap_slot != BITMAP_ERROR) {
+		lock_acquire (&swap_lock);
+		bitmap_reset (swap_table, anon_page->swap_slot);
+		lock_release (&swap_lock);
+	}
 }
@@ -1,8 +1,47 @@
 /* vm.c: Generic interface for virtual memory objects. */
 
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 #include "vm/vm.h"
 #include "vm/inspect.h"
+#include "intrinsic.h"
+
+/* Default RSS limit handed to every new supplemental page table.
+ * Set with the "-rss=PAGES" kernel option; 0 means unlimited. */
+size_t vm_rss_limit;
+
+/* Every user frame in use, in clock order.  Eviction walks this
+ * list with CLOCK_HAND, giving a second chance to frames whose
+ * accessed bit is set. */
+static struct list frame_table;
+static struct list_elem *clock_hand;
+static struct lock frame_lock;
+
+/* Signaled, with FRAME_LOCK, whenever an eviction finishes. */
+static struct condition evict_done;
+
+/* Slab caches for struct page and struct frame. */
+static struct kmem_cache *page_slab;
+static struct kmem_cache *frame_slab;
+
+/* Number of faults between two working-set samples of the same
+ * process. */
+#define WSET_SAMPLE_INTERVAL 64
+
+/* Maximum size of a user stack. */
+#define STACK_LIMIT (1 << 20)
+
+static uint64_t page_hash (const struct hash_elem *, void *);
+static bool page_less (const struct hash_elem *, const struct hash_elem *,
+		void *);
+static void frame_table_remove (struct frame *);
+static void vm_free_frame (struct page *);
 
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
@@ -15,7 +54,14 @@ vm_init (void) {
 #endif
 	register_inspect_intr ();
 	/* DO NOT MODIFY UPPER LINES. */
-	/* TODO: Your code goes here. */
+	list_init (&frame_table);
+	lock_init (&frame_lock);
+	cond_init (&evict_done);
+	clock_hand = NULL;
+	page_slab = kmem_cache_create ("page", sizeof (struct page), NULL);
+	frame_slab = kmem_cache_create ("frame", sizeof (struct frame), NULL);
+	if (page_slab == NULL || frame_slab == NULL)
+		PANIC ("vm_init: out of memory");
 }
 
 /* Get the type of the page. This function is useful if you want to know the
@@ -35,6 +81,8 @@ page_get_type (struct page *page) {
 /* Helpers */
 static struct frame *vm_get_victim (void);
 static bool vm_do_claim_page (struct page *page);
+static bool vm_claim_zero_page (struct page *page);
+static bool vm_install_frame (struct page *page, struct frame *frame);
 static struct frame *vm_evict_frame (void);
 
 /* Create the pending page object with initializer. If you want to create a
@@ -50,11 +98,32 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 
 	/* Check wheter the upage is already occupied or not. */
 	if (spt_find_page (spt, upage) == NULL) {
-		/* TODO: Create the page, fetch the initialier according to the VM type,
-		 * TODO: and then create "uninit" page struct by calling uninit_new. You
-		 * TODO: should modify the field after calling the uninit_new. */
-
-		/* TODO: Insert the page into the spt. */
+		bool (*initializer) (struct page *, enum vm_type, void *);
+		struct page *page;
+
+		switch (VM_TYPE (type)) {
+			case VM_ANON:
+				initializer = anon_initializer;
+				break;
+			case VM_FILE:
+				initializer = file_backed_initializer;
+				break;
+			default:
+				goto err;
+		}
+
+		page = kmem_cache_alloc (page_slab);
+		if (page == NULL)
+			goto err;
+		uninit_new (page, upage, init, type, aux, initializer);
+		page->writable = writable;
+		page->evicting = false;
+
+		if (!spt_insert_page (spt, page)) {
+			kmem_cache_free (page_slab, page);
+			goto err;
+		}
+		return true;
 	}
 err:
 	return false;
@@ -62,81 +131,329 @@ err:
 
 /* Find VA from spt and return page. On error, return NULL. */
 struct page *
-spt_find_page (struct supplemental_page_table *spt UNUSED, void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function. */
+spt_find_page (struct supplemental_page_table *spt, void *va) {
+	struct page p;
+	struct hash_elem *e;
 
-	return page;
+	p.va = pg_round_down (va);
+	e = hash_find (&spt->pages, &p.spt_elem);
+	return e != NULL ? hash_entry (e, struct page, spt_elem) : NULL;
 }
 
 /* Insert PAGE into spt with validation. */
 bool
-spt_insert_page (struct supplemental_page_table *spt UNUSED,
-		struct page *page UNUSED) {
-	int succ = false;
-	/* TODO: Fill this function. */
+spt_insert_page (struct supplemental_page_table *spt, struct page *page) {
+	ASSERT (pg_ofs (page->va) == 0);
 
-	return succ;
+	return hash_insert (&spt->pages, &page->spt_elem) == NULL;
 }
 
 void
 spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
+	hash_delete (&spt->pages, &page->spt_elem);
+	vm_free_frame (page);
 	vm_dealloc_page (page);
-	return true;
 }
 
-/* Get the struct frame, that will be evicted. */
+/* Returns true if frame F belongs to a process that holds more
+ * frames than its RSS limit allows. */
+static bool
+frame_over_limit (const struct frame *f, void *aux UNUSED) {
+	const struct supplemental_page_table *spt = &f->owner->spt;
+
+	return spt->rss_limit != 0 && spt->rss > spt->rss_limit;
+}
+
+/* Returns true if frame F belongs to thread AUX. */
+static bool
+frame_owned_by (const struct frame *f, void *aux) {
+	return f->owner == aux;
+}
+
+/* Returns the frame under the clock hand and advances the hand,
+ * wrapping around at the end of the frame table. */
+static struct frame *
+clock_advance (void) {
+	struct frame *f;
+
+	if (clock_hand == NULL || clock_hand == list_end (&frame_table))
+		clock_hand = list_begin (&frame_table);
+	f = list_entry (clock_hand, struct frame, elem);
+	clock_hand = list_next (clock_hand);
+	return f;
+}
+
+/* Runs the clock over the frames accepted by FILTER (all frames if
+ * FILTER is null) and returns the first one that has not been
+ * accessed since the hand last passed it.  Two sweeps are enough:
+ * the first one clears every accessed bit it meets.  Returns a null
+ * pointer if FILTER accepts no frame.  FRAME_LOCK must be held. */
+static struct frame *
+clock_scan (bool (*filter) (const struct frame *, void *), void *aux) {
+	size_t cnt = 2 * list_size (&frame_table);
+
+	while (cnt-- > 0) {
+		struct frame *f = clock_advance ();
+		uint64_t *pml4 = f->owner->pml4;
+
+		if (filter != NULL && !filter (f, aux))
+			continue;
+		if (pml4_is_accessed (pml4, f->page->va)) {
+			pml4_set_accessed (pml4, f->page->va, false);
+			continue;
+		}
+		return f;
+	}
+	return NULL;
+}
+
+/* Get the struct frame, that will be evicted.
+ * A process that is at its own RSS limit replaces one of its own
+ * frames.  Otherwise frames of processes over their limit go first,
+ * so a single runaway process cannot push everyone else's hot pages
+ * out; only then does the clock pick from the whole table. */
 static struct frame *
 vm_get_victim (void) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
 	struct frame *victim = NULL;
-	 /* TODO: The policy for eviction is up to you. */
 
+	ASSERT (lock_held_by_current_thread (&frame_lock));
+
+	if (list_empty (&frame_table))
+		return NULL;
+	if (spt->rss_limit != 0 && spt->rss >= spt->rss_limit)
+		victim = clock_scan (frame_owned_by, thread_current ());
+	if (victim == NULL)
+		victim = clock_scan (frame_over_limit, NULL);
+	if (victim == NULL)
+		victim = clock_scan (NULL, NULL);
 	return victim;
 }
 
 /* Evict one page and return the corresponding frame.
- * Return NULL on error.*/
+ * Return NULL on error.
+ * The victim is unmapped and taken off the frame table before its
+ * contents are written out, so that its owner cannot change them
+ * in the meantime, and FRAME_LOCK is not held during the write.
+ * Until the write is done, the page is marked EVICTING, and its
+ * owner waits on EVICT_DONE before faulting it back in or freeing
+ * it. */
 static struct frame *
 vm_evict_frame (void) {
-	struct frame *victim UNUSED = vm_get_victim ();
-	/* TODO: swap out the victim and return the evicted frame. */
-
-	return NULL;
+	struct frame *victim;
+	struct thread *owner;
+	struct page *page;
+	bool written;
+
+	lock_acquire (&frame_lock);
+	victim = vm_get_victim ();
+	if (victim == NULL) {
+		lock_release (&frame_lock);
+		return NULL;
+	}
+	page = victim->page;
+	owner = victim->owner;
+	pml4_clear_page (owner->pml4, page->va);
+	frame_table_remove (victim);
+	page->evicting = true;
+	lock_release (&frame_lock);
+
+	written = swap_out (page);
+
+	lock_acquire (&frame_lock);
+	page->evicting = false;
+	if (written) {
+		page->frame = NULL;
+		victim->page = NULL;
+		victim->owner = NULL;
+	} else {
+		/* Nowhere to put it: give the frame back to its owner.
+		 * Its page table is still there, so mapping it again
+		 * cannot fail for lack of memory. */
+		pml4_set_page (owner->pml4, page->va, victim->kva, page->writable);
+		list_push_back (&frame_table, &victim->elem);
+		owner->spt.rss++;
+		victim = NULL;
+	}
+	cond_broadcast (&evict_done, &frame_lock);
+	lock_release (&frame_lock);
+	return victim;
 }
 
 /* palloc() and get frame. If there is no available page, evict the page
- * and return it. This always return valid address. That is, if the user pool
- * memory is full, this function evicts the frame to get the available memory
- * space.*/
+ * and return it. That is, if the user pool memory is full, this function
+ * evicts the frame to get the available memory space.  Returns a null
+ * pointer if no page can be evicted, e.g. because swap is full. */
 static struct frame *
 vm_get_frame (void) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
 	struct frame *frame = NULL;
-	/* TODO: Fill this function. */
+	void *kva = NULL;
+
+	/* A process at its RSS limit does not get fresh memory, even
+	 * if there is some; it has to give up one of its frames. */
+	if (spt->rss_limit == 0 || spt->rss < spt->rss_limit)
+		kva = palloc_get_page (PAL_USER);
+
+	if (kva != NULL) {
+		frame = kmem_cache_alloc (frame_slab);
+		if (frame == NULL)
+			PANIC ("vm_get_frame: out of kernel memory");
+		frame->kva = kva;
+	} else {
+		frame = vm_evict_frame ();
+		if (frame == NULL)
+			return NULL;
+	}
 
-	ASSERT (frame != NULL);
-	ASSERT (frame->page == NULL);
+	frame->page = NULL;
+	frame->owner = NULL;
 	return frame;
 }
 
+/* Removes F from the frame table and charges it off its owner's
+ * RSS.  FRAME_LOCK must be held. */
+static void
+frame_table_remove (struct frame *f) {
+	if (clock_hand == &f->elem)
+		clock_hand = list_next (clock_hand);
+	list_remove (&f->elem);
+	f->owner->spt.rss--;
+}
+
+/* Unmaps and releases the frame backing PAGE, if any. */
+static void
+vm_free_frame (struct page *page) {
+	struct frame *frame;
+
+	/* An evictor may own the frame for now, and hand it to
+	 * someone else once it is done. */
+	lock_acquire (&frame_lock);
+	while (page->evicting)
+		cond_wait (&evict_done, &frame_lock);
+	frame = page->frame;
+	if (frame == NULL) {
+		lock_release (&frame_lock);
+		return;
+	}
+	page->frame = NULL;
+	pml4_clear_page (frame->owner->pml4, page->va);
+	frame_table_remove (frame);
+	lock_release (&frame_lock);
+
+	palloc_free_page (frame->kva);
+	kmem_cache_free (frame_slab, frame);
+}
+
 /* Growing the stack. */
 static void
-vm_stack_growth (void *addr UNUSED) {
+vm_stack_growth (void *addr) {
+	vm_alloc_page (VM_ANON | VM_MARKER_0, pg_round_down (addr), true);
 }
 
 /* Handle the fault on write_protected page */
 static bool
 vm_handle_wp (struct page *page UNUSED) {
+	/* Pages are never shared copy-on-write yet. */
+	return false;
 }
 
-/* Return true on success */
+/* Returns true if a user access to ADDR that faulted with user stack
+ * pointer in F should grow the stack.  PUSH may touch 8 bytes below
+ * the stack pointer before moving it. */
+static bool
+is_stack_access (const struct intr_frame *f, void *addr, bool user) {
+	uint8_t *va = addr;
+
+	if (!user)
+		return false;
+	return va >= (uint8_t *) f->rsp - 8
+		&& va < (uint8_t *) USER_STACK
+		&& va >= (uint8_t *) USER_STACK - STACK_LIMIT;
+}
+
+/* Classifies a not-present fault on PAGE, which is in the spt. */
+static enum vm_fault_class
+classify_page (const struct page *page) {
+	if (page->operations->type == VM_UNINIT) {
+		if (VM_TYPE (page->uninit.type) == VM_FILE)
+			return VM_FAULT_MMAP;
+		return page->uninit.init == NULL ? VM_FAULT_ZERO : VM_FAULT_LAZY;
+	}
+	return VM_TYPE (page->operations->type) == VM_FILE
+		? VM_FAULT_MMAP : VM_FAULT_SWAP;
+}
+
+/* Returns a short name for fault class CLASS. */
+const char *
+vm_fault_class_name (enum vm_fault_class class) {
+	static const char *names[VM_FAULT_CLASS_CNT] = {
+		[VM_FAULT_ZERO] = "zero-fill",
+		[VM_FAULT_LAZY] = "lazy load",
+		[VM_FAULT_STACK] = "stack growth",
+		[VM_FAULT_COW] = "copy-on-write",
+		[VM_FAULT_SWAP] = "swap-in",
+		[VM_FAULT_MMAP] = "mmap",
+		[VM_FAULT_INVALID] = "invalid",
+	};
+
+	ASSERT (class < VM_FAULT_CLASS_CNT);
+	return names[class];
+}
+
+/* Return true on success.  Stores the kind of fault into *CLASS,
+ * VM_FAULT_INVALID if the fault cannot be resolved. */
 bool
-vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
-		bool user UNUSED, bool write UNUSED, bool not_present UNUSED) {
-	struct supplemental_page_table *spt UNUSED = &thread_current ()->spt;
+vm_try_handle_fault (struct intr_frame *f, void *addr,
+		bool user, bool write, bool not_present, enum vm_fault_class *class) {
+	struct thread *t = thread_current ();
+	struct supplemental_page_table *spt = &t->spt;
 	struct page *page = NULL;
-	/* TODO: Validate the fault */
-	/* TODO: Your code goes here */
 
+	*class = VM_FAULT_INVALID;
+	if (addr == NULL || is_kernel_vaddr (addr))
+		return false;
+
+	page = spt_find_page (spt, addr);
+	if (!not_present) {
+		/* The page is mapped, so this is a write to a read-only
+		 * mapping of a page that may be writable. */
+		if (page == NULL || !write || !page->writable
+				|| !vm_handle_wp (page))
+			return false;
+		*class = VM_FAULT_COW;
+		return true;
+	}
+
+	if (page == NULL) {
+		if (!is_stack_access (f, addr, user))
+			return false;
+		vm_stack_growth (addr);
+		page = spt_find_page (spt, addr);
+		if (page == NULL)
+			return false;
+		*class = VM_FAULT_STACK;
+	} else if (write && !page->writable)
+		return false;
+	else
+		*class = classify_page (page);
+
+	if (++spt->fault_cnt % WSET_SAMPLE_INTERVAL == 0)
+		vm_sample_working_set (t);
+
+	/* The page may be on its way out.  Wait until it is; if the
+	 * eviction failed, it is mapped again and there is nothing
+	 * left to do. */
+	lock_acquire (&frame_lock);
+	while (page->evicting)
+		cond_wait (&evict_done, &frame_lock);
+	lock_release (&frame_lock);
+	if (page->frame != NULL)
+		return true;
+
+	/* New stack pages are zero-fill pages too. */
+	if (*class == VM_FAULT_ZERO || *class == VM_FAULT_STACK)
+		return vm_claim_zero_page (page);
 	return vm_do_claim_page (page);
 }
 
@@ -150,10 +467,14 @@ vm_dealloc_page (struct page *page) {
 
 /* Claim the page that allocate on VA. */
 bool
-vm_claim_page (void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function */
-
+vm_claim_page (void *va) {
+	struct page *page = spt_find_page (&thread_current ()->spt, va);
+
+	if (page == NULL)
+		return false;
+	/* Zero-fill pages get a zeroed frame, as on a fault. */
+	if (classify_page (page) == VM_FAULT_ZERO)
+		return vm_claim_zero_page (page);
 	return vm_do_claim_page (page);
 }
 
@@ -162,18 +483,139 @@ static bool
 vm_do_claim_page (struct page *page) {
 	struct frame *frame = vm_get_frame ();
 
+	if (frame == NULL)
+		return false;
+
 	/* Set links */
 	frame->page = page;
+	frame->owner = thread_current ();
 	page->frame = frame;
 
-	/* TODO: Insert page table entry to map page's VA to frame's PA. */
+	if (!swap_in (page, frame->kva)) {
+		page->frame = NULL;
+		palloc_free_page (frame->kva);
+		kmem_cache_free (frame_slab, frame);
+		return false;
+	}
+	return vm_install_frame (page, frame);
+}
+
+/* Fast path for VM_FAULT_ZERO faults.  Turns the uninit PAGE into an
+ * anonymous page directly and maps a zeroed frame for it, instead of
+ * going through uninit_initialize(), which has nothing to run for
+ * such a page anyway. */
+static bool
+vm_claim_zero_page (struct page *page) {
+	enum vm_type type = page->uninit.type;
+	struct frame *frame = vm_get_frame ();
+
+	if (frame == NULL)
+		return false;
+	frame->page = page;
+	frame->owner = thread_current ();
+	page->frame = frame;
+
+	anon_initializer (page, type, frame->kva);
+	clear_page (frame->kva);
+	return vm_install_frame (page, frame);
+}
+
+/* Maps FRAME, which already holds PAGE's contents, into the current
+ * process and enters it into the frame table. */
+static bool
+vm_install_frame (struct page *page, struct frame *frame) {
+	struct thread *t = thread_current ();
+
+	if (!pml4_set_page (t->pml4, page->va, frame->kva, page->writable)) {
+		page->frame = NULL;
+		palloc_free_page (frame->kva);
+		kmem_cache_free (frame_slab, frame);
+		return false;
+	}
+
+	lock_acquire (&frame_lock);
+	list_push_back (&frame_table, &frame->elem);
+	if (++t->spt.rss > t->spt.rss_peak)
+		t->spt.rss_peak = t->spt.rss;
+	lock_release (&frame_lock);
+	return true;
+}
+
+/* Counts the user pages of a process that were referenced since
+ * the previous sample and clears their accessed bits. */
+static bool
+sample_accessed_pte (uint64_t *pte, void *va, void *aux) {
+	size_t *cnt = aux;
+
+	if (is_user_vaddr (va) && is_user_pte (pte) && (*pte & PTE_A)) {
+		*pte &= ~(uint64_t) PTE_A;
+		(*cnt)++;
+	}
+	return true;
+}
+
+/* Estimates T's working set as the number of its pages referenced
+ * since the last sample, and records it in T's spt. */
+void
+vm_sample_working_set (struct thread *t) {
+	size_t cnt = 0;
+
+	if (t->pml4 == NULL)
+		return;
+
+	pml4_for_each (t->pml4, sample_accessed_pte, &cnt);
+	/* The TLB may still hold entries with the accessed bit set,
+	 * which would keep the CPU from setting it again. */
+	if (rcr3 () == vtop (t->pml4))
+		pml4_activate (t->pml4);
+	t->spt.wss = cnt;
+}
 
-	return swap_in (page, frame->kva);
+/* Prints T's resident-set statistics.  Only done when an RSS limit
+ * was requested on the command line, so the output of the regular
+ * tests is left alone. */
+void
+vm_print_rss (struct thread *t) {
+	struct supplemental_page_table *spt = &t->spt;
+	int64_t elapsed;
+
+	if (vm_rss_limit == 0)
+		return;
+
+	vm_sample_working_set (t);
+	elapsed = timer_elapsed (spt->start_ticks);
+	printf ("%s: rss %zu pages (peak %zu, limit %zu), wss %zu pages, "
+			"%lld faults (%lld/s)\n",
+			t->name, spt->rss, spt->rss_peak, spt->rss_limit, spt->wss,
+			spt->fault_cnt,
+			spt->fault_cnt * TIMER_FREQ / (elapsed > 0 ? elapsed : 1));
+}
+
+/* Returns a hash value for page P. */
+static uint64_t
+page_hash (const struct hash_elem *p_, void *aux UNUSED) {
+	const struct page *p = hash_entry (p_, struct page, spt_elem);
+	return hash_bytes (&p->va, sizeof p->va);
+}
+
+/* Returns true if page A precedes page B. */
+static bool
+page_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct page *a = hash_entry (a_, struct page, spt_elem);
+	const struct page *b = hash_entry (b_, struct page, spt_elem);
+
+	return a->va < b->va;
 }
 
 /* Initialize new supplemental page table */
 void
-supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
+supplemental_page_table_init (struct supplemental_page_table *spt) {
+	hash_init (&spt->pages, page_hash, page_less, NULL);
+	spt->rss = spt->rss_peak = spt->wss = 0;
+	spt->rss_limit = vm_rss_limit;
+	spt->fault_cnt = 0;
+	spt->start_ticks = timer_ticks ();
 }
 
 /* Copy supplemental page table from src to dst */
@@ -182,9 +624,18 @@ supplemental_page_table_copy (struct supplemental_page_table *dst UNUSED,
 		struct supplemental_page_table *src UNUSED) {
 }
 
+/* Releases the frame of the page in hash element E and frees the
+ * page itself. */
+static void
+spt_destroy_page (struct hash_elem *e, void *aux UNUSED) {
+	struct page *page = hash_entry (e, struct page, spt_elem);
+
+	vm_free_frame (page);
+	vm_dealloc_page (page);
+}
+
 /* Free the resource hold by the supplemental page table */
 void
-supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
-	/* TODO: Destroy all the supplemental_page_table hold by thread and
-	 * TODO: writeback all the modified contents to the storage. */
+supplemental_page_table_kill (struct supplemental_page_table *spt) {
+	hash_destroy (&spt->pages, spt_destroy_page);
 }